@@ -0,0 +1,120 @@
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "admin.h"
+
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct admin {
+    pthread_t thread;
+    char* path;
+    int fd;
+    int stop_fd; // eventfd that wakes the thread up to stop
+    admin_handler_t handler;
+    void* arg;
+    char line[ADMIN_MAX_LINE + 1];
+    size_t used;
+    bool skipping; // the current line is too long, drop it up to the next newline
+};
+
+/**
+ * Passes every complete line in 'data' to the handler, keeps the start of an unfinished one
+ */
+static void handle_input(admin_t* admin, const char* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        char c = data[i];
+        if (c == '\n') {
+            if (!admin->skipping && admin->used > 0) {
+                admin->line[admin->used] = '\0';
+                admin->handler(admin->arg, admin->line);
+            }
+            admin->used = 0;
+            admin->skipping = false;
+        } else if (admin->used == ADMIN_MAX_LINE) {
+            admin->skipping = true;
+        } else if (!admin->skipping) {
+            admin->line[admin->used++] = c;
+        }
+    }
+}
+
+/**
+ * Reads what is in the FIFO right now
+ */
+static void drain(admin_t* admin) {
+    char data[512];
+    ssize_t size;
+    while ((size = read(admin->fd, data, sizeof(data))) > 0)
+        handle_input(admin, data, size);
+}
+
+static void* run_admin(void* _admin) {
+    admin_t* admin = _admin;
+    struct pollfd fds[] = {
+        {.fd = admin->fd, .events = POLLIN},
+        {.fd = admin->stop_fd, .events = POLLIN},
+    };
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            ASSERT_ELSE_PERROR(errno == EINTR);
+            continue;
+        }
+        if (fds[0].revents & POLLIN)
+            drain(admin);
+        if (fds[1].revents & POLLIN)
+            break;
+    }
+    // commands written right before the stop still count
+    drain(admin);
+    return NULL;
+}
+
+admin_t* admin_start(const char* path, admin_handler_t handler, void* arg) {
+    assert(path && handler);
+    if (mkfifo(path, 0600) != 0 && errno != EEXIST)
+        return NULL;
+    // read and write: the FIFO stays open when a writer closes it, so poll does not keep reporting the hang up
+    int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISFIFO(st.st_mode)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    admin_t* admin = calloc(1, sizeof(*admin));
+    assert(admin != NULL);
+    admin->path = strdup(path);
+    assert(admin->path != NULL);
+    admin->fd = fd;
+    admin->stop_fd = eventfd(0, EFD_CLOEXEC);
+    ASSERT_ELSE_PERROR(admin->stop_fd >= 0);
+    admin->handler = handler;
+    admin->arg = arg;
+    ASSERT_ELSE_PERROR(pthread_create(&admin->thread, NULL, run_admin, admin) == 0);
+    return admin;
+}
+
+void admin_stop(admin_t* admin) {
+    assert(admin);
+    ASSERT_ELSE_PERROR(eventfd_write(admin->stop_fd, 1) == 0);
+    ASSERT_ELSE_PERROR(pthread_join(admin->thread, NULL) == 0);
+    close(admin->stop_fd);
+    close(admin->fd);
+    unlink(admin->path);
+    free(admin->path);
+    free(admin);
+}
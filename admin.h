@@ -0,0 +1,37 @@
+#pragma once
+
+/**
+ * Admin channel of the server: a named pipe (FIFO) that takes one command per line while the server runs, e.g.
+ *   echo "sync full" > admin.fifo
+ * A background thread reads the lines and passes them to a handler, it never holds up the other threads.
+ * Lines that are longer than ADMIN_MAX_LINE are skipped.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+
+// longest command line, without the newline
+#ifndef ADMIN_MAX_LINE
+    #define ADMIN_MAX_LINE 255
+#endif
+
+typedef struct admin admin_t;
+
+/**
+ * Called on the admin thread for every command line, without the newline
+ */
+typedef void (*admin_handler_t)(void* arg, const char* command);
+
+/**
+ * Creates the FIFO 'path' (unless it exists already) and starts the thread that reads it
+ * \return the admin channel, or NULL if the FIFO can not be created or opened (errno tells why)
+ */
+admin_t* admin_start(const char* path, admin_handler_t handler, void* arg);
+
+/**
+ * Stops the thread, handles what is still in the FIFO, removes the FIFO and frees the channel
+ */
+void admin_stop(admin_t* admin);
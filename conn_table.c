@@ -0,0 +1,103 @@
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "conn_table.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+#define NO_SLOT UINT32_MAX
+
+typedef struct {
+    void* item; // NULL while the slot is free
+    // free slot: the next free slot, or NO_SLOT
+    // used slot: the index of the slot in 'active'
+    uint32_t link;
+} slot_t;
+
+struct conn_table {
+    slot_t* slots;
+    uint32_t* active; // the slot ids of the items, packed at the front
+    size_t size;
+    size_t capacity;
+    uint32_t free_head;
+};
+
+/**
+ * Makes room for 'capacity' slots, the new ones go on the free list
+ */
+static void grow(conn_table_t* table, size_t capacity) {
+    assert(capacity > table->capacity && capacity < NO_SLOT);
+    table->slots = realloc(table->slots, capacity * sizeof(*table->slots));
+    table->active = realloc(table->active, capacity * sizeof(*table->active));
+    assert(table->slots != NULL && table->active != NULL);
+    // pushed in reverse, so the lowest slot ids are handed out first
+    for (size_t slot = capacity; slot-- > table->capacity;) {
+        table->slots[slot].item = NULL;
+        table->slots[slot].link = table->free_head;
+        table->free_head = slot;
+    }
+    table->capacity = capacity;
+}
+
+conn_table_t* conn_table_create(size_t capacity) {
+    conn_table_t* table = malloc(sizeof(*table));
+    assert(table != NULL);
+    table->slots = NULL;
+    table->active = NULL;
+    table->size = 0;
+    table->capacity = 0;
+    table->free_head = NO_SLOT;
+    grow(table, capacity > 0 ? capacity : 1);
+    return table;
+}
+
+void conn_table_destroy(conn_table_t* table) {
+    assert(table);
+    free(table->slots);
+    free(table->active);
+    free(table);
+}
+
+uint32_t conn_table_add(conn_table_t* table, void* item) {
+    assert(table && item);
+    if (table->free_head == NO_SLOT)
+        grow(table, table->capacity * 2);
+    uint32_t slot = table->free_head;
+    table->free_head = table->slots[slot].link;
+    table->slots[slot].item = item;
+    table->slots[slot].link = table->size;
+    table->active[table->size++] = slot;
+    return slot;
+}
+
+void* conn_table_remove(conn_table_t* table, uint32_t slot) {
+    assert(table && slot < table->capacity && table->slots[slot].item != NULL);
+    void* item = table->slots[slot].item;
+    // the last active slot fills the gap
+    uint32_t index = table->slots[slot].link;
+    uint32_t last = table->active[--table->size];
+    table->active[index] = last;
+    table->slots[last].link = index;
+
+    table->slots[slot].item = NULL;
+    table->slots[slot].link = table->free_head;
+    table->free_head = slot;
+    return item;
+}
+
+void* conn_table_get(const conn_table_t* table, uint32_t slot) {
+    assert(table);
+    return slot < table->capacity ? table->slots[slot].item : NULL;
+}
+
+size_t conn_table_size(const conn_table_t* table) {
+    assert(table);
+    return table->size;
+}
+
+void* conn_table_at(const conn_table_t* table, size_t index) {
+    assert(table && index < table->size);
+    return table->slots[table->active[index]].item;
+}
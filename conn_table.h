@@ -0,0 +1,56 @@
+#pragma once
+
+/**
+ * Connection table: a slot array with a free list, so adding and removing a connection are O(1).
+ * Every item gets a slot id that stays the same until it is removed, a removed slot id is handed out again later.
+ * Next to the slots the table keeps the items densely packed, so iterating only visits active connections.
+ * The table stores pointers, growing it never moves the items themselves. Not thread safe: one table per thread.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct conn_table conn_table_t;
+
+/**
+ * \param capacity the number of slots to start with, the table doubles when it runs out
+ */
+conn_table_t* conn_table_create(size_t capacity);
+
+/**
+ * Frees the table, not the items that are still in it
+ */
+void conn_table_destroy(conn_table_t* table);
+
+/**
+ * Adds 'item', which must not be NULL
+ * \return the slot id of 'item'
+ */
+uint32_t conn_table_add(conn_table_t* table, void* item);
+
+/**
+ * Removes the item in slot 'slot', the last item in iteration order takes its place there
+ * \return the removed item
+ */
+void* conn_table_remove(conn_table_t* table, uint32_t slot);
+
+/**
+ * \return the item in slot 'slot', or NULL if the slot is free
+ */
+void* conn_table_get(const conn_table_t* table, uint32_t slot);
+
+/**
+ * \return the number of items in the table
+ */
+size_t conn_table_size(const conn_table_t* table);
+
+/**
+ * Iterates over the items: 'index' goes from 0 to conn_table_size - 1.
+ * To remove items while iterating, go from the back to the front.
+ * \return the item at 'index'
+ */
+void* conn_table_at(const conn_table_t* table, size_t index);
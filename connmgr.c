@@ -1,124 +1,776 @@
 #include "connmgr.h"
 
 #include "config.h"
+#include "conn_table.h"
 #include "lib/tcpsock.h"
-#include "lib/vector.h"
+#include "logger.h"
+#include "protocol.h"
 #include "sbuffer.h"
+#include "timer_wheel.h"
+#include "uring.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 #include <time.h>
 #include <unistd.h>
 
-void connmgr_listen(int port_number, sbuffer_t* buffer) {
+// maximum number of ready sockets handled per epoll_wait
+#define CONNMGR_MAX_EVENTS 64
+// epoll_wait wakes up at least this often to advance the timer wheel, whose ticks are seconds
+#define CONNMGR_TICK_MS 1000
+// connection slots a network thread starts with, the table doubles when they are all taken
+#define CONNMGR_TABLE_CAPACITY 64
+// bytes read per recv, a few hundred readings, and room for the largest message
+#define CONNMGR_RECV_BUFFER 4096
+_Static_assert(CONNMGR_RECV_BUFFER >= PROTOCOL_MAX_BATCH_SIZE, "a batch must fit in the input buffer");
+// submission slots of an io_uring, completions get four times as many
+#define CONNMGR_URING_ENTRIES 256
+// provided receive buffers of CONNMGR_RECV_BUFFER bytes per io_uring network thread, a power of two
+#define CONNMGR_URING_BUFFERS 256
+// io_uring user_data of the requests that do not belong to a connection, connections use their (aligned) address
+#define URING_ACCEPT 1
+#define URING_TICK 2
+#define URING_UDP 3
+// datagrams received per recvmmsg
+#define CONNMGR_UDP_BATCH 64
+// receive buffer of a UDP socket, datagrams that arrive while it is full are lost
+#define CONNMGR_UDP_RCVBUF (4 * 1024 * 1024)
+// a UDP batch at most this many readings behind the newest one arrived late instead of after a sensor restart
+#define CONNMGR_UDP_REORDER_WINDOW 4096
 
+// state shared by all network threads
+typedef struct {
+    int port_number;
+    sbuffer_t* buffer;
+    connmgr_backend_t backend;
+    bool udp;
+    // last time a socket of any thread had an event, the server stops TIMEOUT seconds after it
+    _Alignas(64) _Atomic time_t last_activity;
+    _Atomic bool stopping;
 #if DEBUG
-    const int fd =
-        open("sensor_data_recv", O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
-    assert(fd > 0);
+    pthread_mutex_t debug_mutex;
+    int debug_fd;
 #endif
+} connmgr_shared_t;
+
+// context of one sensor connection, comes back in epoll_data with every event
+typedef struct {
+    tcpsock_t* socket;
+    uint32_t slot; // in the connection table
+    timer_wheel_timer_t idle_timer;
+    bool closing; // given up on, io_uring still has to report the end of its recv before it can be freed
+    int version;  // protocol version, 0 until the first bytes are in
+    bool greeted; // version 2: the hello was answered
+    uint8_t flags; // version 2: what the handshake settled on
+    uint32_t next_sequence; // version 2 with PROTOCOL_FLAG_SEQUENCE: the sequence number the next batch should have
+    size_t used; // bytes in 'input', the start of a message that is not complete yet
+    uint8_t input[CONNMGR_RECV_BUFFER];
+} connection_t;
+
+// UDP state of one sensor id, the kernel hands all datagrams of a sensor to the same network thread
+typedef struct {
+    bool seen;
+    uint32_t next_sequence;
+    uint64_t lost;
+} udp_sensor_t;
+
+// the UDP socket of one network thread, with the buffers of one recvmmsg
+typedef struct {
+    tcpsock_t* socket;
+    struct mmsghdr messages[CONNMGR_UDP_BATCH];
+    struct iovec iovecs[CONNMGR_UDP_BATCH];
+    uint8_t datagrams[CONNMGR_UDP_BATCH][PROTOCOL_MAX_BATCH_SIZE];
+    udp_sensor_t sensors[UINT16_MAX + 1];
+} udp_receiver_t;
 
-    vector_t* sockets = vector_create();
+// one network thread: its own listener, event loop and connections, nothing in here is shared
+typedef struct {
+    connmgr_shared_t* shared;
+    pthread_t thread;
+    sbuffer_t* buffer;
+    int epoll_fd;
+    uring_t ring;
+    uring_buffers_t recv_buffers;
+    tcpsock_t* listener;
+    udp_receiver_t* udp; // NULL unless UDP is enabled
+    conn_table_t* connections;
+    // idle timeouts of the connections and of the server, in seconds
+    timer_wheel_t* timers;
+    timer_wheel_timer_t server_timer;
+    time_t last_activity; // copy of the last value this thread stored in 'shared'
+    connmgr_stats_t stats;
+    uint64_t* sensor_readings; // readings per sensor id, merged over the threads at the end
+} connmgr_t;
 
-    {
-        tcpsock_t* connection_socket = NULL;
-        if (tcp_passive_open(&connection_socket, port_number) != TCP_NO_ERROR)
-            exit(EXIT_FAILURE);
-        vector_add(sockets, connection_socket);
+static void connection_idle(void* _connmgr, void* _connection);
+
+static connection_t* connection_add(connmgr_t* connmgr, tcpsock_t* socket) {
+    connection_t* connection = malloc(sizeof(*connection));
+    assert(connection != NULL);
+    connection->socket = socket;
+    connection->closing = false;
+    connection->version = 0;
+    connection->greeted = false;
+    connection->flags = 0;
+    connection->next_sequence = 0;
+    connection->used = 0;
+    *tcp_last_seen(socket) = time(NULL);
+    // armed once, the timer only moves when it expires while the connection was active in between
+    timer_wheel_timer_init(&connection->idle_timer, connection_idle, connection);
+    timer_wheel_arm(connmgr->timers, &connection->idle_timer, *tcp_last_seen(socket) + TIMEOUT + 1);
+    connection->slot = conn_table_add(connmgr->connections, connection);
+    connmgr->stats.connections++;
+    return connection;
+}
+
+static void connection_close(connmgr_t* connmgr, connection_t* connection) {
+    conn_table_remove(connmgr->connections, connection->slot);
+    timer_wheel_cancel(connmgr->timers, &connection->idle_timer);
+    // closing the descriptor removes it from the epoll set as well
+    tcp_close(&connection->socket);
+    free(connection);
+}
+
+/**
+ * Ends a connection the server gives up on, after a timeout or a protocol error
+ */
+static void connection_abort(connmgr_t* connmgr, connection_t* connection) {
+    if (connmgr->shared->backend == CONNMGR_IO_URING) {
+        // the recv in flight still points at the connection, the shutdown makes it complete for the last time
+        shutdown(connection->socket->sd, SHUT_RDWR);
+        connection->closing = true;
+    } else {
+        connection_close(connmgr, connection);
     }
+}
+
+static void connection_disconnected(connmgr_t* connmgr, connection_t* connection) {
+    if (connection->used != 0)
+        logger_log(LOGGER_WARNING, LOGGER_CLASS_SENSOR, "Sensor with id %d left %zu bytes of an incomplete message\n", *tcp_last_seen_sensor_id(connection->socket), connection->used);
+    logger_log(LOGGER_INFO, LOGGER_CLASS_SENSOR, "Sensor with id %d disconnected\n", *tcp_last_seen_sensor_id(connection->socket));
+    connection_close(connmgr, connection);
+}
+
+static void accept_connections(connmgr_t* connmgr) {
+    // edge triggered: accept until the backlog is empty, the listener is non-blocking
+    tcpsock_t* new_socket = NULL;
+    while (tcp_wait_for_connection(connmgr->listener, &new_socket) == TCP_NO_ERROR) {
+        connection_t* connection = connection_add(connmgr, new_socket);
+        // reads never block, a partial reading just waits in 'input' for the rest
+        int flags = fcntl(new_socket->sd, F_GETFL);
+        ASSERT_ELSE_PERROR(flags != -1 && fcntl(new_socket->sd, F_SETFL, flags | O_NONBLOCK) == 0);
+        // registered once, the connection is the context that comes back with every event
+        struct epoll_event event = {
+            .events = EPOLLIN | EPOLLRDHUP | EPOLLET,
+            .data.ptr = connection,
+        };
+        ASSERT_ELSE_PERROR(epoll_ctl(connmgr->epoll_fd, EPOLL_CTL_ADD, new_socket->sd, &event) == 0);
+    }
+}
 
-    bool active = true;
-    struct pollfd* fds = NULL;
-    while (active) {
-        fds = realloc(fds, vector_size(sockets) * sizeof(*fds));
+/**
+ * Hands a reading that was decoded into 'reservation' to the consumers
+ */
+static void publish_reading(connmgr_t* connmgr, tcpsock_t* socket, sbuffer_reservation_t* reservation) {
+    sensor_data_t* data = reservation->data;
+    // NULL for a datagram, UDP sensors are announced by handle_datagram
+    if (socket != NULL) {
+        if (!socket->announced) {
+            logger_log(LOGGER_INFO, LOGGER_CLASS_SENSOR, "A new sensor with id = %" PRIu16 " has opened a new connection\n", data->id);
+            socket->announced = true;
+        }
+        *tcp_last_seen_sensor_id(socket) = data->id;
+    }
+    connmgr->stats.readings++;
+    connmgr->sensor_readings[data->id]++;
+#if DEBUG
+    connmgr_shared_t* shared = connmgr->shared;
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&shared->debug_mutex) == 0);
+    ASSERT_ELSE_PERROR(write(shared->debug_fd, &data->id, sizeof(data->id)) == sizeof(data->id));
+    ASSERT_ELSE_PERROR(write(shared->debug_fd, &data->value, sizeof(data->value)) == sizeof(data->value));
+    ASSERT_ELSE_PERROR(write(shared->debug_fd, &data->ts, sizeof(data->ts)) == sizeof(data->ts));
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&shared->debug_mutex) == 0);
+#endif
+    // log before the commit, afterwards the slot belongs to the consumers
+    logger_log(LOGGER_INFO, LOGGER_CLASS_READING, "sensor id = %" PRIu16 " - temperature = %g - timestamp = %ld\n", data->id, data->value, data->ts);
+    int ret = sbuffer_commit(connmgr->buffer, reservation);
+    // SBUFFER_DROPPED is fine, the overload policy already counted it
+    assert(ret != SBUFFER_FAILURE);
+}
+
+/**
+ * Decodes one version 1 reading straight into its slot in the sbuffer
+ */
+static void handle_frame(connmgr_t* connmgr, tcpsock_t* socket, const uint8_t* frame) {
+    sensor_id_t id;
+    memcpy(&id, frame, sizeof(id));
+    frame += sizeof(id);
+
+    sbuffer_reservation_t reservation;
+    sbuffer_reserve(connmgr->buffer, id, &reservation);
+    sensor_data_t* data = reservation.data;
+    memcpy(&data->value, frame, sizeof(data->value));
+    frame += sizeof(data->value);
+    memcpy(&data->ts, frame, sizeof(data->ts));
+    publish_reading(connmgr, socket, &reservation);
+}
+
+/**
+ * Decodes the readings of a version 2 batch straight into their slots in the sbuffer
+ */
+static void handle_batch(connmgr_t* connmgr, connection_t* connection, protocol_reader_t* reader) {
+    if (connection->flags & PROTOCOL_FLAG_SEQUENCE) {
+        // a sequence number from the past is a sensor that restarted its numbering, not a loss
+        if (reader->sequence - connection->next_sequence < UINT32_MAX / 2)
+            connmgr->stats.missing += reader->sequence - connection->next_sequence;
+        connection->next_sequence = reader->sequence + reader->count;
+    }
+    while (reader->count > 0) {
+        sbuffer_reservation_t reservation;
+        sbuffer_reserve(connmgr->buffer, reader->id, &reservation);
+        protocol_batch_next(reader, &reservation.data->value, &reservation.data->ts);
+        publish_reading(connmgr, connection->socket, &reservation);
+    }
+}
+
+/**
+ * Decodes a datagram, which holds exactly one batch, and keeps the loss accounting of its sensor
+ * \return false if it is not a valid batch
+ */
+static bool handle_datagram(connmgr_t* connmgr, const uint8_t* data, size_t length) {
+    protocol_reader_t reader;
+    if (protocol_batch_open(&reader, data, length, PROTOCOL_UDP_FLAGS) != (ssize_t) length)
+        return false;
+    udp_sensor_t* sensor = &connmgr->udp->sensors[reader.id];
+    uint32_t ahead = reader.sequence - sensor->next_sequence;
+    if (!sensor->seen) {
+        // whatever was sent before the first datagram that arrived is not counted
+        logger_log(LOGGER_INFO, LOGGER_CLASS_SENSOR, "A new sensor with id = %" PRIu16 " is sending over UDP\n", reader.id);
+        sensor->seen = true;
+        sensor->next_sequence = reader.sequence + reader.count;
+    } else if (ahead < UINT32_MAX / 2) {
+        sensor->lost += ahead;
+        sensor->next_sequence = reader.sequence + reader.count;
+    } else if (sensor->next_sequence - reader.sequence <= CONNMGR_UDP_REORDER_WINDOW) {
+        // overtaken by a later datagram, which counted these readings as lost
+        sensor->lost -= sensor->lost < reader.count ? sensor->lost : reader.count;
+    } else {
+        // the sensor restarted its numbering
+        sensor->next_sequence = reader.sequence + reader.count;
+    }
+    while (reader.count > 0) {
+        sbuffer_reservation_t reservation;
+        sbuffer_reserve(connmgr->buffer, reader.id, &reservation);
+        protocol_batch_next(&reader, &reservation.data->value, &reservation.data->ts);
+        publish_reading(connmgr, NULL, &reservation);
+    }
+    return true;
+}
 
-        for (size_t i = 0; i < vector_size(sockets); i++) {
-            tcpsock_t* socket = vector_at(sockets, i);
-            fds[i] = (struct pollfd){
-                .fd = socket->sd,
-                .events = POLLIN,
-            };
+/**
+ * Receives datagrams until the UDP socket is empty, many per system call
+ */
+static void receive_datagrams(connmgr_t* connmgr) {
+    udp_receiver_t* udp = connmgr->udp;
+    unsigned int count;
+    do {
+        count = CONNMGR_UDP_BATCH;
+        if (udp_receive_batch(udp->socket, udp->messages, &count) != TCP_NO_ERROR)
+            return;
+        for (unsigned int i = 0; i < count; i++) {
+            connmgr->stats.datagrams++;
+            // a datagram bigger than the buffer is cut off, MSG_TRUNC says so
+            if ((udp->messages[i].msg_hdr.msg_flags & MSG_TRUNC) || !handle_datagram(connmgr, udp->datagrams[i], udp->messages[i].msg_len))
+                connmgr->stats.bad_datagrams++;
         }
+        // recvmmsg without waiting only returns fewer datagrams than asked when the socket is empty
+    } while (count == CONNMGR_UDP_BATCH);
+}
+
+static udp_receiver_t* udp_receiver_create(int port) {
+    udp_receiver_t* udp = calloc(1, sizeof(*udp));
+    assert(udp != NULL);
+    if (udp_passive_open(&udp->socket, port) != TCP_NO_ERROR)
+        exit(EXIT_FAILURE);
+    // flooding sensors can fill the default buffer in a few milliseconds, the kernel caps this at net.core.rmem_max
+    int size = CONNMGR_UDP_RCVBUF;
+    ASSERT_ELSE_PERROR(setsockopt(udp->socket->sd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) == 0);
+    // recvmmsg only writes msg_len and msg_flags, the buffers are set up once
+    for (unsigned int i = 0; i < CONNMGR_UDP_BATCH; i++) {
+        udp->iovecs[i].iov_base = udp->datagrams[i];
+        udp->iovecs[i].iov_len = sizeof(udp->datagrams[i]);
+        udp->messages[i].msg_hdr.msg_iov = &udp->iovecs[i];
+        udp->messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    return udp;
+}
 
-        int n = poll(fds, vector_size(sockets), TIMEOUT * 1000);
-        assert(n != -1);
+static void udp_receiver_destroy(udp_receiver_t* udp) {
+    if (udp->socket != NULL)
+        tcp_close(&udp->socket);
+    free(udp);
+}
 
-        if (n == 0) {
-            // quit the connmgr (TIMEOUT was reached)
-            printf("No sensor data received after " TO_STRING(TIMEOUT) " seconds. Quitting server.\n");
-            active = false;
+/**
+ * Answers the version 2 handshake
+ * \return false if the client did not send a valid hello or could not be answered
+ */
+static bool handle_hello(connection_t* connection, const protocol_hello_t* hello) {
+    protocol_hello_t ack = protocol_negotiate(*hello);
+    uint8_t message[PROTOCOL_HELLO_SIZE];
+    protocol_encode_hello(message, ack);
+    // the send buffer of a new connection is empty, this never blocks
+    int bytes = sizeof(message);
+    if (tcp_send(connection->socket, message, &bytes) != TCP_NO_ERROR || bytes != sizeof(message))
+        return false;
+    connection->greeted = true;
+    connection->flags = ack.flags;
+    return true;
+}
+
+/**
+ * Handles every complete message at the start of 'data'
+ * \return the number of bytes handled, or -1 if the sensor broke the protocol
+ */
+static ssize_t handle_messages(connmgr_t* connmgr, connection_t* connection, const uint8_t* data, size_t length) {
+    if (connection->version == 0) {
+        connection->version = protocol_sniff(data, length);
+        if (connection->version == 0)
+            return 0;
+        if (connection->version == 1)
+            connmgr->stats.v1_connections++;
+    }
+
+    size_t offset = 0;
+    while (offset < length) {
+        const uint8_t* message = data + offset;
+        size_t available = length - offset;
+        ssize_t size;
+        if (connection->version == 1) {
+            if (available < PROTOCOL_V1_FRAME_SIZE)
+                break;
+            handle_frame(connmgr, connection->socket, message);
+            size = PROTOCOL_V1_FRAME_SIZE;
+        } else if (!connection->greeted) {
+            protocol_hello_t hello;
+            size = protocol_decode_hello(message, available, &hello);
+            if (size > 0 && !handle_hello(connection, &hello))
+                return -1;
         } else {
-            // loop over sockets
-            size_t size = vector_size(sockets); // cache up front because some sockets may get added
-            for (size_t i = 0; i < size; i++) {
-                tcpsock_t* socket = vector_at(sockets, i);
-                if (i != 0 && time(NULL) > *tcp_last_seen(socket) + TIMEOUT) {
-                    printf("Sensor with id %d timed out. \n", *tcp_last_seen_sensor_id(socket));
-                    tcp_close(&socket);
-                    vector_remove_at_index(sockets, i);
-                    break;
-                } else if ((fds[i].revents & POLLIN) != 0) {
-                    *tcp_last_seen(socket) = time(NULL);
-                    if (i == 0) { // a new sensor is connected
-                        tcpsock_t* new_socket = NULL;
-                        tcp_wait_for_connection(socket, &new_socket);
-                        // this does not invalidate our loop since we only iterate over the original sockets
-                        vector_add(sockets, new_socket);
-                    } else { // data from existing connection is obtained
-                        sensor_data_t data;
-                        int bytes = sizeof(data.id);
-                        tcp_receive(socket, &data.id, &bytes);
-
-                        bytes = sizeof(data.value);
-                        tcp_receive(socket, &data.value, &bytes);
-
-                        bytes = sizeof(data.ts);
-                        const int result = tcp_receive(socket, &data.ts, &bytes);
-
-                        if (!socket->announced) {
-                            printf("A new sensor with id = %" PRIu16 " has opened a new connection\n", data.id);
-                            socket->announced = true;
-                        }
-
-                        if ((result == TCP_NO_ERROR) && bytes) {
-                            *tcp_last_seen_sensor_id(socket) = data.id;
-#if DEBUG
-                            ASSERT_ELSE_PERROR(write(fd, &data.id, sizeof(data.id)) == sizeof(data.id));
-                            ASSERT_ELSE_PERROR(write(fd, &data.value, sizeof(data.value)) == sizeof(data.value));
-                            ASSERT_ELSE_PERROR(write(fd, &data.ts, sizeof(data.ts)) == sizeof(data.ts));
-#endif
-                            printf("sensor id = %" PRIu16 " - temperature = %g - timestamp = %ld\n", data.id, data.value, data.ts);
-                            // sbuffer_lock(buffer);
-                            int ret = sbuffer_insert_first(buffer, &data);
-                            assert(ret == SBUFFER_SUCCESS);
-                            // sbuffer_unlock(buffer);
-                        } else if (result == TCP_CONNECTION_CLOSED) {
-                            printf("Sensor with id %" PRIu16 " disconnected\n", *tcp_last_seen_sensor_id(socket));
-                            tcp_close(&socket);
-                            vector_remove_at_index(sockets, i);
-                            break;
-                        }
-                    }
+            protocol_reader_t reader;
+            size = protocol_batch_open(&reader, message, available, connection->flags);
+            if (size > 0)
+                handle_batch(connmgr, connection, &reader);
+        }
+        if (size < 0)
+            return -1;
+        if (size == 0)
+            break;
+        offset += size;
+    }
+    return offset;
+}
+
+static void protocol_error(connmgr_t* connmgr, connection_t* connection) {
+    logger_log(LOGGER_WARNING, LOGGER_CLASS_SENSOR, "Sensor with id %d broke the protocol, closing its connection\n", *tcp_last_seen_sensor_id(connection->socket));
+    connection_abort(connmgr, connection);
+}
+
+/**
+ * Handles every complete message in the input buffer and keeps the partial one at the start
+ * \return false if the sensor broke the protocol
+ */
+static bool handle_input(connmgr_t* connmgr, connection_t* connection) {
+    ssize_t handled = handle_messages(connmgr, connection, connection->input, connection->used);
+    if (handled < 0)
+        return false;
+    connection->used -= handled;
+    memmove(connection->input, connection->input + handled, connection->used);
+    return true;
+}
+
+/**
+ * Handles 'length' received bytes that are not in the input buffer, only a message that is cut off is copied
+ * \return false if the sensor broke the protocol
+ */
+static bool handle_received(connmgr_t* connmgr, connection_t* connection, const uint8_t* data, size_t length) {
+    // first complete the message the previous chunk ended with
+    while (connection->used != 0 && length > 0) {
+        size_t n = sizeof(connection->input) - connection->used;
+        if (n > length)
+            n = length;
+        memcpy(connection->input + connection->used, data, n);
+        connection->used += n;
+        data += n;
+        length -= n;
+        size_t before = connection->used;
+        if (!handle_input(connmgr, connection))
+            return false;
+        // the buffer is big enough for any message, a full buffer that makes no progress is garbage
+        if (connection->used == before && before == sizeof(connection->input))
+            return false;
+    }
+    // the whole chunk went into the input buffer and still ends in a cut off message
+    if (connection->used != 0)
+        return true;
+    ssize_t handled = handle_messages(connmgr, connection, data, length);
+    if (handled < 0)
+        return false;
+    memcpy(connection->input, data + handled, length - handled);
+    connection->used = length - handled;
+    return true;
+}
+
+static void handle_readable(connmgr_t* connmgr, connection_t* connection, uint32_t events) {
+    bool hang_up = (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0;
+    while (true) {
+        int space = sizeof(connection->input) - connection->used;
+        int bytes = space;
+        int result = tcp_receive(connection->socket, connection->input + connection->used, &bytes);
+        if (result == TCP_SOCKOP_ERROR && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return; // drained, the next data gives a new edge
+        if (result != TCP_NO_ERROR)
+            break;
+        connection->used += bytes;
+        // the buffer is big enough for any message, a full buffer that makes no progress is garbage
+        if (!handle_input(connmgr, connection) || connection->used == sizeof(connection->input)) {
+            protocol_error(connmgr, connection);
+            return;
+        }
+        // edge triggered: a short read means the socket was empty at that moment, so new data gives a new edge.
+        // After a hang-up keep reading until recv reports the end of the stream.
+        if (!hang_up && bytes < space)
+            return;
+    }
+    connection_disconnected(connmgr, connection);
+}
+
+static void connection_idle(void* _connmgr, void* _connection) {
+    connmgr_t* connmgr = _connmgr;
+    connection_t* connection = _connection;
+    time_t deadline = *tcp_last_seen(connection->socket) + TIMEOUT;
+    // an event only updates 'last_seen', the timer catches up here
+    if ((time_t) timer_wheel_now(connmgr->timers) <= deadline) {
+        timer_wheel_arm(connmgr->timers, &connection->idle_timer, deadline + 1);
+        return;
+    }
+    logger_log(LOGGER_INFO, LOGGER_CLASS_SENSOR, "Sensor with id %d timed out. \n", *tcp_last_seen_sensor_id(connection->socket));
+    connmgr->stats.timed_out++;
+    connection_abort(connmgr, connection);
+}
+
+static void mark_activity(connmgr_t* connmgr, time_t now) {
+    // at most one store per second per thread on the shared cache line
+    if (now == connmgr->last_activity)
+        return;
+    connmgr->last_activity = now;
+    connmgr_shared_t* shared = connmgr->shared;
+    time_t last = atomic_load_explicit(&shared->last_activity, memory_order_relaxed);
+    while (last < now && !atomic_compare_exchange_weak_explicit(&shared->last_activity, &last, now,
+                                                                memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+/**
+ * Stops every thread once no thread had an event for TIMEOUT seconds
+ */
+static void server_idle(void* _connmgr, void* arg) {
+    (void) arg;
+    connmgr_t* connmgr = _connmgr;
+    connmgr_shared_t* shared = connmgr->shared;
+    time_t deadline = atomic_load_explicit(&shared->last_activity, memory_order_relaxed) + TIMEOUT;
+    if ((time_t) timer_wheel_now(connmgr->timers) <= deadline) {
+        timer_wheel_arm(connmgr->timers, &connmgr->server_timer, deadline + 1);
+        return;
+    }
+    // only the first thread that notices reports it
+    if (!atomic_exchange(&shared->stopping, true))
+        logger_log(LOGGER_INFO, LOGGER_CLASS_SERVER, "No sensor data received after " TO_STRING(TIMEOUT) " seconds. Quitting server.\n");
+}
+
+static void run_epoll_loop(connmgr_t* connmgr) {
+    connmgr_shared_t* shared = connmgr->shared;
+    connmgr->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    ASSERT_ELSE_PERROR(connmgr->epoll_fd >= 0);
+    // the listener and the UDP socket are the only sockets without a connection context
+    struct epoll_event listen_event = {
+        .events = EPOLLIN | EPOLLET,
+        .data.ptr = NULL,
+    };
+    ASSERT_ELSE_PERROR(epoll_ctl(connmgr->epoll_fd, EPOLL_CTL_ADD, connmgr->listener->sd, &listen_event) == 0);
+    if (connmgr->udp != NULL) {
+        struct epoll_event udp_event = {
+            .events = EPOLLIN | EPOLLET,
+            .data.ptr = connmgr->udp,
+        };
+        ASSERT_ELSE_PERROR(epoll_ctl(connmgr->epoll_fd, EPOLL_CTL_ADD, connmgr->udp->socket->sd, &udp_event) == 0);
+    }
+
+    struct epoll_event events[CONNMGR_MAX_EVENTS];
+    while (!atomic_load_explicit(&shared->stopping, memory_order_relaxed)) {
+        int n = epoll_wait(connmgr->epoll_fd, events, CONNMGR_MAX_EVENTS, CONNMGR_TICK_MS);
+        ASSERT_ELSE_PERROR(n != -1 || errno == EINTR);
+
+        time_t now = time(NULL);
+        // only the sockets that are ready, no matter how many connections there are
+        for (int i = 0; i < n; i++) {
+            connection_t* connection = events[i].data.ptr;
+            mark_activity(connmgr, now);
+            if (connection == NULL) { // a new sensor is connected
+                accept_connections(connmgr);
+            } else if (events[i].data.ptr == connmgr->udp) { // datagrams are waiting
+                receive_datagrams(connmgr);
+            } else { // data from existing connection is obtained
+                *tcp_last_seen(connection->socket) = now;
+                handle_readable(connmgr, connection, events[i].events);
+            }
+        }
+
+        // only the timers that expire are touched, at most once per second
+        timer_wheel_advance(connmgr->timers, now);
+    }
+    close(connmgr->epoll_fd);
+}
+
+static void uring_recv(connmgr_t* connmgr, connection_t* connection) {
+    uring_prep_multishot_recv(uring_get_sqe(&connmgr->ring), connection->socket->sd, connmgr->recv_buffers.group, (uint64_t) (uintptr_t) connection);
+}
+
+static void uring_accepted(connmgr_t* connmgr, struct io_uring_cqe* cqe) {
+    // a multishot accept stops on errors such as running out of descriptors, it is simply started again
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        uring_prep_multishot_accept(uring_get_sqe(&connmgr->ring), connmgr->listener->sd, URING_ACCEPT);
+    if (cqe->res < 0)
+        return;
+    tcpsock_t* new_socket = NULL;
+    if (tcp_adopt_connection(connmgr->listener, cqe->res, &new_socket) != TCP_NO_ERROR) {
+        close(cqe->res);
+        return;
+    }
+    uring_recv(connmgr, connection_add(connmgr, new_socket));
+}
+
+static void uring_received(connmgr_t* connmgr, connection_t* connection, struct io_uring_cqe* cqe, time_t now) {
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    if (cqe->res > 0) {
+        uint16_t id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (!connection->closing) {
+            *tcp_last_seen(connection->socket) = now;
+            if (!handle_received(connmgr, connection, uring_buffer(&connmgr->recv_buffers, id), cqe->res))
+                protocol_error(connmgr, connection);
+        }
+        // the readings are in the sbuffer now, the kernel can have the buffer back right away
+        uring_buffer_recycle(&connmgr->recv_buffers, id);
+    }
+    if (more)
+        return;
+    // the recv ended: the sensor closed, an error, or the kernel ran out of buffers or wanted a break
+    if (connection->closing) {
+        connection_close(connmgr, connection);
+    } else if (cqe->res > 0 || cqe->res == -ENOBUFS) {
+        uring_recv(connmgr, connection);
+    } else {
+        connection_disconnected(connmgr, connection);
+    }
+}
+
+static void run_uring_loop(connmgr_t* connmgr) {
+    connmgr_shared_t* shared = connmgr->shared;
+    uring_t* ring = &connmgr->ring;
+    // uring_supported already checked the kernel, failing here is a resource problem
+    ASSERT_ELSE_PERROR(uring_init(ring, CONNMGR_URING_ENTRIES) == 0);
+    ASSERT_ELSE_PERROR(uring_buffers_init(ring, &connmgr->recv_buffers, 0, CONNMGR_URING_BUFFERS, CONNMGR_RECV_BUFFER) == 0);
+
+    uring_prep_multishot_accept(uring_get_sqe(ring), connmgr->listener->sd, URING_ACCEPT);
+    // datagrams are few and small enough to receive with recvmmsg once the socket is readable
+    if (connmgr->udp != NULL)
+        uring_prep_multishot_poll(uring_get_sqe(ring), connmgr->udp->socket->sd, POLLIN, URING_UDP);
+    // wakes the loop up when nothing happens, like the epoll_wait timeout
+    struct __kernel_timespec tick = {
+        .tv_sec = CONNMGR_TICK_MS / 1000,
+        .tv_nsec = (CONNMGR_TICK_MS % 1000) * 1000000L,
+    };
+    uring_prep_timeout(uring_get_sqe(ring), &tick, URING_TICK);
+
+    struct io_uring_cqe* cqes[CONNMGR_MAX_EVENTS];
+    while (!atomic_load_explicit(&shared->stopping, memory_order_relaxed)) {
+        // one system call submits every new request and waits for completions
+        int ret = uring_submit_and_wait(ring, 1);
+        ASSERT_ELSE_PERROR(ret >= 0 || ret == -EINTR || ret == -EBUSY);
+
+        time_t now = time(NULL);
+        unsigned n;
+        while ((n = uring_peek_batch(ring, cqes, CONNMGR_MAX_EVENTS)) > 0) {
+            for (unsigned i = 0; i < n; i++) {
+                struct io_uring_cqe* cqe = cqes[i];
+                if (cqe->user_data == URING_TICK) {
+                    uring_prep_timeout(uring_get_sqe(ring), &tick, URING_TICK);
+                    continue;
+                }
+                mark_activity(connmgr, now);
+                if (cqe->user_data == URING_ACCEPT) {
+                    uring_accepted(connmgr, cqe);
+                } else if (cqe->user_data == URING_UDP) {
+                    if (!(cqe->flags & IORING_CQE_F_MORE))
+                        uring_prep_multishot_poll(uring_get_sqe(ring), connmgr->udp->socket->sd, POLLIN, URING_UDP);
+                    receive_datagrams(connmgr);
+                } else {
+                    uring_received(connmgr, (connection_t*) (uintptr_t) cqe->user_data, cqe, now);
                 }
             }
+            uring_cq_advance(ring, n);
         }
+
+        timer_wheel_advance(connmgr->timers, now);
+    }
+    // cancels every request, so nothing points at the connections or buffers anymore
+    uring_exit(ring);
+    uring_buffers_free(ring, &connmgr->recv_buffers);
+}
+
+static void* run_network_thread(void* _connmgr) {
+    connmgr_t* connmgr = _connmgr;
+    connmgr_shared_t* shared = connmgr->shared;
+    connmgr->buffer = shared->buffer;
+    connmgr->connections = conn_table_create(CONNMGR_TABLE_CAPACITY);
+    connmgr->last_activity = atomic_load(&shared->last_activity);
+    connmgr->timers = timer_wheel_create(time(NULL), connmgr);
+    timer_wheel_timer_init(&connmgr->server_timer, server_idle, NULL);
+    timer_wheel_arm(connmgr->timers, &connmgr->server_timer, connmgr->last_activity + TIMEOUT + 1);
+    connmgr->sensor_readings = calloc((size_t) UINT16_MAX + 1, sizeof(*connmgr->sensor_readings));
+    assert(connmgr->sensor_readings != NULL);
+
+    // every thread has its own listener on the same port, the kernel spreads the connections over them
+    if (tcp_passive_open_shared(&connmgr->listener, shared->port_number) != TCP_NO_ERROR)
+        exit(EXIT_FAILURE);
+    int flags = fcntl(connmgr->listener->sd, F_GETFL);
+    ASSERT_ELSE_PERROR(flags != -1 && fcntl(connmgr->listener->sd, F_SETFL, flags | O_NONBLOCK) == 0);
+    // the same goes for the UDP sockets, with the sender's address instead of a connection
+    if (shared->udp)
+        connmgr->udp = udp_receiver_create(shared->port_number);
+
+    if (shared->backend == CONNMGR_IO_URING)
+        run_uring_loop(connmgr);
+    else
+        run_epoll_loop(connmgr);
+
+    for (size_t i = 0; i < conn_table_size(connmgr->connections); i++) {
+        connection_t* connection = conn_table_at(connmgr->connections, i);
+        tcp_close(&connection->socket);
+        free(connection);
     }
-    free(fds);
+    conn_table_destroy(connmgr->connections);
+    timer_wheel_destroy(connmgr->timers);
+    tcp_close(&connmgr->listener);
+    // the rest of the UDP state holds the per sensor losses, which are merged at the end like the readings
+    if (connmgr->udp != NULL)
+        tcp_close(&connmgr->udp->socket);
+    return NULL;
+}
+
+bool connmgr_backend_from_string(const char* name, connmgr_backend_t* backend) {
+    for (connmgr_backend_t i = CONNMGR_EPOLL; i <= CONNMGR_IO_URING; i++) {
+        if (strcmp(name, connmgr_backend_to_string(i)) == 0) {
+            *backend = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* connmgr_backend_to_string(connmgr_backend_t backend) {
+    static const char* const names[] = {
+        [CONNMGR_EPOLL] = "epoll",
+        [CONNMGR_IO_URING] = "io_uring",
+    };
+    assert(backend <= CONNMGR_IO_URING);
+    return names[backend];
+}
+
+void connmgr_listen(int port_number, sbuffer_t* buffer) {
+    connmgr_config_t config = CONNMGR_DEFAULT_CONFIG;
+    connmgr_listen_with_config(port_number, buffer, &config, NULL);
+}
+
+void connmgr_listen_with_config(int port_number, sbuffer_t* buffer, const connmgr_config_t* config, connmgr_stats_t* stats) {
+    assert(buffer && config && config->threads > 0);
+    connmgr_shared_t shared = {
+        .port_number = port_number,
+        .buffer = buffer,
+        .backend = config->backend,
+        .udp = config->udp,
+        .last_activity = time(NULL),
+        .stopping = false,
+    };
+
+    if (shared.backend == CONNMGR_IO_URING && !uring_supported()) {
+        logger_log(LOGGER_WARNING, LOGGER_CLASS_SERVER, "This kernel does not support multishot io_uring receives, using epoll instead\n");
+        shared.backend = CONNMGR_EPOLL;
+    }
+
 #if DEBUG
-    close(fd);
+    ASSERT_ELSE_PERROR(pthread_mutex_init(&shared.debug_mutex, NULL) == 0);
+    shared.debug_fd = open("sensor_data_recv", O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+    assert(shared.debug_fd > 0);
 #endif
 
-    for (size_t i = 0; i < vector_size(sockets); i++) {
-        tcpsock_t* socket = vector_at(sockets, i);
-        tcp_close(&socket);
+    connmgr_t* connmgrs = calloc(config->threads, sizeof(*connmgrs));
+    assert(connmgrs != NULL);
+    for (unsigned i = 0; i < config->threads; i++)
+        connmgrs[i].shared = &shared;
+    // the calling thread is network thread 0
+    for (unsigned i = 1; i < config->threads; i++)
+        ASSERT_ELSE_PERROR(pthread_create(&connmgrs[i].thread, NULL, run_network_thread, &connmgrs[i]) == 0);
+    run_network_thread(&connmgrs[0]);
+    for (unsigned i = 1; i < config->threads; i++)
+        ASSERT_ELSE_PERROR(pthread_join(connmgrs[i].thread, NULL) == 0);
+
+    // a sensor can have reconnected to another thread, so the per sensor counts are only merged now
+    connmgr_stats_t total = {.threads = config->threads, .backend = shared.backend};
+    for (unsigned i = 0; i < config->threads; i++) {
+        total.connections += connmgrs[i].stats.connections;
+        total.timed_out += connmgrs[i].stats.timed_out;
+        total.readings += connmgrs[i].stats.readings;
+        total.v1_connections += connmgrs[i].stats.v1_connections;
+        total.missing += connmgrs[i].stats.missing;
+        total.datagrams += connmgrs[i].stats.datagrams;
+        total.bad_datagrams += connmgrs[i].stats.bad_datagrams;
+    }
+    for (size_t id = 0; id <= UINT16_MAX; id++) {
+        uint64_t readings = 0, lost = 0;
+        for (unsigned i = 0; i < config->threads; i++) {
+            readings += connmgrs[i].sensor_readings[id];
+            if (connmgrs[i].udp != NULL)
+                lost += connmgrs[i].udp->sensors[id].lost;
+        }
+        if (readings > 0)
+            total.sensors++;
+        if (lost > 0)
+            logger_log(LOGGER_WARNING, LOGGER_CLASS_SERVER, "Sensor with id %zu lost %" PRIu64 " readings over UDP\n", id, lost);
+        total.missing += lost;
     }
-    vector_destroy(sockets);
+    if (stats != NULL)
+        *stats = total;
+
+    for (unsigned i = 0; i < config->threads; i++) {
+        free(connmgrs[i].sensor_readings);
+        if (connmgrs[i].udp != NULL)
+            udp_receiver_destroy(connmgrs[i].udp);
+    }
+    free(connmgrs);
+#if DEBUG
+    close(shared.debug_fd);
+    ASSERT_ELSE_PERROR(pthread_mutex_destroy(&shared.debug_mutex) == 0);
+#endif
 }
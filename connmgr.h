@@ -8,15 +8,64 @@
 #include "lib/tcpsock.h"
 #include "sbuffer.h"
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+/**
+ * How a network thread waits for its sockets
+ */
+typedef enum {
+    CONNMGR_EPOLL,    // readiness with edge-triggered epoll, then non-blocking recv
+    CONNMGR_IO_URING, // multishot accept and recv into provided buffer rings, falls back to epoll if the kernel lacks them
+} connmgr_backend_t;
+
+typedef struct {
+    unsigned threads; // network threads, each with its own listener (SO_REUSEPORT), event loop and connections
+    connmgr_backend_t backend;
+    bool udp; // every network thread also receives version 2 batches as UDP datagrams on the same port
+} connmgr_config_t;
+
+#define CONNMGR_DEFAULT_CONFIG ((connmgr_config_t){.threads = 1, .backend = CONNMGR_EPOLL, .udp = false})
+
+typedef struct {
+    unsigned threads;
+    connmgr_backend_t backend; // the backend that actually ran, after a possible fallback
+    uint64_t connections;      // connections accepted
+    uint64_t v1_connections;   // connections that used protocol version 1
+    uint64_t timed_out;        // connections closed because the sensor was silent for TIMEOUT seconds
+    uint64_t readings;         // readings received
+    uint64_t missing;          // readings that never arrived according to the protocol version 2 sequence numbers, TCP and UDP
+    uint64_t datagrams;        // UDP datagrams received
+    uint64_t bad_datagrams;    // UDP datagrams that did not hold exactly one valid batch
+    unsigned sensors;          // distinct sensor ids that sent at least one reading
+} connmgr_stats_t;
+
+/**
+ * Looks up a backend by its command line name: epoll or io_uring
+ * \return false if 'name' is not a backend
+ */
+bool connmgr_backend_from_string(const char* name, connmgr_backend_t* backend);
+
+/**
+ * \return the command line name of 'backend'
+ */
+const char* connmgr_backend_to_string(connmgr_backend_t backend);
+
 /*
     This method holds the core functionality of the connmgr.
     It starts listening on the given port and when when a sensor
     node connects it writes the data to a sensor_data_recv file.
 */
 void connmgr_listen(int port_number, sbuffer_t* buffer);
+
+/*
+    Same as connmgr_listen, but spreads the connections over 'config->threads' network threads.
+    The calling thread is one of them. Returns once no thread received anything for TIMEOUT seconds,
+    'stats' (if not NULL) is then filled out with the totals over all threads.
+*/
+void connmgr_listen_with_config(int port_number, sbuffer_t* buffer, const connmgr_config_t* config, connmgr_stats_t* stats);
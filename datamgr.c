@@ -5,6 +5,7 @@
 #include "datamgr.h"
 
 #include "lib/vector.h"
+#include "logger.h"
 
 #include <assert.h>
 #include <errno.h>
@@ -67,7 +68,7 @@ void datamgr_init() {
 void datamgr_process_reading(const sensor_data_t* data) {
     sensor_t* obtained_sensor = datamgr_find_sensor(data->id);
     if (!obtained_sensor) { // sensor with id not found
-        printf("Received sensor data with new sensor node id %d \n", data->id);
+        logger_log(LOGGER_INFO, LOGGER_CLASS_SENSOR, "Received sensor data with new sensor node id %d \n", data->id);
         // put new sensor in sensor list
         obtained_sensor = calloc(1, sizeof(*obtained_sensor)); // initialize to zero
         obtained_sensor->sensor_id = data->id;
@@ -81,10 +82,10 @@ void datamgr_process_reading(const sensor_data_t* data) {
     sensor_value_t running_average = sensor_running_average(obtained_sensor);
     if (obtained_sensor->count >= RUN_AVG_LENGTH) {
         if (running_average < SET_MIN_TEMP) {
-            printf(BOLD RED "Sensor %" PRIu16 " read a temperature value (%f) lower than " TO_STRING(SET_MIN_TEMP) "\n" RESET, data->id, data->value);
+            logger_log(LOGGER_WARNING, LOGGER_CLASS_ALERT, BOLD RED "Sensor %" PRIu16 " read a temperature value (%f) lower than " TO_STRING(SET_MIN_TEMP) "\n" RESET, data->id, data->value);
         }
         if (running_average > SET_MAX_TEMP) {
-            printf(BOLD RED "Sensor %" PRIu16 " read a temperature value (%f) higher than " TO_STRING(SET_MAX_TEMP) "\n" RESET, data->id, data->value);
+            logger_log(LOGGER_WARNING, LOGGER_CLASS_ALERT, BOLD RED "Sensor %" PRIu16 " read a temperature value (%f) higher than " TO_STRING(SET_MAX_TEMP) "\n" RESET, data->id, data->value);
         }
     }
 }
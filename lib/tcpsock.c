@@ -12,6 +12,8 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -53,7 +55,7 @@
 
 static tcpsock_t* tcp_sock_create();
 
-int tcp_passive_open(tcpsock_t** sock, int port) {
+static int passive_open(tcpsock_t** sock, int port, bool shared) {
     int result;
     struct sockaddr_in addr;
     TCP_ERR_HANDLER(((port < MIN_PORT) || (port > MAX_PORT)), return TCP_ADDRESS_ERROR);
@@ -62,6 +64,12 @@ int tcp_passive_open(tcpsock_t** sock, int port) {
     s->sd = socket(PROTOCOLFAMILY, TYPE, PROTOCOL);
     TCP_DEBUG_PRINTF(s->sd < 0, "Socket() failed with errno = %d [%s]", errno, strerror(errno));
     TCP_ERR_HANDLER(s->sd < 0, free(s); return TCP_SOCKOP_ERROR);
+    if (shared) {
+        int on = 1;
+        result = setsockopt(s->sd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+        TCP_DEBUG_PRINTF(result == -1, "Setsockopt() failed with errno = %d [%s]", errno, strerror(errno));
+        TCP_ERR_HANDLER(result != 0, close(s->sd); free(s); return TCP_SOCKOP_ERROR);
+    }
     // Construct the server address structure
     memset(&addr, 0, sizeof(struct sockaddr_in));
     addr.sin_family = PROTOCOLFAMILY;
@@ -80,6 +88,67 @@ int tcp_passive_open(tcpsock_t** sock, int port) {
     return TCP_NO_ERROR;
 }
 
+int tcp_passive_open(tcpsock_t** sock, int port) {
+    return passive_open(sock, port, false);
+}
+
+int tcp_passive_open_shared(tcpsock_t** sock, int port) {
+    return passive_open(sock, port, true);
+}
+
+int udp_passive_open(tcpsock_t** sock, int port) {
+    int result, on = 1;
+    struct sockaddr_in addr;
+    TCP_ERR_HANDLER(((port < MIN_PORT) || (port > MAX_PORT)), return TCP_ADDRESS_ERROR);
+    tcpsock_t* s = tcp_sock_create();
+    TCP_ERR_HANDLER(s == NULL, return TCP_MEMORY_ERROR);
+    s->sd = socket(PROTOCOLFAMILY, SOCK_DGRAM, IPPROTO_UDP);
+    TCP_DEBUG_PRINTF(s->sd < 0, "Socket() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(s->sd < 0, free(s); return TCP_SOCKOP_ERROR);
+    // the kernel hashes the sender's address, so all datagrams of one sensor end up at the same socket
+    result = setsockopt(s->sd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    TCP_DEBUG_PRINTF(result == -1, "Setsockopt() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(result != 0, close(s->sd); free(s); return TCP_SOCKOP_ERROR);
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = PROTOCOLFAMILY;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    result = bind(s->sd, (struct sockaddr*) &addr, sizeof(addr));
+    TCP_DEBUG_PRINTF(result == -1, "Bind() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(result != 0, close(s->sd); free(s); return TCP_SOCKOP_ERROR);
+    s->ip_addr = NULL; // address set to INADDR_ANY - not a specific IP address
+    s->port = port;
+    s->cookie = MAGIC_COOKIE;
+    *sock = s;
+    return TCP_NO_ERROR;
+}
+
+int udp_active_open(tcpsock_t** sock, int remote_port, char* remote_ip) {
+    struct sockaddr_in addr;
+    int result;
+    TCP_ERR_HANDLER(((remote_port < MIN_PORT) || (remote_port > MAX_PORT)), return TCP_ADDRESS_ERROR);
+    TCP_ERR_HANDLER(remote_ip == NULL, return TCP_ADDRESS_ERROR);
+    tcpsock_t* client = tcp_sock_create();
+    TCP_ERR_HANDLER(client == NULL, return TCP_MEMORY_ERROR);
+    client->sd = socket(PROTOCOLFAMILY, SOCK_DGRAM, IPPROTO_UDP);
+    TCP_DEBUG_PRINTF(client->sd < 0, "Socket() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(client->sd < 0, free(client); return TCP_SOCKOP_ERROR);
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = PROTOCOLFAMILY;
+    result = inet_aton(remote_ip, (struct in_addr*) &addr.sin_addr.s_addr);
+    TCP_ERR_HANDLER(result == 0, close(client->sd); free(client); return TCP_ADDRESS_ERROR);
+    addr.sin_port = htons(remote_port);
+    // only sets the default destination, no packet is sent
+    result = connect(client->sd, (struct sockaddr*) &addr, sizeof(addr));
+    TCP_DEBUG_PRINTF(result == -1, "Connect() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(result != 0, close(client->sd); free(client); return TCP_SOCKOP_ERROR);
+    client->ip_addr = NULL;
+    client->port = remote_port;
+    client->cookie = MAGIC_COOKIE;
+    *sock = client;
+    return TCP_NO_ERROR;
+}
+
 int tcp_active_open(tcpsock_t** sock, int remote_port, char* remote_ip) {
     struct sockaddr_in addr;
     tcpsock_t* client;
@@ -110,13 +179,51 @@ int tcp_active_open(tcpsock_t** sock, int remote_port, char* remote_ip) {
     p = inet_ntoa(addr.sin_addr); // returns addr to statically allocated buffer
     client->ip_addr = (char*) malloc(sizeof(char) * CHAR_IP_ADDR_LENGTH);
     TCP_ERR_HANDLER(client->ip_addr == NULL, free(client); return TCP_MEMORY_ERROR);
-    client->ip_addr = strncpy(client->ip_addr, p, CHAR_IP_ADDR_LENGTH);
+    snprintf(client->ip_addr, CHAR_IP_ADDR_LENGTH, "%s", p);
     client->port = ntohs(addr.sin_port);
     client->cookie = MAGIC_COOKIE;
     *sock = client;
     return TCP_NO_ERROR;
 }
 
+int tcp_start_connect(tcpsock_t** sock, int remote_port, char* remote_ip) {
+    struct sockaddr_in addr;
+    int result;
+    TCP_ERR_HANDLER(((remote_port < MIN_PORT) || (remote_port > MAX_PORT)), return TCP_ADDRESS_ERROR);
+    TCP_ERR_HANDLER(remote_ip == NULL, return TCP_ADDRESS_ERROR);
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = PROTOCOLFAMILY;
+    result = inet_aton(remote_ip, (struct in_addr*) &addr.sin_addr.s_addr);
+    TCP_ERR_HANDLER(result == 0, return TCP_ADDRESS_ERROR);
+    addr.sin_port = htons(remote_port);
+    tcpsock_t* client = tcp_sock_create();
+    TCP_ERR_HANDLER(client == NULL, return TCP_MEMORY_ERROR);
+    client->sd = socket(PROTOCOLFAMILY, TYPE | SOCK_NONBLOCK, PROTOCOL);
+    TCP_DEBUG_PRINTF(client->sd < 0, "Socket() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(client->sd < 0, free(client); return TCP_SOCKOP_ERROR);
+    result = connect(client->sd, (struct sockaddr*) &addr, sizeof(addr));
+    TCP_DEBUG_PRINTF(result == -1 && errno != EINPROGRESS, "Connect() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(result != 0 && errno != EINPROGRESS, close(client->sd); free(client); return TCP_SOCKOP_ERROR);
+    client->ip_addr = NULL;
+    client->port = remote_port;
+    client->cookie = MAGIC_COOKIE;
+    *sock = client;
+    return TCP_NO_ERROR;
+}
+
+int tcp_finish_connect(tcpsock_t* socket) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    int result = getsockopt(socket->sd, SOL_SOCKET, SO_ERROR, &error, &length);
+    TCP_DEBUG_PRINTF(result == -1, "Getsockopt() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(result != 0, return TCP_SOCKOP_ERROR);
+    TCP_DEBUG_PRINTF(error != 0, "Connect() failed with errno = %d [%s]", error, strerror(error));
+    TCP_ERR_HANDLER(error != 0, errno = error; return TCP_SOCKOP_ERROR);
+    return TCP_NO_ERROR;
+}
+
 int tcp_close(tcpsock_t** socket) {
     int result;
     if (socket == NULL)
@@ -134,7 +241,8 @@ int tcp_close(tcpsock_t** socket) {
             result = shutdown((*socket)->sd, SHUT_RDWR);
             // if ((result of shutdown==-1)&&(errno!=ENOTCONN)) //socket wasn't connected
             TCP_DEBUG_PRINTF(result == -1, "Shutdown() failed with errno = %d [%s]", errno, strerror(errno));
-            if (result != -1) {
+            // an unconnected UDP socket has nothing to shut down (ENOTCONN), but must be closed all the same
+            if (result != -1 || errno == ENOTCONN) {
                 result = close((*socket)->sd); // try to close the socket descriptor
                 TCP_DEBUG_PRINTF(result == -1, "Close() failed with errno = %d [%s]", errno, strerror(errno));
             }
@@ -151,22 +259,38 @@ int tcp_close(tcpsock_t** socket) {
 }
 
 int tcp_wait_for_connection(tcpsock_t* socket, tcpsock_t** new_socket) {
+    int sd, result;
+
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    sd = accept(socket->sd, NULL, NULL);
+    TCP_DEBUG_PRINTF(sd == -1, "Accept() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(sd == -1, return TCP_SOCKOP_ERROR);
+    result = tcp_adopt_connection(socket, sd, new_socket);
+    TCP_ERR_HANDLER(result != TCP_NO_ERROR, close(sd); return result);
+    return TCP_NO_ERROR;
+}
+
+int tcp_adopt_connection(tcpsock_t* socket, int sd, tcpsock_t** new_socket) {
     struct sockaddr_in addr;
     tcpsock_t* s;
     unsigned int length = sizeof(struct sockaddr_in);
     char* p;
+    int result;
 
     TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
     TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(sd < 0, return TCP_SOCKET_ERROR);
     s = tcp_sock_create();
     TCP_ERR_HANDLER(s == NULL, return TCP_MEMORY_ERROR);
-    s->sd = accept(socket->sd, (struct sockaddr*) &addr, &length);
-    TCP_DEBUG_PRINTF(s->sd == -1, "Accept() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(s->sd == -1, free(s); return TCP_SOCKOP_ERROR);
+    result = getpeername(sd, (struct sockaddr*) &addr, &length);
+    TCP_DEBUG_PRINTF(result == -1, "getpeername() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(result != 0, free(s); return TCP_SOCKOP_ERROR);
+    s->sd = sd;
     p = inet_ntoa(addr.sin_addr); // returns addr to statically allocated buffer
     s->ip_addr = (char*) malloc(sizeof(char) * CHAR_IP_ADDR_LENGTH);
     TCP_ERR_HANDLER(s->ip_addr == NULL, free(s); return TCP_MEMORY_ERROR);
-    s->ip_addr = strncpy(s->ip_addr, p, CHAR_IP_ADDR_LENGTH);
+    snprintf(s->ip_addr, CHAR_IP_ADDR_LENGTH, "%s", p);
     s->port = ntohs(addr.sin_port);
     s->cookie = MAGIC_COOKIE;
     *new_socket = s;
@@ -184,7 +308,7 @@ int tcp_send(tcpsock_t* socket, void* buffer, int* buf_size) {
     // if socket is not connected, a SIGPIPE signal is sent which terminates the program (default behaviour)
     //*buf_size = sendto(socket->sd, (const void*)buffer,*buf_size, 0, NULL, 0);
     // use MSG_NOSIGNAL flag to avoid a signal to be sent
-    *buf_size = sendto(socket->sd, (const void*) buffer, *buf_size, 0, NULL, 0);
+    *buf_size = sendto(socket->sd, (const void*) buffer, *buf_size, MSG_NOSIGNAL, NULL, 0);
     TCP_DEBUG_PRINTF((*buf_size == 0), "Send() : no connection to peer\n");
     TCP_ERR_HANDLER(*buf_size == 0, return TCP_CONNECTION_CLOSED);
     TCP_DEBUG_PRINTF(((*buf_size < 0) && ((errno == EPIPE) || (errno == ENOTCONN))),
@@ -195,6 +319,60 @@ int tcp_send(tcpsock_t* socket, void* buffer, int* buf_size) {
     return TCP_NO_ERROR;
 }
 
+int tcp_send_iov(tcpsock_t* socket, const struct iovec* iov, int iovcnt, int* bytes) {
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    if ((iov == NULL) || (iovcnt == 0)) // nothing to send
+    {
+        *bytes = 0;
+        return TCP_NO_ERROR;
+    }
+    // writev can not be told to skip SIGPIPE, sendmsg can
+    struct msghdr message = {.msg_iov = (struct iovec*) iov, .msg_iovlen = iovcnt};
+    ssize_t result = sendmsg(socket->sd, &message, MSG_NOSIGNAL);
+    *bytes = result < 0 ? 0 : result;
+    TCP_DEBUG_PRINTF((result < 0) && ((errno == EPIPE) || (errno == ENOTCONN) || (errno == ECONNRESET)), "Sendmsg() : no connection to peer\n");
+    TCP_ERR_HANDLER((result < 0) && ((errno == EPIPE) || (errno == ENOTCONN) || (errno == ECONNRESET)), return TCP_CONNECTION_CLOSED);
+    TCP_DEBUG_PRINTF((result < 0) && (errno != EAGAIN), "Sendmsg() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(result < 0, return TCP_SOCKOP_ERROR);
+    return TCP_NO_ERROR;
+}
+
+int tcp_set_nodelay(tcpsock_t* socket, bool on) {
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    int value = on;
+    int result = setsockopt(socket->sd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+    TCP_DEBUG_PRINTF(result == -1, "Setsockopt() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(result != 0, return TCP_SOCKOP_ERROR);
+    return TCP_NO_ERROR;
+}
+
+int tcp_set_cork(tcpsock_t* socket, bool on) {
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    int value = on;
+    int result = setsockopt(socket->sd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+    TCP_DEBUG_PRINTF(result == -1, "Setsockopt() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(result != 0, return TCP_SOCKOP_ERROR);
+    return TCP_NO_ERROR;
+}
+
+int udp_send_batch(tcpsock_t* socket, struct mmsghdr* messages, unsigned int* count) {
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    if ((messages == NULL) || (*count == 0)) // nothing to send
+    {
+        *count = 0;
+        return TCP_NO_ERROR;
+    }
+    int result = sendmmsg(socket->sd, messages, *count, MSG_DONTWAIT);
+    TCP_DEBUG_PRINTF((result < 0) && (errno != EAGAIN), "Sendmmsg() failed with errno = %d [%s]", errno, strerror(errno));
+    *count = result < 0 ? 0 : result;
+    TCP_ERR_HANDLER(result < 0, return TCP_SOCKOP_ERROR);
+    return TCP_NO_ERROR;
+}
+
 int tcp_receive(tcpsock_t* socket, void* buffer, int* buf_size) {
     TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
     TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
@@ -213,6 +391,21 @@ int tcp_receive(tcpsock_t* socket, void* buffer, int* buf_size) {
     return TCP_NO_ERROR;
 }
 
+int udp_receive_batch(tcpsock_t* socket, struct mmsghdr* messages, unsigned int* count) {
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    if ((messages == NULL) || (*count == 0)) // nothing to read
+    {
+        *count = 0;
+        return TCP_NO_ERROR;
+    }
+    int result = recvmmsg(socket->sd, messages, *count, MSG_DONTWAIT, NULL);
+    TCP_DEBUG_PRINTF((result < 0) && (errno != EAGAIN), "Recvmmsg() failed with errno = %d [%s]", errno, strerror(errno));
+    *count = result < 0 ? 0 : result;
+    TCP_ERR_HANDLER(result < 0, return TCP_SOCKOP_ERROR);
+    return TCP_NO_ERROR;
+}
+
 int* tcp_last_seen_sensor_id(tcpsock_t* socket) {
     return &socket->last_seen_sensor_id;
 }
@@ -12,6 +12,8 @@
 #endif
 
 #include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <time.h>
 
 #define MIN_PORT 1024
@@ -52,6 +54,35 @@ typedef struct tcpsock tcpsock_t;
  */
 int tcp_passive_open(tcpsock_t** socket, int port);
 
+/**
+ * Same as tcp_passive_open, but several sockets can listen on the same port at the same time (SO_REUSEPORT)
+ * The kernel spreads the incoming connections over all of them, so each can be served by its own thread.
+ */
+int tcp_passive_open_shared(tcpsock_t** socket, int port);
+
+/**
+ * Creates a new UDP socket bound to port 'port' on any active IP interface of the system
+ * Like tcp_passive_open_shared, several sockets can be bound to the same port (SO_REUSEPORT)
+ * If port 'port' is not between MIN_PORT and MAX_PORT, TCP_ADDRESS_ERROR is returned
+ * If memory allocation for the newly created socket fails, TCP_MEMORY_ERROR is returned
+ * If a socket operation (socket, bind,...) fails, TCP_SOCKOP_ERROR is returned
+ * \param socket a double pointer, that will be filled out with the newly created socket
+ * \param port a port number between MIN_PORT and MAX_PORT
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int udp_passive_open(tcpsock_t** socket, int port);
+
+/**
+ * Creates a new UDP socket that sends its datagrams to 'remote_ip' on port 'remote_port' with tcp_send
+ * Nothing is sent to set it up, so this succeeds whether or not a server is listening
+ * Errors are returned as in tcp_active_open
+ * \param socket a double pointer, that will be filled out with the newly created socket
+ * \param remote_port the remote port number to send to
+ * \param remote_ip the remote ip address to send to
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int udp_active_open(tcpsock_t** socket, int remote_port, char* remote_ip);
+
 /**
  * Creates a new TCP socket and opens a TCP connection to the system with IP address 'remote_ip' on port 'remote_port'
  * The newly created socket is return as '*socket'
@@ -67,6 +98,26 @@ int tcp_passive_open(tcpsock_t** socket, int port);
  */
 int tcp_active_open(tcpsock_t** socket, int remote_port, char* remote_ip);
 
+/**
+ * Same as tcp_active_open, but does not wait until the connection is set up: the new socket is non-blocking
+ * Wait until the socket is writable (poll, epoll, ...) and then call tcp_finish_connect to know whether it worked
+ * Errors are returned as in tcp_active_open, a server that refuses the connection is only reported by tcp_finish_connect
+ * \param socket a double pointer, that will be filled out with the newly created socket
+ * \param remote_port the remote port number to connect to
+ * \param remote_ip the remote ip address to connect to
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_start_connect(tcpsock_t** socket, int remote_port, char* remote_ip);
+
+/**
+ * Checks the outcome of a connection set up by tcp_start_connect, once its socket became writable
+ * If the connection failed, TCP_SOCKOP_ERROR is returned and errno tells why (ECONNREFUSED, ETIMEDOUT, ...)
+ * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
+ * \param socket the socket returned by tcp_start_connect
+ * \return TCP_NO_ERROR if the connection is set up
+ */
+int tcp_finish_connect(tcpsock_t* socket);
+
 /**
  * The socket '*socket' is closed , allocated resources are freed and '*socket' is set to NULL
  * If '*socket' is connected, a TCP shutdown on the connection is executed
@@ -90,6 +141,16 @@ int tcp_close(tcpsock_t** socket);
  */
 int tcp_wait_for_connection(tcpsock_t* socket, tcpsock_t** new_socket);
 
+/**
+ * Same as tcp_wait_for_connection, for a connection 'sd' that was already accepted on 'socket' some other way (e.g. io_uring)
+ * On error 'sd' is left open
+ * \param socket the listening socket 'sd' was accepted on
+ * \param sd the descriptor of the accepted connection
+ * \param new_socket a double pointer, that will be filled out with the newly created socket for the connection with the client
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_adopt_connection(tcpsock_t* socket, int sd, tcpsock_t** new_socket);
+
 /**
  * Initiates a send command on the socket 'socket' and tries to send the total '*buf_size' bytes of data in 'buffer' (recall that the function might block for a while)
  * The function sets '*buf_size' to the number of bytes that were really sent, which might be less than the initial '*buf_size'
@@ -102,6 +163,46 @@ int tcp_wait_for_connection(tcpsock_t* socket, tcpsock_t** new_socket);
  */
 int tcp_send(tcpsock_t* socket, void* buffer, int* buf_size);
 
+/**
+ * Same as tcp_send, but gathers the data from the 'iovcnt' buffers in 'iov' into a single send (like writev)
+ * On a non-blocking socket with a full send buffer, TCP_SOCKOP_ERROR is returned with errno EAGAIN
+ * \param socket the socket where the data needs to be sent on
+ * \param iov the buffers to send, in order
+ * \param iovcnt the number of buffers in 'iov'
+ * \param bytes is set to the number of bytes that were really sent, which might be less than the sum of the buffers
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_send_iov(tcpsock_t* socket, const struct iovec* iov, int iovcnt, int* bytes);
+
+/**
+ * Turns TCP_NODELAY on or off: with it on, small sends go out right away instead of waiting for more data (Nagle)
+ * If a socket operation fails, TCP_SOCKOP_ERROR is returned
+ * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_set_nodelay(tcpsock_t* socket, bool on);
+
+/**
+ * Turns TCP_CORK on or off: while it is on only full packets are sent, turning it off sends what is left
+ * If a socket operation fails, TCP_SOCKOP_ERROR is returned
+ * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_set_cork(tcpsock_t* socket, bool on);
+
+/**
+ * Sends up to '*count' datagrams on the UDP socket 'socket' with a single system call (sendmmsg), without blocking
+ * The datagrams are described by 'messages' as for sendmmsg, the destination is the one given to udp_active_open
+ * The function sets '*count' to the number of datagrams that were sent
+ * If the socket can not take any datagram right now, TCP_SOCKOP_ERROR is returned with errno EAGAIN
+ * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
+ * \param socket the UDP socket to send on
+ * \param messages the datagrams
+ * \param count the number of entries in 'messages'
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int udp_send_batch(tcpsock_t* socket, struct mmsghdr* messages, unsigned int* count);
+
 /**
  * Initiates a receive command on the socket 'socket' and tries to receive the total '*buf_size' bytes of data in 'buffer' (recall that the function might block for a while)
  * The function sets '*buf_size' to the number of bytes that were really received, which might be less than the inital '*buf_size'
@@ -114,6 +215,19 @@ int tcp_send(tcpsock_t* socket, void* buffer, int* buf_size);
  */
 int tcp_receive(tcpsock_t* socket, void* buffer, int* buf_size);
 
+/**
+ * Receives up to '*count' datagrams on the UDP socket 'socket' with a single system call (recvmmsg), without blocking
+ * The buffers are described by 'messages' as for recvmmsg, the length of every datagram ends up in its 'msg_len'
+ * The function sets '*count' to the number of datagrams that were received
+ * If no datagram is waiting, TCP_SOCKOP_ERROR is returned with errno EAGAIN
+ * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
+ * \param socket the UDP socket to receive from
+ * \param messages the buffers for the datagrams
+ * \param count the number of entries in 'messages'
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int udp_receive_batch(tcpsock_t* socket, struct mmsghdr* messages, unsigned int* count);
+
 /**
  * Set '*ip_addr' to the IP address of 'socket' (could be NULL if the IP address is not set)
  * No memory allocation is done (pointer reference assignment!), hence, no free must be called to avoid a memory leak
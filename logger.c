@@ -0,0 +1,272 @@
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "logger.h"
+
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+// messages per thread that can wait for the writer, a power of two
+#define LOGGER_RING_ENTRIES 1024
+// bytes per message including its length, longer messages are cut off
+#define LOGGER_ENTRY_SIZE 256
+// messages per writev
+#define LOGGER_WRITEV_MAX 64
+// how long the writer sleeps when all rings are empty
+#define LOGGER_IDLE_MS 10
+
+typedef struct {
+    uint32_t length;
+    char text[LOGGER_ENTRY_SIZE - sizeof(uint32_t)];
+} entry_t;
+
+// single producer (the thread it belongs to), single consumer (the writer)
+typedef struct ring {
+    struct ring* next; // every ring ever created, so the writer can find them
+    _Alignas(64) _Atomic uint64_t head; // written by the writer
+    _Alignas(64) _Atomic uint64_t tail; // written by the owner
+    // rate limiting, only the owner touches these
+    time_t window; // the second the counts are for
+    unsigned counts[LOGGER_CLASSES];
+    uint64_t window_suppressed[LOGGER_CLASSES];
+    // totals, only read at shutdown
+    _Atomic uint64_t written;
+    _Atomic uint64_t suppressed;
+    _Atomic uint64_t dropped;
+    entry_t entries[LOGGER_RING_ENTRIES];
+} ring_t;
+
+static const char* const class_names[LOGGER_CLASSES] = {
+    [LOGGER_CLASS_READING] = "reading",
+    [LOGGER_CLASS_SENSOR] = "sensor",
+    [LOGGER_CLASS_ALERT] = "alert",
+    [LOGGER_CLASS_SERVER] = "server",
+};
+
+static const char* const level_names[] = {
+    [LOGGER_DEBUG] = "debug",
+    [LOGGER_INFO] = "info",
+    [LOGGER_WARNING] = "warning",
+    [LOGGER_ERROR] = "error",
+};
+
+// only changed by logger_init and logger_shutdown, while no other thread logs
+static logger_config_t config = {.fd = STDOUT_FILENO, .level = LOGGER_INFO};
+static pthread_t writer;
+
+static _Atomic bool running = false;
+static _Atomic bool stopping = false;
+// bumped by every logger_shutdown, so a thread notices its ring is gone
+static _Atomic unsigned generation = 0;
+static _Atomic(ring_t*) rings = NULL;
+
+static _Thread_local ring_t* local_ring = NULL;
+static _Thread_local unsigned local_generation = 0;
+
+/**
+ * \return the ring of the calling thread, created on its first message
+ */
+static ring_t* thread_ring(void) {
+    unsigned current = atomic_load_explicit(&generation, memory_order_relaxed);
+    if (local_ring != NULL && local_generation == current)
+        return local_ring;
+    ring_t* ring = NULL;
+    ASSERT_ELSE_PERROR(posix_memalign((void**) &ring, 64, sizeof(*ring)) == 0);
+    memset(ring, 0, sizeof(*ring));
+    ring->next = atomic_load_explicit(&rings, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&rings, &ring->next, ring, memory_order_release, memory_order_relaxed))
+        ;
+    local_ring = ring;
+    local_generation = current;
+    return ring;
+}
+
+/**
+ * Formats a message into the next free entry of 'ring'
+ */
+static void enqueue(ring_t* ring, const char* format, va_list args) {
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == LOGGER_RING_ENTRIES) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    entry_t* entry = &ring->entries[tail % LOGGER_RING_ENTRIES];
+    int length = vsnprintf(entry->text, sizeof(entry->text), format, args);
+    if (length < 0)
+        return;
+    if ((size_t) length >= sizeof(entry->text)) {
+        // cut off, but still a line of its own
+        length = sizeof(entry->text) - 1;
+        entry->text[length - 1] = '\n';
+    }
+    entry->length = length;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    atomic_fetch_add_explicit(&ring->written, 1, memory_order_relaxed);
+}
+
+static void enqueue_format(ring_t* ring, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    enqueue(ring, format, args);
+    va_end(args);
+}
+
+/**
+ * Counts the message against the limit of its class in the current second
+ * \return true if the message has to be suppressed
+ */
+static bool rate_limited(ring_t* ring, logger_class_t class) {
+    unsigned limit = config.rate_limits[class];
+    if (limit == 0)
+        return false;
+    // the coarse clock is a plain memory read, no system call
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    if (now.tv_sec != ring->window) {
+        ring->window = now.tv_sec;
+        for (int i = 0; i < LOGGER_CLASSES; i++) {
+            ring->counts[i] = 0;
+            if (ring->window_suppressed[i] > 0)
+                enqueue_format(ring, "Logger suppressed %" PRIu64 " %s messages of this thread\n", ring->window_suppressed[i], class_names[i]);
+            ring->window_suppressed[i] = 0;
+        }
+    }
+    if (ring->counts[class] >= limit) {
+        ring->window_suppressed[class]++;
+        atomic_fetch_add_explicit(&ring->suppressed, 1, memory_order_relaxed);
+        return true;
+    }
+    ring->counts[class]++;
+    return false;
+}
+
+void logger_log(logger_level_t level, logger_class_t class, const char* format, ...) {
+    assert(class < LOGGER_CLASSES);
+    if (level < config.level)
+        return;
+    va_list args;
+    va_start(args, format);
+    if (!atomic_load_explicit(&running, memory_order_relaxed)) {
+        vdprintf(config.fd, format, args);
+    } else {
+        ring_t* ring = thread_ring();
+        if (!rate_limited(ring, class))
+            enqueue(ring, format, args);
+    }
+    va_end(args);
+}
+
+static void write_all(struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(config.fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return; // nowhere to log that logging failed
+        }
+        // skip what was written, a partial entry continues where it stopped
+        while (count > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+/**
+ * Writes out what is in the rings right now
+ * \return the number of messages written
+ */
+static uint64_t flush_rings(void) {
+    uint64_t total = 0;
+    struct iovec iov[LOGGER_WRITEV_MAX];
+    for (ring_t* ring = atomic_load_explicit(&rings, memory_order_acquire); ring != NULL; ring = ring->next) {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        while (head != tail) {
+            int count = 0;
+            for (; head + count != tail && count < LOGGER_WRITEV_MAX; count++) {
+                entry_t* entry = &ring->entries[(head + count) % LOGGER_RING_ENTRIES];
+                iov[count].iov_base = entry->text;
+                iov[count].iov_len = entry->length;
+            }
+            // the entries go straight from the ring to the kernel, no copy
+            write_all(iov, count);
+            head += count;
+            total += count;
+            atomic_store_explicit(&ring->head, head, memory_order_release);
+        }
+    }
+    return total;
+}
+
+static void* run_writer(void* arg) {
+    (void) arg;
+    const struct timespec idle = {.tv_sec = 0, .tv_nsec = LOGGER_IDLE_MS * 1000000L};
+    while (!atomic_load_explicit(&stopping, memory_order_acquire)) {
+        // no wake up from the threads that log, that would cost them a system call
+        if (flush_rings() == 0)
+            nanosleep(&idle, NULL);
+    }
+    // nobody logs anymore, empty the rings
+    while (flush_rings() > 0)
+        ;
+    return NULL;
+}
+
+void logger_init(const logger_config_t* _config) {
+    assert(_config && !atomic_load(&running));
+    fflush(stdout);
+    config = *_config;
+    atomic_store(&stopping, false);
+    atomic_store(&running, true);
+    ASSERT_ELSE_PERROR(pthread_create(&writer, NULL, run_writer, NULL) == 0);
+}
+
+void logger_shutdown(logger_stats_t* stats) {
+    assert(atomic_load(&running));
+    atomic_store_explicit(&stopping, true, memory_order_release);
+    ASSERT_ELSE_PERROR(pthread_join(writer, NULL) == 0);
+    atomic_store(&running, false);
+    atomic_fetch_add(&generation, 1);
+
+    logger_stats_t total = {0};
+    ring_t* ring = atomic_exchange(&rings, NULL);
+    while (ring != NULL) {
+        ring_t* next = ring->next;
+        total.written += atomic_load(&ring->written);
+        total.suppressed += atomic_load(&ring->suppressed);
+        total.dropped += atomic_load(&ring->dropped);
+        free(ring);
+        ring = next;
+    }
+    if (stats != NULL)
+        *stats = total;
+}
+
+bool logger_level_from_string(const char* name, logger_level_t* level) {
+    for (logger_level_t i = LOGGER_DEBUG; i <= LOGGER_ERROR; i++) {
+        if (strcmp(name, level_names[i]) == 0) {
+            *level = i;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+/**
+ * Asynchronous logger for the server. A thread that logs formats the message into its own lock-free ring and
+ * goes on, a background writer thread collects the rings and writes them out in batches with writev.
+ * Messages of one thread keep their order, messages of different threads can interleave differently than they were logged.
+ * Every message has a level and a class. Messages below the configured level are skipped before they are formatted,
+ * and every class can be rate limited per thread. Messages that are rate limited or do not fit in a full ring are counted
+ * instead of blocking the caller.
+ * Before logger_init and after logger_shutdown messages are written directly, so modules can log without a running logger.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+    LOGGER_DEBUG,
+    LOGGER_INFO,
+    LOGGER_WARNING,
+    LOGGER_ERROR,
+} logger_level_t;
+
+typedef enum {
+    LOGGER_CLASS_READING, // every reading that comes in
+    LOGGER_CLASS_SENSOR,  // sensors that (dis)connect, time out or break the protocol
+    LOGGER_CLASS_ALERT,   // temperature alerts
+    LOGGER_CLASS_SERVER,  // everything else: start up, storage, shut down
+    LOGGER_CLASSES,
+} logger_class_t;
+
+typedef struct {
+    int fd; // where the messages go
+    logger_level_t level; // the lowest level that is written
+    unsigned rate_limits[LOGGER_CLASSES]; // messages per second per thread, 0 for no limit
+} logger_config_t;
+
+#define LOGGER_DEFAULT_CONFIG                      \
+    ((logger_config_t){                            \
+        .fd = 1,                                   \
+        .level = LOGGER_INFO,                      \
+        .rate_limits = {                           \
+            [LOGGER_CLASS_READING] = 1000,         \
+            [LOGGER_CLASS_SENSOR] = 100,           \
+            [LOGGER_CLASS_ALERT] = 100,            \
+            [LOGGER_CLASS_SERVER] = 0,             \
+        },                                         \
+    })
+
+typedef struct {
+    uint64_t written;    // messages handed to the writer thread
+    uint64_t suppressed; // messages over the rate limit of their class
+    uint64_t dropped;    // messages that did not fit in the ring of their thread
+} logger_stats_t;
+
+/**
+ * Starts the writer thread. Flushes stdout first, so what was printed before comes out before the log.
+ */
+void logger_init(const logger_config_t* config);
+
+/**
+ * Writes out everything that is still in the rings and stops the writer thread.
+ * No other thread may be logging anymore.
+ * \param stats if not NULL, filled out with the totals since logger_init
+ */
+void logger_shutdown(logger_stats_t* stats);
+
+/**
+ * Logs a message, formatted like printf. Never blocks once the logger runs.
+ */
+void logger_log(logger_level_t level, logger_class_t class, const char* format, ...) __attribute__((format(printf, 3, 4)));
+
+/**
+ * Looks up a level by its command line name: debug, info, warning or error
+ * \return false if 'name' is not a level
+ */
+bool logger_level_from_string(const char* name, logger_level_t* level);
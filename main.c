@@ -6,32 +6,144 @@
     #define _GNU_SOURCE
 #endif
 
+#include "admin.h"
 #include "config.h"
 #include "connmgr.h"
 #include "datamgr.h"
+#include "logger.h"
 #include "sbuffer.h"
 #include "sensor_db.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include <wait.h>
 
+// max number of readings a manager takes out of the buffer at once
+#ifndef MANAGER_BATCH_SIZE
+    #define MANAGER_BATCH_SIZE 64
+#endif
+
+// max number of readings the storage manager stores in one transaction
+#ifndef STORAGEMGR_BATCH_SIZE
+    #define STORAGEMGR_BATCH_SIZE 512
+#endif
+
+// every storage writer is a consumer of its own, next to the datamgr
+#define STORAGEMGR_MAX_WRITERS (SBUFFER_MAX_CONSUMERS - 1)
+
 static int print_usage() {
-    printf("Usage: <command> <port number> \n");
+    printf("Usage: <command> [-o block|drop-oldest|drop-newest|downsample] [-d spill directory] [-S shards] [-t network threads] [-b epoll|io_uring] [-u] [-l debug|info|warning|error] [-c commit rows] [-w commit ms] [-y off|normal|full|extra] [-e sqlite|tsdb|binlog|null] [-W storage writers] [-a admin fifo] <port number> \n");
     return -1;
 }
 
+// Gedeeld door de writers en het admin kanaal, dat de instellingen van alle writers aanpast terwijl de server draait
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned writers;
+    storagemgr_config_t configs[STORAGEMGR_MAX_WRITERS];
+    DBCONN* connections[STORAGEMGR_MAX_WRITERS]; // NULL zolang de writer niet verbonden is
+} storage_control_t;
+
 typedef struct run_manager_args {
     sbuffer_t* buffer;
-    bool fromDatamgr; 
+    int consumer;
+    bool fromDatamgr;
+    storage_control_t* storage_control;
+    unsigned writer;
+    storagemgr_stats_t* storage_stats; // ingevuld voor de storagemgr stopt
 } run_manager_args_t;
 
+/**
+ * Verbindt writer 'writer' met zijn shard en maakt de verbinding bereikbaar voor het admin kanaal
+ */
+static DBCONN* storage_connect(storage_control_t* control, unsigned writer) {
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&control->lock) == 0);
+    storagemgr_config_t config = control->configs[writer];
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&control->lock) == 0);
+    // Niet onder de lock: openen kan traag zijn
+    DBCONN* db = storagemgr_init_connection(1, &config);
+    assert(db != NULL);
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&control->lock) == 0);
+    // Een commando van tijdens het openen zit enkel nog in de config
+    config = control->configs[writer];
+    storagemgr_set_group_commit(db, config.commit_rows, config.commit_ms);
+    storagemgr_set_synchronous(db, config.synchronous);
+    control->connections[writer] = db;
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&control->lock) == 0);
+    return db;
+}
+
+static void storage_disconnect(storage_control_t* control, unsigned writer, storagemgr_stats_t* stats) {
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&control->lock) == 0);
+    DBCONN* db = control->connections[writer];
+    control->connections[writer] = NULL;
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&control->lock) == 0);
+    storagemgr_disconnect(db, stats);
+}
+
+/**
+ * \return true als 'text' een geheel getal tussen 'min' en 'max' is
+ */
+static bool parse_number(const char* text, long min, long max, long* value) {
+    char* end = NULL;
+    errno = 0;
+    *value = strtol(text, &end, 10);
+    return text[0] != '\0' && end[0] == '\0' && errno == 0 && *value >= min && *value <= max;
+}
+
+/**
+ * Admin commando's:
+ *   commit <rows> <ms>               group commit limieten van alle writers
+ *   sync off|normal|full|extra       synchronous niveau van alle writers
+ */
+static void handle_admin_command(void* _control, const char* command) {
+    storage_control_t* control = _control;
+    char copy[ADMIN_MAX_LINE + 1];
+    snprintf(copy, sizeof(copy), "%s", command);
+    char* saveptr = NULL;
+    char* name = strtok_r(copy, " \t", &saveptr);
+    char* first = strtok_r(NULL, " \t", &saveptr);
+    char* second = strtok_r(NULL, " \t", &saveptr);
+    char* rest = strtok_r(NULL, " \t", &saveptr);
+    long rows, ms;
+    storagemgr_sync_t synchronous;
+    if (name != NULL && strcmp(name, "commit") == 0 && second != NULL && rest == NULL &&
+        parse_number(first, 1, UINT_MAX, &rows) && parse_number(second, 0, INT_MAX, &ms)) {
+        ASSERT_ELSE_PERROR(pthread_mutex_lock(&control->lock) == 0);
+        for (unsigned i = 0; i < control->writers; i++) {
+            control->configs[i].commit_rows = rows;
+            control->configs[i].commit_ms = ms;
+            if (control->connections[i] != NULL)
+                storagemgr_set_group_commit(control->connections[i], rows, ms);
+        }
+        ASSERT_ELSE_PERROR(pthread_mutex_unlock(&control->lock) == 0);
+        logger_log(LOGGER_INFO, LOGGER_CLASS_SERVER, "Storage commits every %ld readings or %ld ms\n", rows, ms);
+    } else if (name != NULL && strcmp(name, "sync") == 0 && first != NULL && second == NULL &&
+               storagemgr_sync_from_string(first, &synchronous)) {
+        ASSERT_ELSE_PERROR(pthread_mutex_lock(&control->lock) == 0);
+        for (unsigned i = 0; i < control->writers; i++) {
+            control->configs[i].synchronous = synchronous;
+            if (control->connections[i] != NULL)
+                storagemgr_set_synchronous(control->connections[i], synchronous);
+        }
+        ASSERT_ELSE_PERROR(pthread_mutex_unlock(&control->lock) == 0);
+        logger_log(LOGGER_INFO, LOGGER_CLASS_SERVER, "Storage synchronous level is now %s\n", first);
+    } else {
+        logger_log(LOGGER_WARNING, LOGGER_CLASS_SERVER, "Unknown admin command \"%s\", use \"commit <rows> <ms>\" or \"sync off|normal|full|extra\"\n", command);
+    }
+}
+
 static void* run_manager(void* _args) {
     // void pointer -> struct pointer
     run_manager_args_t *args = (run_manager_args_t *) _args;
@@ -39,60 +151,216 @@ static void* run_manager(void* _args) {
     if (args->fromDatamgr) {
         datamgr_init();
     } else {
-        db = storagemgr_init_connection(1);
-        assert(db != NULL);
+        db = storage_connect(args->storage_control, args->writer);
     }
 
-    while (true) {
-        sensor_data_t data = sbuffer_remove_last(args->buffer, args->fromDatamgr);
-        if (args->fromDatamgr) {
-            datamgr_process_reading(&data);
-        } else {
-            storagemgr_insert_sensor(db, data.id, data.value, data.ts);
+    ssize_t count;
+    if (args->fromDatamgr) {
+        // Datamgr is snel genoeg om in de buffer zelf te lezen, zonder kopie
+        const sensor_data_t* readings[MANAGER_BATCH_SIZE];
+        while ((count = sbuffer_peek(args->buffer, args->consumer, readings, MANAGER_BATCH_SIZE, -1)) > 0) {
+            for (ssize_t i = 0; i < count; i++)
+                datamgr_process_reading(readings[i]);
+            sbuffer_release(args->buffer, args->consumer);
         }
-        if (sbuffer_is_closed_and_empty(args->buffer, args->fromDatamgr)) {
-            break;
+    } else {
+        // De consumer van een writer leest enkel de shards van zijn eigen sensors
+        // De database kan traag zijn -> kopieren zodat de slots meteen terug vrij zijn
+        // Grotere batches dan de datamgr: elke batch is een transactie
+        sensor_data_t batch[STORAGEMGR_BATCH_SIZE];
+        // Stopt pas als de buffer gesloten is en deze manager alles gezien heeft
+        // Niet langer wachten dan de open transactie mag blijven openstaan
+        while ((count = sbuffer_remove_batch(args->buffer, args->consumer, batch, STORAGEMGR_BATCH_SIZE, 1, storagemgr_commit_timeout(db))) >= 0) {
+            if (count > 0)
+                storagemgr_insert_batch(db, batch, count);
+            else
+                storagemgr_flush(db);
         }
     }
-    
+
+
     if (args->fromDatamgr) {
         datamgr_free();
     } else {
-        storagemgr_disconnect(db);
+        storage_disconnect(args->storage_control, args->writer, args->storage_stats);
     }
     return NULL;
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 2)
+    sbuffer_config_t config = SBUFFER_DEFAULT_CONFIG;
+    connmgr_config_t connmgr_config = CONNMGR_DEFAULT_CONFIG;
+    logger_config_t logger_config = LOGGER_DEFAULT_CONFIG;
+    storagemgr_config_t storage_config = STORAGEMGR_DEFAULT_CONFIG;
+    const char* admin_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:d:S:t:b:ul:c:w:y:e:W:a:")) != -1) {
+        switch (opt) {
+        case 'o':
+            if (!sbuffer_policy_from_string(optarg, &config.policy))
+                return print_usage();
+            break;
+        case 'd':
+            config.spill_dir = optarg;
+            break;
+        case 'S':
+            config.shards = atoi(optarg);
+            if (config.shards < 1 || config.shards > SBUFFER_MAX_SHARDS)
+                return print_usage();
+            break;
+        case 't':
+            connmgr_config.threads = atoi(optarg);
+            if (connmgr_config.threads < 1)
+                return print_usage();
+            break;
+        case 'b':
+            if (!connmgr_backend_from_string(optarg, &connmgr_config.backend))
+                return print_usage();
+            break;
+        case 'u':
+            connmgr_config.udp = true;
+            break;
+        case 'l':
+            if (!logger_level_from_string(optarg, &logger_config.level))
+                return print_usage();
+            break;
+        case 'c': {
+            long commit_rows;
+            if (!parse_number(optarg, 1, UINT_MAX, &commit_rows))
+                return print_usage();
+            storage_config.commit_rows = commit_rows;
+            break;
+        }
+        case 'w': {
+            // 0 mag: dan wordt elke batch meteen gecommit
+            long commit_ms;
+            if (!parse_number(optarg, 0, INT_MAX, &commit_ms))
+                return print_usage();
+            storage_config.commit_ms = commit_ms;
+            break;
+        }
+        case 'y':
+            if (!storagemgr_sync_from_string(optarg, &storage_config.synchronous))
+                return print_usage();
+            break;
+        case 'e':
+            if (!storagemgr_engine_from_string(optarg, &storage_config.engine))
+                return print_usage();
+            break;
+        case 'W':
+            storage_config.shards = atoi(optarg);
+            if (storage_config.shards < 1 || storage_config.shards > STORAGEMGR_MAX_WRITERS)
+                return print_usage();
+            break;
+        case 'a':
+            admin_path = optarg;
+            break;
+        default:
+            return print_usage();
+        }
+    }
+    if (argc - optind != 1)
         return print_usage();
-    char* strport = argv[1];
+    char* strport = argv[optind];
     char* error_char = NULL;
     int port_number = strtol(strport, &error_char, 10);
     if (strport[0] == '\0' || error_char[0] != '\0')
         return print_usage();
 
-    sbuffer_t* buffer = sbuffer_create();
+    // Loggen gebeurt in een aparte thread, de threads die loggen schrijven enkel in hun eigen ring
+    logger_init(&logger_config);
+
+    // Elke writer leest zijn eigen shards -> zoveel shards als een veelvoud van het aantal writers
+    unsigned writers = storage_config.shards;
+    if (config.shards % writers != 0) {
+        unsigned shards = (config.shards + writers - 1) / writers * writers;
+        if (shards > SBUFFER_MAX_SHARDS)
+            shards -= writers;
+        logger_log(LOGGER_INFO, LOGGER_CLASS_SERVER, "Using %u buffer shards instead of %u, a multiple of the %u storage writers\n",
+                   shards, config.shards, writers);
+        config.shards = shards;
+    }
+    sbuffer_t* buffer = sbuffer_create_with_config(&config);
 
     pthread_t datamgr_thread;
     run_manager_args_t datamgr_args;
     datamgr_args.fromDatamgr = true;
     datamgr_args.buffer = buffer;
+    // Registreren voor de connmgr start, anders kunnen de eerste readings gemist worden
+    datamgr_args.consumer = sbuffer_register_consumer(buffer);
+    assert(datamgr_args.consumer != SBUFFER_FAILURE);
     ASSERT_ELSE_PERROR(pthread_create(&datamgr_thread, NULL, run_manager,  &datamgr_args) == 0);
 
-    pthread_t storagemgr_thread;
-    run_manager_args_t storagemgr_args;
-    storagemgr_args.fromDatamgr = false;
-    storagemgr_args.buffer = buffer;
-    ASSERT_ELSE_PERROR(pthread_create(&storagemgr_thread, NULL, run_manager, &storagemgr_args) == 0);
+    // Een writer per shard, elk met een eigen consumer en eigen bestanden
+    storage_control_t storage_control = {.writers = writers};
+    ASSERT_ELSE_PERROR(pthread_mutex_init(&storage_control.lock, NULL) == 0);
+    pthread_t storagemgr_threads[STORAGEMGR_MAX_WRITERS];
+    run_manager_args_t storagemgr_args[STORAGEMGR_MAX_WRITERS];
+    storagemgr_stats_t writer_stats[STORAGEMGR_MAX_WRITERS];
+    for (unsigned i = 0; i < writers; i++) {
+        storage_control.configs[i] = storage_config;
+        storage_control.configs[i].shard = i;
+        storagemgr_args[i].fromDatamgr = false;
+        storagemgr_args[i].buffer = buffer;
+        storagemgr_args[i].storage_control = &storage_control;
+        storagemgr_args[i].writer = i;
+        storagemgr_args[i].storage_stats = &writer_stats[i];
+        // Buffer shard s bevat enkel sensors met id % writers == s % writers, zie storagemgr_shard_of
+        storagemgr_args[i].consumer = sbuffer_register_partial_consumer(buffer, i, writers);
+        assert(storagemgr_args[i].consumer != SBUFFER_FAILURE);
+        ASSERT_ELSE_PERROR(pthread_create(&storagemgr_threads[i], NULL, run_manager, &storagemgr_args[i]) == 0);
+    }
+
+    // Instellingen aanpassen terwijl de server draait, bv. echo "sync full" > admin.fifo
+    admin_t* admin = NULL;
+    if (admin_path != NULL) {
+        admin = admin_start(admin_path, handle_admin_command, &storage_control);
+        if (admin == NULL)
+            logger_log(LOGGER_ERROR, LOGGER_CLASS_SERVER, "Unable to open admin fifo %s: %m\n", admin_path);
+    }
 
     // main server loop
-    connmgr_listen(port_number, buffer);
+    connmgr_stats_t connmgr_stats;
+    connmgr_listen_with_config(port_number, buffer, &connmgr_config, &connmgr_stats);
+
+    if (admin != NULL)
+        admin_stop(admin);
 
     sbuffer_close(buffer);
 
     pthread_join(datamgr_thread, NULL);
-    pthread_join(storagemgr_thread, NULL);
+    storagemgr_stats_t storage_stats = {0};
+    for (unsigned i = 0; i < writers; i++) {
+        pthread_join(storagemgr_threads[i], NULL);
+        storage_stats.rows += writer_stats[i].rows;
+        storage_stats.lost += writer_stats[i].lost;
+        storage_stats.transactions += writer_stats[i].transactions;
+        storage_stats.checkpoints += writer_stats[i].checkpoints;
+        storage_stats.bytes += writer_stats[i].bytes;
+    }
+    pthread_mutex_destroy(&storage_control.lock);
+
+    // Niemand logt nog -> alles uitschrijven voor de samenvatting
+    logger_stats_t logger_stats;
+    logger_shutdown(&logger_stats);
+
+    printf("Connection manager: %" PRIu64 " readings from %u sensors over %" PRIu64 " connections (%" PRIu64 " timed out) on %u %s threads\n",
+           connmgr_stats.readings, connmgr_stats.sensors, connmgr_stats.connections, connmgr_stats.timed_out, connmgr_stats.threads,
+           connmgr_backend_to_string(connmgr_stats.backend));
+    printf("Protocol: %" PRIu64 " connections still on version 1, %" PRIu64 " readings missing according to sequence numbers\n",
+           connmgr_stats.v1_connections, connmgr_stats.missing);
+    if (connmgr_config.udp)
+        printf("UDP: %" PRIu64 " datagrams, %" PRIu64 " rejected\n", connmgr_stats.datagrams, connmgr_stats.bad_datagrams);
+    sbuffer_stats_t stats;
+    sbuffer_get_stats(buffer, &stats);
+    printf("Buffer: the fullest of %u shards used at most %zu of its %zu slots, for %" PRIu64 " readings\n",
+           stats.shards, stats.shard_high_water, stats.capacity / stats.shards, stats.inserted);
+    printf("Buffer overload: %" PRIu64 " blocked, %" PRIu64 " dropped oldest, %" PRIu64 " dropped newest, %" PRIu64 " downsampled, %" PRIu64 " spilled, %" PRIu64 " lost to a failed spill\n",
+           stats.blocked, stats.dropped_oldest, stats.dropped_newest, stats.downsampled, stats.spilled, stats.spill_failed);
+    printf("Storage: %" PRIu64 " readings in %" PRIu64 " transactions, %" PRIu64 " lost, %" PRIu64 " checkpoints, %" PRIu64 " bytes written by %u writers\n",
+           storage_stats.rows, storage_stats.transactions, storage_stats.lost, storage_stats.checkpoints, storage_stats.bytes, writers);
+    printf("Logger: %" PRIu64 " messages written, %" PRIu64 " suppressed by rate limits, %" PRIu64 " dropped because a ring was full\n",
+           logger_stats.written, logger_stats.suppressed, logger_stats.dropped);
 
     sbuffer_destroy(buffer);
 
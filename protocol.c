@@ -0,0 +1,211 @@
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "protocol.h"
+
+#include <assert.h>
+#include <endian.h>
+#include <string.h>
+
+// like PNG: not text, and line ending conversions break it
+static const uint8_t magic[PROTOCOL_MAGIC_SIZE] = {0x89, 'S', 'N', 'P', '\r', '\n', 0x1a, '\n'};
+
+// length, sensor id, count and first timestamp
+#define BATCH_HEADER_SIZE (2 + 2 + 2 + 8)
+#define SEQUENCE_SIZE 4
+#define MAX_VARINT_SIZE 10
+
+static void put_u16(uint8_t* out, uint16_t value) {
+    value = htole16(value);
+    memcpy(out, &value, sizeof(value));
+}
+
+static void put_u32(uint8_t* out, uint32_t value) {
+    value = htole32(value);
+    memcpy(out, &value, sizeof(value));
+}
+
+static void put_u64(uint8_t* out, uint64_t value) {
+    value = htole64(value);
+    memcpy(out, &value, sizeof(value));
+}
+
+static uint16_t get_u16(const uint8_t* in) {
+    uint16_t value;
+    memcpy(&value, in, sizeof(value));
+    return le16toh(value);
+}
+
+static uint32_t get_u32(const uint8_t* in) {
+    uint32_t value;
+    memcpy(&value, in, sizeof(value));
+    return le32toh(value);
+}
+
+static uint64_t get_u64(const uint8_t* in) {
+    uint64_t value;
+    memcpy(&value, in, sizeof(value));
+    return le64toh(value);
+}
+
+static size_t header_size(uint8_t flags) {
+    return BATCH_HEADER_SIZE + (flags & PROTOCOL_FLAG_SEQUENCE ? SEQUENCE_SIZE : 0);
+}
+
+/**
+ * Writes 'value' zigzag and LEB128 encoded, small positive and negative numbers take one byte
+ * \return the number of bytes written, at most MAX_VARINT_SIZE
+ */
+static size_t put_varint(uint8_t* out, int64_t value) {
+    uint64_t zigzag = ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+    size_t size = 0;
+    while (zigzag >= 0x80) {
+        out[size++] = (uint8_t) (zigzag | 0x80);
+        zigzag >>= 7;
+    }
+    out[size++] = (uint8_t) zigzag;
+    return size;
+}
+
+/**
+ * \return the number of bytes of the varint at 'in', or 0 if it does not end before 'end'
+ */
+static size_t varint_size(const uint8_t* in, const uint8_t* end) {
+    for (size_t size = 1; size <= MAX_VARINT_SIZE && in + size <= end; size++)
+        if (!(in[size - 1] & 0x80))
+            return size;
+    return 0;
+}
+
+static int64_t get_varint(const uint8_t** in) {
+    uint64_t zigzag = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+    do {
+        byte = *(*in)++;
+        zigzag |= (uint64_t) (byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return (int64_t) (zigzag >> 1) ^ -(int64_t) (zigzag & 1);
+}
+
+void protocol_encode_v1(uint8_t* out, sensor_id_t id, sensor_value_t value, sensor_ts_t ts) {
+    // host byte order, like the old sensors
+    memcpy(out, &id, sizeof(id));
+    memcpy(out + sizeof(id), &value, sizeof(value));
+    memcpy(out + sizeof(id) + sizeof(value), &ts, sizeof(ts));
+}
+
+int protocol_sniff(const uint8_t* data, size_t length) {
+    size_t n = length < PROTOCOL_MAGIC_SIZE ? length : PROTOCOL_MAGIC_SIZE;
+    if (memcmp(data, magic, n) != 0)
+        return 1;
+    return n == PROTOCOL_MAGIC_SIZE ? 2 : 0;
+}
+
+void protocol_encode_hello(uint8_t* out, protocol_hello_t hello) {
+    memcpy(out, magic, PROTOCOL_MAGIC_SIZE);
+    out[PROTOCOL_MAGIC_SIZE] = hello.version;
+    out[PROTOCOL_MAGIC_SIZE + 1] = hello.flags;
+    put_u16(out + PROTOCOL_MAGIC_SIZE + 2, 0);
+}
+
+ssize_t protocol_decode_hello(const uint8_t* data, size_t length, protocol_hello_t* hello) {
+    if (length < PROTOCOL_HELLO_SIZE)
+        return 0;
+    if (memcmp(data, magic, PROTOCOL_MAGIC_SIZE) != 0 || data[PROTOCOL_MAGIC_SIZE] < 2)
+        return -1;
+    hello->version = data[PROTOCOL_MAGIC_SIZE];
+    hello->flags = data[PROTOCOL_MAGIC_SIZE + 1];
+    return PROTOCOL_HELLO_SIZE;
+}
+
+protocol_hello_t protocol_negotiate(protocol_hello_t hello) {
+    return (protocol_hello_t){
+        .version = hello.version < PROTOCOL_VERSION ? hello.version : PROTOCOL_VERSION,
+        .flags = hello.flags & PROTOCOL_FLAGS_SUPPORTED,
+    };
+}
+
+void protocol_batch_init(protocol_batch_t* batch, uint8_t flags, sensor_id_t id, uint32_t sequence) {
+    assert(batch);
+    batch->flags = flags;
+    batch->count = 0;
+    batch->last_ts = 0;
+    put_u16(batch->data + 2, id);
+    if (flags & PROTOCOL_FLAG_SEQUENCE)
+        put_u32(batch->data + BATCH_HEADER_SIZE, sequence);
+    batch->size = header_size(flags);
+}
+
+bool protocol_batch_add(protocol_batch_t* batch, sensor_value_t value, sensor_ts_t ts) {
+    assert(batch);
+    if (batch->count == UINT16_MAX || batch->size + MAX_VARINT_SIZE + sizeof(value) > PROTOCOL_MAX_BATCH_SIZE)
+        return false;
+    // the first reading's timestamp is in the header, its delta is 0
+    if (batch->count == 0) {
+        put_u64(batch->data + 6, (uint64_t) ts);
+        batch->last_ts = ts;
+    }
+    batch->size += put_varint(batch->data + batch->size, ts - batch->last_ts);
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    put_u64(batch->data + batch->size, bits);
+    batch->size += sizeof(bits);
+    batch->last_ts = ts;
+    batch->count++;
+    return true;
+}
+
+void protocol_batch_set_sequence(protocol_batch_t* batch, uint32_t sequence) {
+    assert(batch && (batch->flags & PROTOCOL_FLAG_SEQUENCE));
+    put_u32(batch->data + BATCH_HEADER_SIZE, sequence);
+}
+
+size_t protocol_batch_finish(protocol_batch_t* batch) {
+    assert(batch);
+    put_u16(batch->data, (uint16_t) (batch->size - 2));
+    put_u16(batch->data + 4, batch->count);
+    return batch->size;
+}
+
+ssize_t protocol_batch_open(protocol_reader_t* reader, const uint8_t* data, size_t length, uint8_t flags) {
+    assert(reader && data);
+    if (length < 2)
+        return 0;
+    size_t size = 2 + (size_t) get_u16(data);
+    if (size > PROTOCOL_MAX_BATCH_SIZE || size < header_size(flags))
+        return -1;
+    if (length < size)
+        return 0;
+
+    reader->id = get_u16(data + 2);
+    reader->count = get_u16(data + 4);
+    reader->ts = (sensor_ts_t) get_u64(data + 6);
+    reader->sequence = flags & PROTOCOL_FLAG_SEQUENCE ? get_u32(data + BATCH_HEADER_SIZE) : 0;
+    reader->next = data + header_size(flags);
+    // the whole batch is checked up front, so decoding can not fail halfway through
+    const uint8_t* end = data + size;
+    const uint8_t* p = reader->next;
+    for (uint16_t i = 0; i < reader->count; i++) {
+        size_t n = varint_size(p, end);
+        if (n == 0 || p + n + sizeof(sensor_value_t) > end)
+            return -1;
+        p += n + sizeof(sensor_value_t);
+    }
+    if (p != end)
+        return -1;
+    return size;
+}
+
+void protocol_batch_next(protocol_reader_t* reader, sensor_value_t* value, sensor_ts_t* ts) {
+    assert(reader && reader->count > 0);
+    reader->ts += get_varint(&reader->next);
+    uint64_t bits = get_u64(reader->next);
+    reader->next += sizeof(bits);
+    memcpy(value, &bits, sizeof(*value));
+    *ts = reader->ts;
+    reader->count--;
+    reader->sequence++;
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+/**
+ * Wire protocol between the sensor nodes and the server.
+ *
+ * Version 1 has no framing: every reading is sent as <sensor id u16><value f64><timestamp i64> in host byte order.
+ *
+ * Version 2 starts with a handshake and then sends readings in batches, all integers little endian:
+ *   hello  client -> server  <magic 8 bytes><highest version u8><flags u8><reserved u16>
+ *   ack    server -> client  <magic 8 bytes><chosen version u8><accepted flags u8><reserved u16>
+ *   batch  client -> server  <length u16><sensor id u16><count u16><first timestamp i64>[<sequence u32>]
+ *                            followed by 'count' times <timestamp delta varint><value f64>
+ * 'length' counts the bytes after the length field. The timestamp delta is the zigzag LEB128 encoded difference
+ * with the previous reading, the first reading has delta 0. The sequence number is only there if both sides
+ * accepted PROTOCOL_FLAG_SEQUENCE: it numbers the first reading of the batch, the others follow it.
+ *
+ * Over UDP there is no handshake: every datagram holds exactly one batch, always with a sequence number
+ * (PROTOCOL_UDP_FLAGS), so the server can tell how many readings of a sensor got lost on the way.
+ *
+ * The server tells both versions apart by the first bytes: a version 1 stream starts with a sensor id and a value,
+ * which only matches the magic for one sensor id and one in 2^48 values.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define PROTOCOL_VERSION 2
+
+// size of one version 1 reading on the wire
+#define PROTOCOL_V1_FRAME_SIZE (sizeof(sensor_id_t) + sizeof(sensor_value_t) + sizeof(sensor_ts_t))
+
+#define PROTOCOL_MAGIC_SIZE 8
+#define PROTOCOL_HELLO_SIZE (PROTOCOL_MAGIC_SIZE + 4)
+
+// every batch starts with a sequence number
+#define PROTOCOL_FLAG_SEQUENCE 0x01
+#define PROTOCOL_FLAGS_SUPPORTED PROTOCOL_FLAG_SEQUENCE
+
+// largest batch on the wire including its length field, the server rejects bigger ones
+#define PROTOCOL_MAX_BATCH_SIZE 4096
+// the most readings that always fit in one batch, whatever their timestamps
+#define PROTOCOL_MAX_BATCH_READINGS ((PROTOCOL_MAX_BATCH_SIZE - 18) / (10 + sizeof(sensor_value_t)))
+
+// the flags every UDP batch is sent with
+#define PROTOCOL_UDP_FLAGS PROTOCOL_FLAG_SEQUENCE
+// the most readings in a datagram that is not fragmented on Ethernet: 1500 bytes minus the IP and UDP headers
+#define PROTOCOL_MAX_DATAGRAM_READINGS ((1472 - 18) / (10 + sizeof(sensor_value_t)))
+
+typedef struct {
+    uint8_t version;
+    uint8_t flags;
+} protocol_hello_t;
+
+/**
+ * Builds a batch of version 2 readings of one sensor
+ */
+typedef struct {
+    uint8_t data[PROTOCOL_MAX_BATCH_SIZE];
+    size_t size;
+    uint16_t count;
+    uint8_t flags;
+    sensor_ts_t last_ts;
+} protocol_batch_t;
+
+/**
+ * Walks over the readings of a received batch, see protocol_batch_open
+ */
+typedef struct {
+    sensor_id_t id;
+    uint16_t count;     // readings left
+    uint32_t sequence;  // of the next reading, only set with PROTOCOL_FLAG_SEQUENCE
+    sensor_ts_t ts;     // of the previous reading
+    const uint8_t* next;
+} protocol_reader_t;
+
+/**
+ * Writes one version 1 reading to 'out', which must hold PROTOCOL_V1_FRAME_SIZE bytes
+ */
+void protocol_encode_v1(uint8_t* out, sensor_id_t id, sensor_value_t value, sensor_ts_t ts);
+
+/**
+ * Looks at the first bytes a client sent
+ * \return 0 if there are not enough bytes yet to tell, otherwise the protocol version of the client
+ */
+int protocol_sniff(const uint8_t* data, size_t length);
+
+/**
+ * Writes a hello (client) or an ack (server) to 'out', which must hold PROTOCOL_HELLO_SIZE bytes
+ */
+void protocol_encode_hello(uint8_t* out, protocol_hello_t hello);
+
+/**
+ * Reads a hello or an ack from the start of 'data'
+ * \return PROTOCOL_HELLO_SIZE, 0 if 'data' does not hold a complete one yet, or -1 if it is not a hello
+ */
+ssize_t protocol_decode_hello(const uint8_t* data, size_t length, protocol_hello_t* hello);
+
+/**
+ * What the server answers to 'hello': the highest version both sides speak and the flags both sides know
+ */
+protocol_hello_t protocol_negotiate(protocol_hello_t hello);
+
+/**
+ * Starts an empty batch for sensor 'id'
+ * \param flags the flags the server accepted
+ * \param sequence number of the first reading that will be added, ignored without PROTOCOL_FLAG_SEQUENCE
+ */
+void protocol_batch_init(protocol_batch_t* batch, uint8_t flags, sensor_id_t id, uint32_t sequence);
+
+/**
+ * Appends a reading to the batch
+ * \return false if the batch is full, the reading was not added then
+ */
+bool protocol_batch_add(protocol_batch_t* batch, sensor_value_t value, sensor_ts_t ts);
+
+/**
+ * Changes the sequence number of the first reading, for a batch that has to be sent again on a new connection
+ * The batch must have been started with PROTOCOL_FLAG_SEQUENCE
+ */
+void protocol_batch_set_sequence(protocol_batch_t* batch, uint32_t sequence);
+
+/**
+ * Fills out the header, 'batch->data' then holds the batch as it goes on the wire
+ * \return the number of bytes to send
+ */
+size_t protocol_batch_finish(protocol_batch_t* batch);
+
+/**
+ * Checks the batch at the start of 'data' and prepares 'reader' to decode its readings
+ * \param flags the flags the server accepted for this connection
+ * \return the size of the batch, 0 if 'data' does not hold the complete batch yet, or -1 if the batch is invalid
+ */
+ssize_t protocol_batch_open(protocol_reader_t* reader, const uint8_t* data, size_t length, uint8_t flags);
+
+/**
+ * Decodes the next reading of a batch opened by protocol_batch_open, 'reader->count' must not be 0
+ */
+void protocol_batch_next(protocol_reader_t* reader, sensor_value_t* value, sensor_ts_t* ts);
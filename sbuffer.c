@@ -10,173 +10,1158 @@
 #include "sbuffer.h"
 
 #include "config.h"
+#include "spill_log.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
 #include <sys/types.h>
+#include <time.h>
 
-typedef struct sbuffer_node {
-    struct sbuffer_node* prev;
+#define SBUFFER_CACHE_LINE 64
+// aantal keer opnieuw proberen voor we gaan slapen op de condvar
+#define SBUFFER_SPIN_LIMIT 64
+// max aantal readings dat in een keer van de spill log naar de ring verhuist
+#define SBUFFER_REFILL_BATCH 256
+
+_Static_assert(SBUFFER_MAX_CONSUMERS <= 32, "sleeping_mask has one bit per consumer");
+_Static_assert(SBUFFER_MAX_SHARDS <= 64, "shard_mask has one bit per shard");
+
+// cursor waarde van een vrije consumer plaats, wordt genegeerd door min_consumer_cursor
+#define CONSUMER_INACTIVE UINT64_MAX
+// wait_shard van een consumer die op eender welke shard wacht
+#define WAIT_ANY_SHARD -1
+// bit in 'published' van een slot dat via sbuffer_cancel zonder reading vrijgegeven is
+#define SLOT_CANCELLED (1ULL << 63)
+
+// toestand van een sbuffer_reservation_t
+enum {
+    RESERVED_SLOT,     // 'data' wijst naar een geclaimd slot in de ring
+    RESERVED_FALLBACK, // 'data' wijst naar 'fallback', commit doet een gewone insert
+    RESERVED_DROPPED,  // de policy gooit de reading weg, commit telt enkel
+    RESERVED_CLOSED,   // de buffer is gesloten
+};
+
+// Elke cursor op zijn eigen cache line -> geen false sharing tussen producer en consumers
+typedef struct {
+    _Alignas(SBUFFER_CACHE_LINE) _Atomic uint64_t value;
+    // consumer is slots aan het kopieren, enkel gebruikt bij SBUFFER_DROP_OLDEST
+    _Atomic bool reading;
+} sbuffer_cursor_t;
+
+typedef struct sbuffer_shard sbuffer_shard_t;
+
+// Eigen wakeup kanaal per consumer -> een insert maakt enkel consumers wakker die echt slapen
+typedef struct {
+    _Alignas(SBUFFER_CACHE_LINE) pthread_mutex_t mutex;
+    pthread_cond_t wakeup;
+    // shard en sequence waarop de consumer wacht, geldig zolang zijn bit in sleeping_mask staat
+    _Atomic int wait_shard;
+    _Atomic uint64_t wait_for;
+    // bit i staat aan als de consumer shard i leest, 0 als deze plaats vrij is
+    _Atomic uint64_t shard_mask;
+    // shard waar de volgende remove begint, enkel gebruikt door de consumer zelf
+    unsigned next_shard;
+    // slots van de laatste sbuffer_peek, vrijgegeven door sbuffer_release
+    sbuffer_shard_t* peek_shard;
+    uint64_t peek_sequence;
+    size_t peek_slots;
+    // -1 tenzij de consumer via sbuffer_consumer_eventfd om een eventfd gevraagd heeft
+    int eventfd;
+} sbuffer_waiter_t;
+
+typedef struct {
+    // sequence + 1 van de reading die in dit slot staat, 0 als het slot nog nooit gebruikt is
+    // SLOT_CANCELLED staat erbij als er geen reading in zit
+    _Atomic uint64_t published;
     sensor_data_t data;
-    bool seenByDatamgr;
-    bool seenByStoragemgr;
-} sbuffer_node_t;
+} sbuffer_slot_t;
 
-typedef struct sbuffer {
-    sbuffer_node_t* head;
-    sbuffer_node_t* storagemgr_tail;
-    sbuffer_node_t* datamgr_tail;
-    bool closed;
+// Onafhankelijke ring met eigen cursors en eigen producer wachtrij.
+// Een sensor komt altijd in dezelfde shard terecht -> volgorde per sensor blijft behouden.
+typedef struct sbuffer_shard {
+    // vooraf gealloceerde slab van 'capacity' slots, wordt nooit vergroot
+    sbuffer_slot_t* slots;
+    // volgende sequence die een producer mag claimen
+    sbuffer_cursor_t claim;
+    // volgende sequence die elke consumer gaat lezen, CONSUMER_INACTIVE als de plaats vrij is
+    sbuffer_cursor_t consumers[SBUFFER_MAX_CONSUMERS];
+    // producers die een cursor vooruit gezet hebben en wachten tot die consumer klaar is met kopieren
+    _Alignas(SBUFFER_CACHE_LINE) _Atomic int dropping;
+    // enkel het trage pad (wachten op plaats) gebruikt de mutex
+    _Atomic int sleeping_producers;
     pthread_mutex_t mutex;
-    pthread_cond_t data_available;
+    pthread_cond_t space_available;
+    // overflow naar schijf, NULL als uitgeschakeld
+    spill_log_t* spill;
+    // true zolang er readings in de spill log zitten -> nieuwe readings moeten er ook in (volgorde)
+    _Atomic bool spilling;
+    pthread_mutex_t spill_mutex;
+    // statistieken
+    _Alignas(SBUFFER_CACHE_LINE) _Atomic size_t high_water;
+    _Atomic uint64_t blocked;
+    _Atomic uint64_t dropped_oldest;
+    _Atomic uint64_t dropped_newest;
+    _Atomic uint64_t downsampled;
+    _Atomic uint64_t spilled;
+    _Atomic uint64_t spill_failed;
+} sbuffer_shard_t;
+
+typedef struct sbuffer {
+    sbuffer_shard_t* shards;
+    unsigned shard_count;
+    // per shard
+    size_t capacity;
+    uint64_t mask;
+    sbuffer_policy_t policy;
+    size_t downsample_threshold;
+    unsigned downsample_factor;
+    // aantal readings per sensor sinds de start, enkel bij SBUFFER_DOWNSAMPLE
+    _Atomic unsigned* sensor_counts;
+    size_t spill_threshold;
+    // 1 + hoogste id ooit geregistreerd, zodat de producer niet alle plaatsen moet overlopen
+    _Atomic int consumer_limit;
+    _Alignas(SBUFFER_CACHE_LINE) _Atomic bool closed;
+    // bit i staat aan als consumer i slaapt of een eventfd notificatie gevraagd heeft
+    _Atomic uint32_t sleeping_mask;
+    sbuffer_waiter_t waiters[SBUFFER_MAX_CONSUMERS];
+    // registreren en sluiten zijn zeldzaam -> een mutex voor heel de buffer
+    _Alignas(SBUFFER_CACHE_LINE) pthread_mutex_t mutex;
 } sbuffer_t;
 
-static sbuffer_node_t* create_node(const sensor_data_t* data) {
-    sbuffer_node_t* node = malloc(sizeof(*node));
-    *node = (sbuffer_node_t){
-        .data = *data,
-        .prev = NULL,
-        .seenByDatamgr = false,
-        .seenByStoragemgr = false,
+/**
+ * \return the cursor of the slowest registered consumer in 'shard', or CONSUMER_INACTIVE if there are none
+ */
+static uint64_t min_consumer_cursor(sbuffer_t* buffer, sbuffer_shard_t* shard) {
+    uint64_t min = CONSUMER_INACTIVE;
+    int limit = atomic_load_explicit(&buffer->consumer_limit, memory_order_acquire);
+    for (int i = 0; i < limit; i++) {
+        uint64_t cursor = atomic_load_explicit(&shard->consumers[i].value, memory_order_acquire);
+        if (cursor < min)
+            min = cursor;
+    }
+    return min;
+}
+
+static size_t depth_at(sbuffer_t* buffer, sbuffer_shard_t* shard, uint64_t sequence) {
+    uint64_t min = min_consumer_cursor(buffer, shard);
+    // Zonder consumers houdt niemand een slot bezet. 'sequence' kan ook al verouderd zijn als andere
+    // producers intussen geclaimd hebben en de consumers erdoor zijn -> dan is er zeker plaats
+    return min == CONSUMER_INACTIVE || min >= sequence ? 0 : sequence - min;
+}
+
+static void check_consumer(sbuffer_t* buffer, int consumer) {
+    assert(consumer >= 0 && consumer < SBUFFER_MAX_CONSUMERS);
+    assert(atomic_load_explicit(&buffer->waiters[consumer].shard_mask, memory_order_relaxed) != 0);
+    (void) buffer;
+    (void) consumer;
+}
+
+static sbuffer_shard_t* shard_of(sbuffer_t* buffer, sensor_id_t id) {
+    return &buffer->shards[id % buffer->shard_count];
+}
+
+static bool reads_shard(sbuffer_t* buffer, int consumer, unsigned index) {
+    return (atomic_load_explicit(&buffer->waiters[consumer].shard_mask, memory_order_relaxed) >> index) & 1;
+}
+
+static bool slot_is_published(sbuffer_slot_t* slot, uint64_t sequence) {
+    return (atomic_load_explicit(&slot->published, memory_order_acquire) & ~SLOT_CANCELLED) == sequence + 1;
+}
+
+static bool slot_is_cancelled(sbuffer_slot_t* slot) {
+    // Enkel geldig nadat slot_is_published true gaf
+    return (atomic_load_explicit(&slot->published, memory_order_relaxed) & SLOT_CANCELLED) != 0;
+}
+
+static bool is_closed_and_drained(sbuffer_t* buffer, int consumer) {
+    if (!atomic_load(&buffer->closed))
+        return false;
+    for (unsigned i = 0; i < buffer->shard_count; i++) {
+        sbuffer_shard_t* shard = &buffer->shards[i];
+        if (!reads_shard(buffer, consumer, i))
+            continue;
+        if (atomic_load(&shard->spilling) || atomic_load(&shard->consumers[consumer].value) != atomic_load(&shard->claim.value))
+            return false;
+    }
+    return true;
+}
+
+static void notify_consumer(sbuffer_t* buffer, int consumer) {
+    sbuffer_waiter_t* waiter = &buffer->waiters[consumer];
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&waiter->mutex) == 0);
+    ASSERT_ELSE_PERROR(pthread_cond_signal(&waiter->wakeup) == 0);
+    if (waiter->eventfd >= 0)
+        ASSERT_ELSE_PERROR(eventfd_write(waiter->eventfd, 1) == 0);
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&waiter->mutex) == 0);
+}
+
+/**
+ * \return true if 'consumer' waits for shard 'index' and everything it waits for is published,
+ * now that the slots from 'first' on were published
+ */
+static bool wait_satisfied(sbuffer_t* buffer, int consumer, unsigned index, uint64_t first) {
+    sbuffer_waiter_t* waiter = &buffer->waiters[consumer];
+    int wait_shard = atomic_load(&waiter->wait_shard);
+    if (wait_shard == WAIT_ANY_SHARD)
+        return reads_shard(buffer, consumer, index);
+    uint64_t wait_for = atomic_load(&waiter->wait_for);
+    // Slots na wait_for maken geen verschil, maar een refill publiceert er vele en meldt enkel de eerste
+    if ((unsigned) wait_shard != index || first > wait_for)
+        return false;
+    // Slots worden niet in volgorde gepubliceerd (10 voor 9) -> pas wakker maken als alles tot wait_for er is
+    // seq_cst loads: twee producers die tegelijk 9 en 10 publiceren zien zo zeker elkaars slot, een van hen maakt wakker
+    sbuffer_shard_t* shard = &buffer->shards[index];
+    for (uint64_t i = atomic_load(&shard->consumers[consumer].value); i <= wait_for; i++) {
+        if ((atomic_load(&shard->slots[i & buffer->mask].published) & ~SLOT_CANCELLED) != i + 1)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Wakes every sleeping consumer for which the readings it waits for in shard 'index' are all published now,
+ * and every consumer that waits for any of its shards and reads 'index'. 'first' is the lowest of the slots that were just published.
+ * Each consumer gets at most one wakeup per sleep, no matter how many inserts follow.
+ */
+static void wake_consumers(sbuffer_t* buffer, unsigned index, uint64_t first) {
+    // seq_cst load: moet na de publish store geordend zijn, anders kan een consumer de wakeup missen
+    uint32_t sleeping = atomic_load(&buffer->sleeping_mask);
+    while (sleeping != 0) {
+        int consumer = __builtin_ctz(sleeping);
+        uint32_t bit = 1u << consumer;
+        sleeping &= ~bit;
+        if (!wait_satisfied(buffer, consumer, index, first))
+            continue;
+        // Enkel wie de bit wist mag wakker maken -> bursts geven een enkele wakeup
+        if (atomic_fetch_and(&buffer->sleeping_mask, ~bit) & bit)
+            notify_consumer(buffer, consumer);
+    }
+}
+
+static void wake_producers(sbuffer_shard_t* shard) {
+    if (atomic_load(&shard->sleeping_producers) == 0)
+        return;
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&shard->mutex) == 0);
+    ASSERT_ELSE_PERROR(pthread_cond_broadcast(&shard->space_available) == 0);
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&shard->mutex) == 0);
+}
+
+static void deadline_after(struct timespec* deadline, int timeout_ms) {
+    ASSERT_ELSE_PERROR(clock_gettime(CLOCK_REALTIME, deadline) == 0);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (long) (timeout_ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+/**
+ * \return how many consecutive published readings there are from 'sequence' on in 'shard', at most 'max'
+ */
+static size_t count_published(sbuffer_t* buffer, sbuffer_shard_t* shard, uint64_t sequence, size_t max) {
+    size_t count = 0;
+    while (count < max && slot_is_published(&shard->slots[(sequence + count) & buffer->mask], sequence + count))
+        count++;
+    return count;
+}
+
+/**
+ * \return how many readings the consumer can remove right now over all of its shards, at most 'max'
+ */
+static size_t count_available(sbuffer_t* buffer, int consumer, size_t max) {
+    size_t count = 0;
+    for (unsigned i = 0; i < buffer->shard_count && count < max; i++) {
+        if (!reads_shard(buffer, consumer, i))
+            continue;
+        sbuffer_shard_t* shard = &buffer->shards[i];
+        uint64_t sequence = atomic_load_explicit(&shard->consumers[consumer].value, memory_order_acquire);
+        count += count_published(buffer, shard, sequence, max - count);
+    }
+    return count;
+}
+
+/**
+ * Tells producers what the consumer waits for and sets its bit in sleeping_mask
+ * Afterwards the caller must check for data once more before it goes to sleep.
+ */
+static void announce_wait(sbuffer_t* buffer, int consumer, size_t count) {
+    sbuffer_waiter_t* waiter = &buffer->waiters[consumer];
+    uint64_t shard_mask = atomic_load_explicit(&waiter->shard_mask, memory_order_relaxed);
+    if ((shard_mask & (shard_mask - 1)) == 0) {
+        // Een shard: enkel wakker worden als de 'count'-ste reading er is
+        int index = __builtin_ctzll(shard_mask);
+        uint64_t sequence = atomic_load(&buffer->shards[index].consumers[consumer].value);
+        atomic_store(&waiter->wait_for, sequence + count - 1);
+        atomic_store(&waiter->wait_shard, index);
+    } else {
+        // Meerdere shards: elke insert kan genoeg zijn, de consumer telt zelf opnieuw
+        atomic_store(&waiter->wait_shard, WAIT_ANY_SHARD);
+    }
+    atomic_fetch_or(&buffer->sleeping_mask, 1u << consumer);
+}
+
+/**
+ * Waits until the consumer can remove 'count' readings, the buffer gets closed or 'deadline' (if not NULL) passes
+ * \return true if 'count' readings are available
+ */
+static bool wait_for_data(sbuffer_t* buffer, int consumer, size_t count, const struct timespec* deadline) {
+    for (int i = 0; i < SBUFFER_SPIN_LIMIT; i++) {
+        if (count_available(buffer, consumer, count) >= count)
+            return true;
+        if (atomic_load(&buffer->closed))
+            return false;
+        sched_yield();
+    }
+
+    sbuffer_waiter_t* waiter = &buffer->waiters[consumer];
+    uint32_t bit = 1u << consumer;
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&waiter->mutex) == 0);
+    while (count_available(buffer, consumer, count) < count && !atomic_load(&buffer->closed)) {
+        announce_wait(buffer, consumer, count);
+        if (count_available(buffer, consumer, count) >= count)
+            break;
+        // Zolang onze bit aan staat heeft niemand ons nog wakker gemaakt
+        bool timed_out = false;
+        while ((atomic_load(&buffer->sleeping_mask) & bit) && !atomic_load(&buffer->closed)) {
+            if (deadline == NULL) {
+                ASSERT_ELSE_PERROR(pthread_cond_wait(&waiter->wakeup, &waiter->mutex) == 0);
+            } else {
+                int rc = pthread_cond_timedwait(&waiter->wakeup, &waiter->mutex, deadline);
+                ASSERT_ELSE_PERROR(rc == 0 || rc == ETIMEDOUT);
+                if (rc == ETIMEDOUT) {
+                    timed_out = true;
+                    break;
+                }
+            }
+        }
+        if (timed_out)
+            break;
+    }
+    atomic_fetch_and(&buffer->sleeping_mask, ~bit);
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&waiter->mutex) == 0);
+    return count_available(buffer, consumer, count) >= count;
+}
+
+static bool has_space(sbuffer_t* buffer, sbuffer_shard_t* shard, uint64_t sequence) {
+    // Het vrijgemaakte slot wordt misschien nog gelezen, zie drop_oldest
+    if (atomic_load(&shard->dropping) != 0)
+        return false;
+    return depth_at(buffer, shard, sequence) < buffer->capacity;
+}
+
+/**
+ * Skips the oldest unseen reading of every consumer that keeps slot 'sequence' of 'shard' occupied
+ */
+static void drop_oldest(sbuffer_t* buffer, sbuffer_shard_t* shard, uint64_t sequence) {
+    int limit = atomic_load(&buffer->consumer_limit);
+    for (int i = 0; i < limit; i++) {
+        sbuffer_cursor_t* cursor = &shard->consumers[i];
+        uint64_t oldest = atomic_load(&cursor->value);
+        if (oldest == CONSUMER_INACTIVE || sequence - oldest < buffer->capacity)
+            continue;
+        // Een andere producer schrijft dit slot nog -> niet overslaan, anders claimt iemand het een tweede keer
+        if (!slot_is_published(&shard->slots[oldest & buffer->mask], oldest))
+            continue;
+        // Eerst aankondigen: andere producers zien de nieuwe cursor pas samen met 'dropping'
+        atomic_fetch_add(&shard->dropping, 1);
+        if (atomic_compare_exchange_strong(&cursor->value, &oldest, oldest + 1)) {
+            atomic_fetch_add_explicit(&shard->dropped_oldest, 1, memory_order_relaxed);
+            // De consumer kan dit slot net aan het kopieren zijn -> wachten tot hij klaar is voor we het overschrijven
+            while (atomic_load(&cursor->reading))
+                sched_yield();
+        }
+        atomic_fetch_sub(&shard->dropping, 1);
+    }
+}
+
+/**
+ * \return true if the reading of sensor 'id' should be kept while its shard is above the downsample threshold
+ */
+static bool downsample_keeps(sbuffer_t* buffer, sbuffer_shard_t* shard, sensor_id_t id, uint64_t sequence) {
+    if (depth_at(buffer, shard, sequence) < buffer->downsample_threshold)
+        return true;
+    return atomic_fetch_add_explicit(&buffer->sensor_counts[id], 1, memory_order_relaxed) % buffer->downsample_factor == 0;
+}
+
+static void update_high_water(sbuffer_t* buffer, sbuffer_shard_t* shard, uint64_t sequence) {
+    // Diepte net na deze insert: alles wat nog niet door alle consumers gezien is
+    size_t depth = depth_at(buffer, shard, sequence + 1);
+    size_t high_water = atomic_load_explicit(&shard->high_water, memory_order_relaxed);
+    while (depth > high_water &&
+           !atomic_compare_exchange_weak_explicit(&shard->high_water, &high_water, depth, memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+static void wait_for_space(sbuffer_t* buffer, sbuffer_shard_t* shard, uint64_t sequence) {
+    for (int i = 0; i < SBUFFER_SPIN_LIMIT; i++) {
+        if (has_space(buffer, shard, sequence) || atomic_load(&buffer->closed))
+            return;
+        sched_yield();
+    }
+
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&shard->mutex) == 0);
+    atomic_fetch_add(&shard->sleeping_producers, 1);
+    while (!has_space(buffer, shard, sequence) && !atomic_load(&buffer->closed)) {
+        ASSERT_ELSE_PERROR(pthread_cond_wait(&shard->space_available, &shard->mutex) == 0);
+    }
+    atomic_fetch_sub(&shard->sleeping_producers, 1);
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&shard->mutex) == 0);
+}
+
+bool sbuffer_policy_from_string(const char* name, sbuffer_policy_t* policy) {
+    static const char* const names[] = {
+        [SBUFFER_BLOCK] = "block",
+        [SBUFFER_DROP_OLDEST] = "drop-oldest",
+        [SBUFFER_DROP_NEWEST] = "drop-newest",
+        [SBUFFER_DOWNSAMPLE] = "downsample",
     };
-    return node;
+    for (size_t i = 0; i < sizeof(names) / sizeof(*names); i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *policy = i;
+            return true;
+        }
+    }
+    return false;
 }
 
 sbuffer_t* sbuffer_create() {
+    sbuffer_config_t config = SBUFFER_DEFAULT_CONFIG;
+    return sbuffer_create_with_config(&config);
+}
+
+static void shard_init(sbuffer_t* buffer, sbuffer_shard_t* shard, unsigned index, const sbuffer_config_t* config) {
+    size_t slab_size = buffer->capacity * sizeof(*shard->slots);
+    slab_size = (slab_size + SBUFFER_CACHE_LINE - 1) / SBUFFER_CACHE_LINE * SBUFFER_CACHE_LINE;
+    shard->slots = aligned_alloc(SBUFFER_CACHE_LINE, slab_size);
+    assert(shard->slots != NULL);
+    // memset ipv calloc: raakt elke page aan zodat de eerste inserts geen page faults meer geven
+    memset(shard->slots, 0, slab_size);
+    atomic_init(&shard->claim.value, 0);
+    for (int i = 0; i < SBUFFER_MAX_CONSUMERS; i++) {
+        atomic_init(&shard->consumers[i].value, CONSUMER_INACTIVE);
+        atomic_init(&shard->consumers[i].reading, false);
+    }
+    atomic_init(&shard->dropping, 0);
+    atomic_init(&shard->sleeping_producers, 0);
+    ASSERT_ELSE_PERROR(pthread_mutex_init(&shard->mutex, NULL) == 0);
+    ASSERT_ELSE_PERROR(pthread_cond_init(&shard->space_available, NULL) == 0);
+    shard->spill = NULL;
+    if (config->spill_dir != NULL) {
+        // Elke shard zijn eigen segment files
+        char name[32];
+        snprintf(name, sizeof(name), "sbuffer-%u", index);
+        shard->spill = spill_log_open(config->spill_dir, name, config->spill_segment_records);
+        assert(shard->spill != NULL);
+    }
+    atomic_init(&shard->spilling, false);
+    ASSERT_ELSE_PERROR(pthread_mutex_init(&shard->spill_mutex, NULL) == 0);
+    atomic_init(&shard->high_water, 0);
+    atomic_init(&shard->blocked, 0);
+    atomic_init(&shard->dropped_oldest, 0);
+    atomic_init(&shard->dropped_newest, 0);
+    atomic_init(&shard->downsampled, 0);
+    atomic_init(&shard->spilled, 0);
+    atomic_init(&shard->spill_failed, 0);
+}
+
+sbuffer_t* sbuffer_create_with_config(const sbuffer_config_t* config) {
+    assert(config && config->capacity > 0);
+    assert(config->shards > 0 && config->shards <= SBUFFER_MAX_SHARDS);
+    assert(config->policy != SBUFFER_DOWNSAMPLE || config->downsample_factor > 0);
+    // Afronden naar de volgende macht van 2 -> index is sequence & mask
+    size_t rounded = 1;
+    while (rounded < config->capacity)
+        rounded <<= 1;
+
     // Geen synchronisatie nodig -> niemand kan er al aan
-    sbuffer_t* buffer = malloc(sizeof(sbuffer_t));
+    sbuffer_t* buffer = aligned_alloc(SBUFFER_CACHE_LINE, sizeof(sbuffer_t));
     // should never fail due to optimistic memory allocation
     assert(buffer != NULL);
 
-    buffer->head = NULL;
-    buffer->storagemgr_tail = NULL;
-    buffer->datamgr_tail = NULL;
-    buffer->closed = false;
+    buffer->capacity = rounded;
+    buffer->mask = rounded - 1;
+    buffer->policy = config->policy;
+    buffer->downsample_threshold = rounded / 2;
+    buffer->downsample_factor = config->downsample_factor;
+    buffer->sensor_counts = NULL;
+    if (config->policy == SBUFFER_DOWNSAMPLE) {
+        buffer->sensor_counts = calloc((size_t) UINT16_MAX + 1, sizeof(*buffer->sensor_counts));
+        assert(buffer->sensor_counts != NULL);
+    }
+    buffer->spill_threshold = config->spill_threshold != 0 && config->spill_threshold < rounded ? config->spill_threshold : rounded * 3 / 4;
+    buffer->shard_count = config->shards;
+    buffer->shards = aligned_alloc(SBUFFER_CACHE_LINE, config->shards * sizeof(*buffer->shards));
+    assert(buffer->shards != NULL);
+    for (unsigned i = 0; i < config->shards; i++)
+        shard_init(buffer, &buffer->shards[i], i, config);
+    atomic_init(&buffer->consumer_limit, 0);
+    atomic_init(&buffer->closed, false);
+    atomic_init(&buffer->sleeping_mask, 0);
+    for (int i = 0; i < SBUFFER_MAX_CONSUMERS; i++) {
+        sbuffer_waiter_t* waiter = &buffer->waiters[i];
+        ASSERT_ELSE_PERROR(pthread_mutex_init(&waiter->mutex, NULL) == 0);
+        ASSERT_ELSE_PERROR(pthread_cond_init(&waiter->wakeup, NULL) == 0);
+        atomic_init(&waiter->wait_shard, WAIT_ANY_SHARD);
+        atomic_init(&waiter->wait_for, 0);
+        atomic_init(&waiter->shard_mask, 0);
+        waiter->next_shard = 0;
+        waiter->peek_shard = NULL;
+        waiter->eventfd = -1;
+    }
     ASSERT_ELSE_PERROR(pthread_mutex_init(&buffer->mutex, NULL) == 0);
-    ASSERT_ELSE_PERROR(pthread_cond_init(&buffer->data_available, NULL) == 0);
     return buffer;
 }
 
 void sbuffer_destroy(sbuffer_t* buffer) {
     assert(buffer);
-    // make sure it's empty
-    assert(buffer->head == buffer->storagemgr_tail && buffer->head == buffer->datamgr_tail);
+    for (unsigned i = 0; i < buffer->shard_count; i++) {
+        sbuffer_shard_t* shard = &buffer->shards[i];
+        // make sure it's empty
+        assert(depth_at(buffer, shard, atomic_load(&shard->claim.value)) == 0);
+        ASSERT_ELSE_PERROR(pthread_mutex_destroy(&shard->mutex) == 0);
+        ASSERT_ELSE_PERROR(pthread_cond_destroy(&shard->space_available) == 0);
+        ASSERT_ELSE_PERROR(pthread_mutex_destroy(&shard->spill_mutex) == 0);
+        if (shard->spill != NULL)
+            spill_log_close(shard->spill);
+        free(shard->slots);
+    }
     ASSERT_ELSE_PERROR(pthread_mutex_destroy(&buffer->mutex) == 0);
-    ASSERT_ELSE_PERROR(pthread_cond_destroy(&buffer->data_available) == 0);
+    for (int i = 0; i < SBUFFER_MAX_CONSUMERS; i++) {
+        sbuffer_waiter_t* waiter = &buffer->waiters[i];
+        ASSERT_ELSE_PERROR(pthread_mutex_destroy(&waiter->mutex) == 0);
+        ASSERT_ELSE_PERROR(pthread_cond_destroy(&waiter->wakeup) == 0);
+        if (waiter->eventfd >= 0)
+            close(waiter->eventfd);
+    }
 
+    free(buffer->sensor_counts);
+    free(buffer->shards);
     free(buffer);
 }
 
-bool sbuffer_is_closed_and_empty(sbuffer_t* buffer, bool fromDatamgr) {
-    // Read only
-    assert(buffer);
+int sbuffer_register_consumer(sbuffer_t* buffer) {
+    return sbuffer_register_partial_consumer(buffer, 0, 1);
+}
+
+int sbuffer_register_partial_consumer(sbuffer_t* buffer, unsigned part, unsigned parts) {
+    assert(buffer && part < parts);
+    if (buffer->shard_count % parts != 0)
+        return SBUFFER_FAILURE;
+    uint64_t shard_mask = 0;
+    for (unsigned i = part; i < buffer->shard_count; i += parts)
+        shard_mask |= 1ULL << i;
+
+    // Registreren is zeldzaam -> mutex om twee registraties niet dezelfde plaats te laten nemen
     ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
-    bool ret;
-    if (fromDatamgr) {
-        ret = buffer->closed && buffer->datamgr_tail == NULL;
-    } else {
-        ret = buffer->closed && buffer->storagemgr_tail == NULL;
+    int consumer = 0;
+    while (consumer < SBUFFER_MAX_CONSUMERS && atomic_load(&buffer->waiters[consumer].shard_mask) != 0)
+        consumer++;
+    if (consumer == SBUFFER_MAX_CONSUMERS) {
+        ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
+        return SBUFFER_FAILURE;
     }
+
+    int limit = atomic_load(&buffer->consumer_limit);
+    if (consumer >= limit)
+        atomic_store(&buffer->consumer_limit, consumer + 1);
+    // De cursors van de andere shards blijven CONSUMER_INACTIVE -> hun producers wachten nooit op ons
+    for (unsigned i = part; i < buffer->shard_count; i += parts) {
+        sbuffer_shard_t* shard = &buffer->shards[i];
+        sbuffer_cursor_t* cursor = &shard->consumers[consumer];
+        // Nieuwe consumer ziet enkel readings vanaf nu. Een producer die ons nog niet zag kan hoogstens
+        // een slot claimen tot aan de claim van na onze store, dus zolang dat minder dan een volle ring
+        // verder is wordt er niets overschreven dat wij nog moeten lezen.
+        uint64_t start;
+        do {
+            start = atomic_load(&shard->claim.value);
+            atomic_store(&cursor->value, start);
+        } while (atomic_load(&shard->claim.value) - start >= buffer->capacity);
+    }
+    buffer->waiters[consumer].next_shard = part;
+    atomic_store(&buffer->waiters[consumer].shard_mask, shard_mask);
     ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
-    return ret;
+    return consumer;
+}
+
+void sbuffer_unregister_consumer(sbuffer_t* buffer, int consumer) {
+    assert(buffer);
+    check_consumer(buffer, consumer);
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
+    for (unsigned i = 0; i < buffer->shard_count; i++)
+        atomic_store(&buffer->shards[i].consumers[consumer].value, CONSUMER_INACTIVE);
+    sbuffer_waiter_t* waiter = &buffer->waiters[consumer];
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&waiter->mutex) == 0);
+    atomic_fetch_and(&buffer->sleeping_mask, ~(1u << consumer));
+    if (waiter->eventfd >= 0)
+        close(waiter->eventfd);
+    waiter->eventfd = -1;
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&waiter->mutex) == 0);
+    // Als laatste: het masker bepaalt of de plaats vrij is
+    atomic_store(&waiter->shard_mask, 0);
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
+    // Deze consumer hield misschien slots bezet
+    for (unsigned i = 0; i < buffer->shard_count; i++)
+        wake_producers(&buffer->shards[i]);
+}
+
+size_t sbuffer_consumer_lag(sbuffer_t* buffer, int consumer) {
+    assert(buffer);
+    check_consumer(buffer, consumer);
+    size_t lag = 0;
+    for (unsigned i = 0; i < buffer->shard_count; i++) {
+        if (!reads_shard(buffer, consumer, i))
+            continue;
+        sbuffer_shard_t* shard = &buffer->shards[i];
+        uint64_t cursor = atomic_load(&shard->consumers[consumer].value);
+        uint64_t claimed = atomic_load(&shard->claim.value);
+        lag += claimed > cursor ? claimed - cursor : 0;
+    }
+    return lag;
+}
+
+int sbuffer_consumer_eventfd(sbuffer_t* buffer, int consumer) {
+    assert(buffer);
+    check_consumer(buffer, consumer);
+    sbuffer_waiter_t* waiter = &buffer->waiters[consumer];
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&waiter->mutex) == 0);
+    if (waiter->eventfd < 0) {
+        waiter->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        ASSERT_ELSE_PERROR(waiter->eventfd >= 0);
+    }
+    int fd = waiter->eventfd;
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&waiter->mutex) == 0);
+    return fd;
+}
+
+bool sbuffer_consumer_arm(sbuffer_t* buffer, int consumer) {
+    assert(buffer);
+    check_consumer(buffer, consumer);
+    sbuffer_waiter_t* waiter = &buffer->waiters[consumer];
+    assert(waiter->eventfd >= 0);
+
+    eventfd_t ignored;
+    // Oude notificatie wegwerken, anders wordt epoll meteen terug wakker
+    eventfd_read(waiter->eventfd, &ignored);
+    announce_wait(buffer, consumer, 1);
+    // Zelfde volgorde als wait_for_data: eerst de bit, dan opnieuw kijken
+    if (count_available(buffer, consumer, 1) > 0 || atomic_load(&buffer->closed)) {
+        atomic_fetch_and(&buffer->sleeping_mask, ~(1u << consumer));
+        return false;
+    }
+    return true;
+}
+
+bool sbuffer_is_closed_and_empty(sbuffer_t* buffer, int consumer) {
+    // Read only
+    assert(buffer);
+    check_consumer(buffer, consumer);
+    return is_closed_and_drained(buffer, consumer);
+}
+
+static void publish_slot(sbuffer_t* buffer, sbuffer_shard_t* shard, uint64_t sequence, uint64_t flags) {
+    sbuffer_slot_t* slot = &shard->slots[sequence & buffer->mask];
+    // seq_cst: moet voor de load van sleeping_mask in wake_consumers geordend zijn
+    atomic_store(&slot->published, (sequence + 1) | flags);
+
+    update_high_water(buffer, shard, sequence);
+}
+
+static void publish(sbuffer_t* buffer, sbuffer_shard_t* shard, uint64_t sequence, const sensor_data_t* data) {
+    shard->slots[sequence & buffer->mask].data = *data;
+    publish_slot(buffer, shard, sequence, 0);
+}
+
+/**
+ * Moves readings from the spill log of 'shard' back into its ring as long as it stays below the spill threshold
+ * Never blocks, the caller holds the shard's spill_mutex.
+ */
+static void spill_refill_locked(sbuffer_t* buffer, sbuffer_shard_t* shard) {
+    sensor_data_t batch[SBUFFER_REFILL_BATCH];
+    while (true) {
+        // Eerst kijken hoeveel er in de ring bij mag, pas dan van schijf lezen
+        uint64_t sequence = atomic_load_explicit(&shard->claim.value, memory_order_relaxed);
+        size_t depth = depth_at(buffer, shard, sequence);
+        if (depth >= buffer->spill_threshold)
+            break;
+        size_t room = buffer->spill_threshold - depth;
+        size_t count = spill_log_peek(shard->spill, batch, room < SBUFFER_REFILL_BATCH ? room : SBUFFER_REFILL_BATCH);
+        if (count == 0)
+            break;
+        size_t moved = 0;
+        uint64_t first = sequence;
+        while (moved < count) {
+            if (depth_at(buffer, shard, sequence) >= buffer->spill_threshold)
+                break;
+            if (!atomic_compare_exchange_weak_explicit(&shard->claim.value, &sequence, sequence + 1,
+                                                       memory_order_acq_rel, memory_order_relaxed))
+                continue;
+            if (moved == 0)
+                first = sequence;
+            publish(buffer, shard, sequence, &batch[moved++]);
+            sequence++;
+        }
+        if (moved == 0)
+            break;
+        spill_log_pop(shard->spill, moved);
+        // Vanaf de eerste verhuisde reading: een consumer kan op eender welke ervan wachten
+        wake_consumers(buffer, shard - buffer->shards, first);
+        if (moved < count)
+            break;
+    }
+    if (spill_log_backlog(shard->spill) == 0)
+        atomic_store(&shard->spilling, false);
+}
+
+/**
+ * \return true if a new reading of 'shard' has to go to its spill log: the ring is above the spill threshold or older readings are still on disk
+ */
+static bool spill_needed(sbuffer_t* buffer, sbuffer_shard_t* shard) {
+    if (shard->spill == NULL)
+        return false;
+    uint64_t sequence = atomic_load_explicit(&shard->claim.value, memory_order_relaxed);
+    return atomic_load(&shard->spilling) || depth_at(buffer, shard, sequence) >= buffer->spill_threshold;
+}
+
+/**
+ * Appends 'data' to the spill log if the shard is above the spill threshold or older readings are still on disk
+ * If the log can not take it while older readings are still on disk, 'data' is dropped: in the ring it would get ahead of them.
+ * \return true if 'data' was handled, 'result' then holds what the insert returns
+ */
+static bool spill_insert(sbuffer_t* buffer, sbuffer_shard_t* shard, const sensor_data_t* data, int* result) {
+    if (!spill_needed(buffer, shard))
+        return false;
+
+    bool handled = false;
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&shard->spill_mutex) == 0);
+    if (spill_needed(buffer, shard)) {
+        if (spill_log_append(shard->spill, data) == SPILL_LOG_SUCCESS) {
+            atomic_store(&shard->spilling, true);
+            atomic_fetch_add_explicit(&shard->spilled, 1, memory_order_relaxed);
+            *result = SBUFFER_SUCCESS;
+            handled = true;
+        } else if (atomic_load(&shard->spilling)) {
+            // Oudere readings van deze shard staan nog op schijf -> in de ring zou deze ze inhalen, dus weg ermee
+            atomic_fetch_add_explicit(&shard->spill_failed, 1, memory_order_relaxed);
+            *result = SBUFFER_DROPPED;
+            handled = true;
+        }
+        // Lukt het niet en staat er niets op schijf -> gewoon de ring gebruiken (met de gekozen policy)
+        spill_refill_locked(buffer, shard);
+    }
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&shard->spill_mutex) == 0);
+    return handled;
+}
+
+/**
+ * Lets a consumer move spilled readings back into the ring, unless another thread is already doing that
+ */
+static void spill_pump(sbuffer_t* buffer, sbuffer_shard_t* shard) {
+    if (shard->spill == NULL || !atomic_load_explicit(&shard->spilling, memory_order_relaxed))
+        return;
+    if (pthread_mutex_trylock(&shard->spill_mutex) != 0)
+        return;
+    spill_refill_locked(buffer, shard);
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&shard->spill_mutex) == 0);
+}
+
+/**
+ * Claims the next slot of 'shard' for a reading of sensor 'id', applying the overload policy while the shard is full
+ * \return SBUFFER_SUCCESS with 'sequence' set to the claimed slot, SBUFFER_DROPPED or SBUFFER_FAILURE
+ */
+static int claim(sbuffer_t* buffer, sbuffer_shard_t* shard, sensor_id_t id, uint64_t* claimed) {
+    uint64_t sequence = atomic_load_explicit(&shard->claim.value, memory_order_relaxed);
+    if (buffer->policy == SBUFFER_DOWNSAMPLE && !downsample_keeps(buffer, shard, id, sequence)) {
+        atomic_fetch_add_explicit(&shard->downsampled, 1, memory_order_relaxed);
+        return SBUFFER_DROPPED;
+    }
+    bool delayed = false;
+    while (true) {
+        if (atomic_load_explicit(&buffer->closed, memory_order_relaxed))
+            return SBUFFER_FAILURE;
+        if (!has_space(buffer, shard, sequence)) {
+            switch (buffer->policy) {
+            case SBUFFER_DROP_NEWEST:
+                atomic_fetch_add_explicit(&shard->dropped_newest, 1, memory_order_relaxed);
+                return SBUFFER_DROPPED;
+            case SBUFFER_DROP_OLDEST:
+                drop_oldest(buffer, shard, sequence);
+                break;
+            default:
+                // Vol -> wachten tot de traagste consumer een slot vrijgeeft
+                if (!delayed)
+                    atomic_fetch_add_explicit(&shard->blocked, 1, memory_order_relaxed);
+                delayed = true;
+                wait_for_space(buffer, shard, sequence);
+                break;
+            }
+            sequence = atomic_load_explicit(&shard->claim.value, memory_order_relaxed);
+            continue;
+        }
+        // CAS ipv fetch_add: zo claimen we nooit een slot dat nog niet vrij is
+        if (atomic_compare_exchange_weak_explicit(&shard->claim.value, &sequence, sequence + 1,
+                                                  memory_order_acq_rel, memory_order_relaxed))
+            break;
+    }
+    *claimed = sequence;
+    return SBUFFER_SUCCESS;
 }
 
 int sbuffer_insert_first(sbuffer_t* buffer, sensor_data_t const* data) {
     // Write only
     assert(buffer && data);
-    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
-    
-    if (buffer->closed) {
-        ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
+    sbuffer_shard_t* shard = shard_of(buffer, data->id);
+
+    if (shard->spill != NULL) {
+        if (atomic_load_explicit(&buffer->closed, memory_order_relaxed))
+            return SBUFFER_FAILURE;
+        int result;
+        if (spill_insert(buffer, shard, data, &result))
+            return result;
+    }
+
+    uint64_t sequence;
+    int result = claim(buffer, shard, data->id, &sequence);
+    if (result != SBUFFER_SUCCESS)
+        return result;
+    publish(buffer, shard, sequence, data);
+
+    // Terug data in de buffer -> consumers die hierop wachten wakker maken
+    wake_consumers(buffer, shard - buffer->shards, sequence);
+    return SBUFFER_SUCCESS;
+}
+
+int sbuffer_reserve(sbuffer_t* buffer, sensor_id_t id, sbuffer_reservation_t* reservation) {
+    assert(buffer && reservation);
+    sbuffer_shard_t* shard = shard_of(buffer, id);
+    reservation->shard = shard;
+    reservation->data = &reservation->fallback;
+    reservation->fallback.id = id;
+
+    if (atomic_load_explicit(&buffer->closed, memory_order_relaxed)) {
+        reservation->state = RESERVED_CLOSED;
         return SBUFFER_FAILURE;
     }
+    // Readings op schijf moeten eerst -> deze reading gaat via de gewone weg
+    if (spill_needed(buffer, shard)) {
+        reservation->state = RESERVED_FALLBACK;
+        return SBUFFER_SUCCESS;
+    }
+    switch (claim(buffer, shard, id, &reservation->sequence)) {
+    case SBUFFER_SUCCESS:
+        reservation->state = RESERVED_SLOT;
+        reservation->data = &shard->slots[reservation->sequence & buffer->mask].data;
+        reservation->data->id = id;
+        return SBUFFER_SUCCESS;
+    case SBUFFER_DROPPED:
+        reservation->state = RESERVED_DROPPED;
+        return SBUFFER_SUCCESS;
+    default:
+        reservation->state = RESERVED_CLOSED;
+        return SBUFFER_FAILURE;
+    }
+}
 
-    // create new node
-    sbuffer_node_t* node = create_node(data);
-    assert(node->prev == NULL);
+int sbuffer_commit(sbuffer_t* buffer, sbuffer_reservation_t* reservation) {
+    assert(buffer && reservation);
+    sbuffer_shard_t* shard = reservation->shard;
+    switch (reservation->state) {
+    case RESERVED_SLOT:
+        publish_slot(buffer, shard, reservation->sequence, 0);
+        wake_consumers(buffer, shard - buffer->shards, reservation->sequence);
+        return SBUFFER_SUCCESS;
+    case RESERVED_FALLBACK:
+        return sbuffer_insert_first(buffer, &reservation->fallback);
+    case RESERVED_DROPPED:
+        return SBUFFER_DROPPED;
+    default:
+        return SBUFFER_FAILURE;
+    }
+}
+
+void sbuffer_cancel(sbuffer_t* buffer, sbuffer_reservation_t* reservation) {
+    assert(buffer && reservation);
+    if (reservation->state != RESERVED_SLOT)
+        return;
+    sbuffer_shard_t* shard = reservation->shard;
+    publish_slot(buffer, shard, reservation->sequence, SLOT_CANCELLED);
+    wake_consumers(buffer, shard - buffer->shards, reservation->sequence);
+}
+
+int sbuffer_remove_last(sbuffer_t* buffer, int consumer, sensor_data_t* data) {
+    return sbuffer_remove_batch(buffer, consumer, data, 1, 1, -1) == 1 ? SBUFFER_SUCCESS : SBUFFER_NO_DATA;
+}
 
-    // insert it
-    if (buffer->head != NULL)
-        // Niet empty
-        buffer->head->prev = node;
-    buffer->head = node;
-    if (buffer->datamgr_tail == NULL) {
-        // datamgr empty
-        buffer->datamgr_tail = node;
+/**
+ * \return the number of readings copied from the 'count' published slots of 'shard' from 'sequence' on, cancelled slots are skipped
+ */
+static size_t copy_slots(sbuffer_t* buffer, sbuffer_shard_t* shard, uint64_t sequence, sensor_data_t* out, size_t count) {
+    size_t copied = 0;
+    for (size_t i = 0; i < count; i++) {
+        sbuffer_slot_t* slot = &shard->slots[(sequence + i) & buffer->mask];
+        if (!slot_is_cancelled(slot))
+            out[copied++] = slot->data;
     }
-    if (buffer->storagemgr_tail == NULL) {
-        // storagemgr empty
-        buffer->storagemgr_tail = node;
+    return copied;
+}
+
+/**
+ * Copies the readings in 'count' published slots of 'shard' from 'sequence' on to 'out' and moves the cursor past them
+ * \param copied set to the number of readings in 'out'
+ * \return false if a producer dropped some of them in the meantime (SBUFFER_DROP_OLDEST), nothing is consumed then
+ */
+static bool consume(sbuffer_t* buffer, sbuffer_shard_t* shard, sbuffer_cursor_t* cursor, uint64_t sequence, sensor_data_t* out, size_t count, size_t* copied) {
+    if (buffer->policy != SBUFFER_DROP_OLDEST) {
+        // Enkel deze consumer schrijft zijn eigen cursor
+        *copied = copy_slots(buffer, shard, sequence, out, count);
+        atomic_store(&cursor->value, sequence + count);
+        return true;
     }
-    
-    // Terug data in de buffer -> threads wakker maken
-    ASSERT_ELSE_PERROR(pthread_cond_broadcast(&buffer->data_available) == 0);
-    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
-    return SBUFFER_SUCCESS;
+
+    // Producers kunnen onze cursor vooruit zetten -> eerst aankondigen dat we lezen, dan pas kopieren
+    atomic_store(&cursor->reading, true);
+    bool consumed = false;
+    if (atomic_load(&cursor->value) == sequence) {
+        *copied = copy_slots(buffer, shard, sequence, out, count);
+        consumed = atomic_compare_exchange_strong(&cursor->value, &sequence, sequence + count);
+    }
+    atomic_store(&cursor->reading, false);
+    return consumed;
 }
 
-sensor_data_t sbuffer_remove_last(sbuffer_t* buffer, bool fromDatamgr) {
-    assert(buffer);
-    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
-    if (buffer->head == NULL) {
-        // Is empty -> wachten tot nieuwe data
-        ASSERT_ELSE_PERROR(pthread_cond_wait(&buffer->data_available, &buffer->mutex) == 0);
-    }
-    else {
-        if (fromDatamgr && buffer->datamgr_tail == NULL) {
-            // Datamgr heeft alles al gezien tot nu toe
-            ASSERT_ELSE_PERROR(pthread_cond_wait(&buffer->data_available, &buffer->mutex) == 0);
+/**
+ * Removes up to 'max' published readings, visiting the shards round-robin so a busy shard cannot starve the others
+ * The readings of one shard stay in order in 'out'.
+ * \return the number of readings in 'out', can be 0 if only cancelled slots were found
+ */
+static size_t consume_shards(sbuffer_t* buffer, int consumer, sensor_data_t* out, size_t max) {
+    sbuffer_waiter_t* waiter = &buffer->waiters[consumer];
+    size_t count = 0;
+    for (unsigned i = 0; i < buffer->shard_count && count < max; i++) {
+        unsigned index = (waiter->next_shard + i) % buffer->shard_count;
+        if (!reads_shard(buffer, consumer, index))
+            continue;
+        sbuffer_shard_t* shard = &buffer->shards[index];
+        sbuffer_cursor_t* cursor = &shard->consumers[consumer];
+        uint64_t sequence = atomic_load_explicit(&cursor->value, memory_order_acquire);
+        size_t published = count_published(buffer, shard, sequence, max - count);
+        size_t copied;
+        if (published == 0 || !consume(buffer, shard, cursor, sequence, out + count, published, &copied))
+            continue;
+        count += copied;
+        // Slots zijn pas vrij als alle consumers voorbij zijn, zie min_consumer_cursor
+        wake_producers(shard);
+        spill_pump(buffer, shard);
+    }
+    waiter->next_shard = (waiter->next_shard + 1) % buffer->shard_count;
+    return count;
+}
+
+/**
+ * Waits until the consumer has at least 'min_count' published slots, the buffer gets closed or 'deadline' (if not NULL) passes
+ * \return the number of published slots (at most 'max'), 0 on timeout, or SBUFFER_FAILURE if the buffer is closed and drained
+ */
+static ssize_t wait_available(sbuffer_t* buffer, int consumer, size_t max, size_t min_count, const struct timespec* deadline) {
+    while (true) {
+        size_t count = count_available(buffer, consumer, max);
+        if (count < min_count) {
+            // Misschien zit er nog data op schijf
+            for (unsigned i = 0; i < buffer->shard_count; i++)
+                if (reads_shard(buffer, consumer, i))
+                    spill_pump(buffer, &buffer->shards[i]);
+            count = count_available(buffer, consumer, max);
         }
-        else if (!fromDatamgr && buffer->storagemgr_tail == NULL) {
-            // Storagemgr heeft alles al gezien tot nu toe
-            ASSERT_ELSE_PERROR(pthread_cond_wait(&buffer->data_available, &buffer->mutex) == 0);
+        if (count < min_count) {
+            if (wait_for_data(buffer, consumer, min_count, deadline))
+                continue;
+            // Timeout of gesloten: nemen wat er is
+            count = count_available(buffer, consumer, max);
+            if (count == 0 && atomic_load(&buffer->closed) && !is_closed_and_drained(buffer, consumer)) {
+                // Gesloten maar een producer is nog bezig met publiceren
+                sched_yield();
+                continue;
+            }
         }
+        if (count == 0)
+            // Gesloten en deze consumer heeft alles al gezien?
+            return is_closed_and_drained(buffer, consumer) ? SBUFFER_FAILURE : 0;
+        return count;
     }
-    sbuffer_node_t* removed_node;
-    if (fromDatamgr) {
-        removed_node = buffer->datamgr_tail;
-    }
-    else {
-        removed_node = buffer->storagemgr_tail;
-    }
-    // Nu zit de laatst mogelijke node die nog niet gezien is door de datamgr/storagemgr in removed_node
-
-    sensor_data_t ret;
-    // Dit is normaal gezien altijd waar in ons geval, tenzij bij het afsluiten
-    if (removed_node != NULL) {
-        ret = removed_node->data;
-
-        // Komt van de datamgr en deze heeft het nog niet gezien -> nu wel dus
-        if (fromDatamgr) {
-            removed_node->seenByDatamgr = true;
-            buffer->datamgr_tail = removed_node->prev;
-        } 
-        // Komt van de storagemgr en deze heeft het nog niet gezien -> nu wel dus
-        else if (!fromDatamgr) {
-            removed_node->seenByStoragemgr = true;
-            buffer->storagemgr_tail = removed_node->prev;
-        }
-        // Beide hebben het gezien -> mag verwijdert worden
-        if (removed_node->seenByDatamgr && removed_node->seenByStoragemgr) {
-            if (removed_node == buffer->head) {
-                buffer->head = NULL;
+}
+
+ssize_t sbuffer_remove_batch(sbuffer_t* buffer, int consumer, sensor_data_t* out, size_t max, size_t min_count, int timeout_ms) {
+    assert(buffer && out);
+    check_consumer(buffer, consumer);
+    assert(buffer->waiters[consumer].peek_shard == NULL);
+    // Alle readings kunnen in dezelfde shard zitten -> meer dan een ring vol kan nooit gegarandeerd worden
+    if (min_count > buffer->capacity)
+        min_count = buffer->capacity;
+    // Zolang een shard spilt houdt zijn ring er nooit meer dan spill_threshold
+    if (buffer->shards[0].spill != NULL && min_count > buffer->spill_threshold)
+        min_count = buffer->spill_threshold;
+    if (min_count > max)
+        min_count = max;
+
+    struct timespec deadline;
+    if (timeout_ms >= 0)
+        deadline_after(&deadline, timeout_ms);
+
+    while (true) {
+        ssize_t available = wait_available(buffer, consumer, max, min_count, timeout_ms >= 0 ? &deadline : NULL);
+        if (available <= 0)
+            return available;
+        size_t count = consume_shards(buffer, consumer, out, max);
+        if (count > 0)
+            return count;
+    }
+}
+
+/**
+ * Points 'out' at up to 'max' readings of the first shard (round-robin) that has published slots for this consumer
+ * \return the number of pointers in 'out', 0 if nothing was found or only cancelled slots
+ */
+static size_t peek_shards(sbuffer_t* buffer, int consumer, const sensor_data_t** out, size_t max) {
+    sbuffer_waiter_t* waiter = &buffer->waiters[consumer];
+    for (unsigned i = 0; i < buffer->shard_count; i++) {
+        unsigned index = (waiter->next_shard + i) % buffer->shard_count;
+        if (!reads_shard(buffer, consumer, index))
+            continue;
+        sbuffer_shard_t* shard = &buffer->shards[index];
+        sbuffer_cursor_t* cursor = &shard->consumers[consumer];
+        uint64_t sequence = atomic_load_explicit(&cursor->value, memory_order_acquire);
+        size_t published = count_published(buffer, shard, sequence, max);
+        if (published == 0)
+            continue;
+        if (buffer->policy == SBUFFER_DROP_OLDEST) {
+            // Zoals in consume, maar 'reading' blijft aan tot sbuffer_release -> producers wachten zolang
+            atomic_store(&cursor->reading, true);
+            if (atomic_load(&cursor->value) != sequence) {
+                atomic_store(&cursor->reading, false);
+                continue;
             }
-            free(removed_node);
         }
+        waiter->next_shard = (index + 1) % buffer->shard_count;
+        waiter->peek_shard = shard;
+        waiter->peek_sequence = sequence;
+        waiter->peek_slots = published;
+        size_t count = 0;
+        for (size_t j = 0; j < published; j++) {
+            sbuffer_slot_t* slot = &shard->slots[(sequence + j) & buffer->mask];
+            if (!slot_is_cancelled(slot))
+                out[count++] = &slot->data;
+        }
+        if (count > 0)
+            return count;
+        sbuffer_release(buffer, consumer);
     }
-    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
-    return ret;
+    return 0;
+}
+
+ssize_t sbuffer_peek(sbuffer_t* buffer, int consumer, const sensor_data_t** out, size_t max, int timeout_ms) {
+    assert(buffer && out);
+    check_consumer(buffer, consumer);
+    assert(buffer->waiters[consumer].peek_shard == NULL);
+
+    struct timespec deadline;
+    if (timeout_ms >= 0)
+        deadline_after(&deadline, timeout_ms);
+
+    while (true) {
+        ssize_t available = wait_available(buffer, consumer, max, 1, timeout_ms >= 0 ? &deadline : NULL);
+        if (available <= 0)
+            return available;
+        size_t count = peek_shards(buffer, consumer, out, max);
+        if (count > 0)
+            return count;
+    }
+}
+
+void sbuffer_release(sbuffer_t* buffer, int consumer) {
+    assert(buffer);
+    check_consumer(buffer, consumer);
+    sbuffer_waiter_t* waiter = &buffer->waiters[consumer];
+    sbuffer_shard_t* shard = waiter->peek_shard;
+    if (shard == NULL)
+        return;
+    sbuffer_cursor_t* cursor = &shard->consumers[consumer];
+    uint64_t end = waiter->peek_sequence + waiter->peek_slots;
+    if (buffer->policy != SBUFFER_DROP_OLDEST) {
+        atomic_store(&cursor->value, end);
+    } else {
+        // Producers kunnen de cursor intussen voorbij onze readings gezet hebben, nooit achteruit
+        uint64_t current = atomic_load(&cursor->value);
+        while (current < end && !atomic_compare_exchange_weak(&cursor->value, &current, end))
+            ;
+        atomic_store(&cursor->reading, false);
+    }
+    waiter->peek_shard = NULL;
+    // Slots zijn pas vrij als alle consumers voorbij zijn, zie min_consumer_cursor
+    wake_producers(shard);
+    spill_pump(buffer, shard);
 }
 
 void sbuffer_close(sbuffer_t* buffer) {
     assert(buffer);
-    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
-    
-    buffer->closed = true;
-    ASSERT_ELSE_PERROR(pthread_cond_broadcast(&buffer->data_available) == 0);
-    
-    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
+    atomic_store(&buffer->closed, true);
+    for (unsigned i = 0; i < buffer->shard_count; i++) {
+        sbuffer_shard_t* shard = &buffer->shards[i];
+        ASSERT_ELSE_PERROR(pthread_mutex_lock(&shard->mutex) == 0);
+        ASSERT_ELSE_PERROR(pthread_cond_broadcast(&shard->space_available) == 0);
+        ASSERT_ELSE_PERROR(pthread_mutex_unlock(&shard->mutex) == 0);
+    }
+
+    // Alle consumers wakker maken, ook wie via eventfd wacht
+    int limit = atomic_load(&buffer->consumer_limit);
+    for (int i = 0; i < limit; i++) {
+        atomic_fetch_and(&buffer->sleeping_mask, ~(1u << i));
+        notify_consumer(buffer, i);
+    }
+}
+
+void sbuffer_get_stats(sbuffer_t* buffer, sbuffer_stats_t* stats) {
+    assert(buffer && stats);
+    *stats = (sbuffer_stats_t){
+        .capacity = buffer->capacity * buffer->shard_count,
+        .shards = buffer->shard_count,
+        .slowest_consumer = -1,
+    };
+    size_t lag[SBUFFER_MAX_CONSUMERS] = {0};
+    int limit = atomic_load(&buffer->consumer_limit);
+    for (unsigned i = 0; i < buffer->shard_count; i++) {
+        sbuffer_shard_t* shard = &buffer->shards[i];
+        uint64_t claimed = atomic_load(&shard->claim.value);
+        for (int j = 0; j < limit; j++) {
+            uint64_t cursor = atomic_load(&shard->consumers[j].value);
+            if (cursor != CONSUMER_INACTIVE)
+                lag[j] += claimed - cursor;
+        }
+        stats->in_use += depth_at(buffer, shard, claimed);
+        size_t high_water = atomic_load(&shard->high_water);
+        if (high_water > stats->shard_high_water)
+            stats->shard_high_water = high_water;
+        stats->inserted += claimed;
+        stats->blocked += atomic_load_explicit(&shard->blocked, memory_order_relaxed);
+        stats->dropped_oldest += atomic_load_explicit(&shard->dropped_oldest, memory_order_relaxed);
+        stats->dropped_newest += atomic_load_explicit(&shard->dropped_newest, memory_order_relaxed);
+        stats->downsampled += atomic_load_explicit(&shard->downsampled, memory_order_relaxed);
+        stats->spilled += atomic_load_explicit(&shard->spilled, memory_order_relaxed);
+        stats->spill_failed += atomic_load_explicit(&shard->spill_failed, memory_order_relaxed);
+    }
+    for (int j = 0; j < limit; j++) {
+        if (atomic_load(&buffer->waiters[j].shard_mask) == 0)
+            continue;
+        if (stats->slowest_consumer == -1 || lag[j] > stats->max_lag) {
+            stats->slowest_consumer = j;
+            stats->max_lag = lag[j];
+        }
+    }
 }
@@ -11,39 +11,237 @@
 
 #include "config.h"
 
+#include <sys/types.h>
+
 #define SBUFFER_FAILURE -1
 #define SBUFFER_SUCCESS 0
+#define SBUFFER_NO_DATA 1
+#define SBUFFER_DROPPED 2
+
+// default number of slots in the ring, rounded up to a power of two
+#ifndef SBUFFER_CAPACITY
+    #define SBUFFER_CAPACITY 1024
+#endif
+
+// maximum number of consumers that can be registered at the same time
+#ifndef SBUFFER_MAX_CONSUMERS
+    #define SBUFFER_MAX_CONSUMERS 8
+#endif
+
+// maximum number of shards a buffer can be split into
+#ifndef SBUFFER_MAX_SHARDS
+    #define SBUFFER_MAX_SHARDS 64
+#endif
 
 typedef struct sbuffer sbuffer_t;
 
+/**
+ * What sbuffer_insert_first does when the ring is full
+ */
+typedef enum {
+    SBUFFER_BLOCK,       // wait until the slowest consumer frees a slot
+    SBUFFER_DROP_OLDEST, // consumers that are a full ring behind skip their oldest unseen reading
+    SBUFFER_DROP_NEWEST, // discard the reading that is being inserted
+    SBUFFER_DOWNSAMPLE,  // above half capacity only keep every 'downsample_factor'-th reading per sensor, block when full
+} sbuffer_policy_t;
+
+typedef struct {
+    size_t capacity; // number of preallocated slots per shard, rounded up to a power of two
+    // independent rings with their own cursors and producer queue, a sensor always goes to shard 'id % shards'
+    // readings of one sensor stay in order, readings of different sensors in different shards do not
+    unsigned shards;
+    sbuffer_policy_t policy;
+    unsigned downsample_factor; // only used by SBUFFER_DOWNSAMPLE
+    // when not NULL, readings that arrive while more than 'spill_threshold' slots are in use
+    // are appended to segment files in this directory and moved back into the ring in order
+    const char* spill_dir;
+    size_t spill_threshold;       // per shard, 0 means three quarters of the capacity
+    size_t spill_segment_records; // readings per segment file
+} sbuffer_config_t;
+
+#define SBUFFER_DEFAULT_CONFIG                \
+    ((sbuffer_config_t){                       \
+        .capacity = SBUFFER_CAPACITY,          \
+        .shards = 1,                           \
+        .policy = SBUFFER_BLOCK,               \
+        .downsample_factor = 4,                \
+        .spill_dir = NULL,                     \
+        .spill_threshold = 0,                  \
+        .spill_segment_records = 64 * 1024,    \
+    })
+
+typedef struct {
+    size_t capacity;         // number of preallocated slots over all shards
+    unsigned shards;         // number of shards, each with capacity / shards slots
+    size_t in_use;           // slots holding a reading that not every consumer has seen yet
+    // the highest number of slots in use that any single shard reached right after an insert
+    // the shards peak at different times, so this says how close a shard came to full, not how full the buffer got
+    size_t shard_high_water;
+    int slowest_consumer;    // id of the consumer that is furthest behind, -1 if none are registered
+    size_t max_lag;          // number of readings 'slowest_consumer' has not seen yet
+    uint64_t inserted;       // total number of readings inserted
+    uint64_t blocked;        // inserts that had to wait for a free slot
+    uint64_t dropped_oldest; // readings a lagging consumer skipped (SBUFFER_DROP_OLDEST)
+    uint64_t dropped_newest; // inserts discarded because the ring was full (SBUFFER_DROP_NEWEST)
+    uint64_t downsampled;    // inserts discarded by SBUFFER_DOWNSAMPLE
+    uint64_t spilled;        // readings that went through the spill log on disk
+    uint64_t spill_failed;   // inserts discarded because the spill log could not take them while older readings were on disk
+} sbuffer_stats_t;
+
+/**
+ * A slot claimed by sbuffer_reserve, to be filled in place and handed to sbuffer_commit or sbuffer_cancel
+ * Only 'data' is meant to be used by the caller, the other fields belong to the buffer.
+ */
+typedef struct {
+    sensor_data_t* data; // where the reading has to be written, its id is already filled out
+    void* shard;
+    uint64_t sequence;
+    int state;
+    sensor_data_t fallback; // used instead of a slot when the reading cannot go straight into the ring
+} sbuffer_reservation_t;
+
+/**
+ * Looks up a policy by its command line name: block, drop-oldest, drop-newest or downsample
+ * \return false if 'name' is not a policy
+ */
+bool sbuffer_policy_from_string(const char* name, sbuffer_policy_t* policy);
+
 /**
  * Allocate and initialize a new shared buffer
+ * The buffer is a fixed-size ring of SBUFFER_CAPACITY slots with one read cursor per registered consumer.
+ * A slot is only reused once every registered consumer has read it.
  */
 sbuffer_t* sbuffer_create();
 
+/**
+ * Allocate and initialize a new shared buffer with the given capacity and overload policy
+ * All slots are allocated and touched up front, so inserting never allocates memory.
+ */
+sbuffer_t* sbuffer_create_with_config(const sbuffer_config_t* config);
+
 /**
  * Clean up & free all allocated resources
  */
 void sbuffer_destroy(sbuffer_t* buffer);
 
-bool sbuffer_is_closed_and_empty(sbuffer_t* buffer, bool fromDatamgr);
+/**
+ * Registers a new consumer with its own read cursor. It will see every reading inserted from now on.
+ * Register consumers before the first insert if they must not miss anything.
+ * \return the consumer id to pass to the remove functions, or SBUFFER_FAILURE if SBUFFER_MAX_CONSUMERS are registered
+ */
+int sbuffer_register_consumer(sbuffer_t* buffer);
+
+/**
+ * Registers a consumer like sbuffer_register_consumer that only reads the shards s with s % parts == part
+ * Since a sensor always goes to shard id % shards, these are the readings of the sensors with id % parts == part.
+ * The slots of the other shards never wait for this consumer, so 'parts' consumers can split the readings between them.
+ * \return the consumer id, or SBUFFER_FAILURE if SBUFFER_MAX_CONSUMERS are registered or the number of shards is no multiple of 'parts'
+ */
+int sbuffer_register_partial_consumer(sbuffer_t* buffer, unsigned part, unsigned parts);
+
+/**
+ * Removes a consumer, the slots it has not read yet no longer wait for it
+ * The consumer must not be used in any other call anymore.
+ */
+void sbuffer_unregister_consumer(sbuffer_t* buffer, int consumer);
+
+/**
+ * \return the number of inserted readings the given consumer has not removed yet
+ */
+size_t sbuffer_consumer_lag(sbuffer_t* buffer, int consumer);
+
+/**
+ * Returns an eventfd that becomes readable when the given consumer has new readings after sbuffer_consumer_arm
+ * This lets a consumer wait in epoll/poll next to other file descriptors. The buffer owns the fd.
+ */
+int sbuffer_consumer_eventfd(sbuffer_t* buffer, int consumer);
+
+/**
+ * Asks for one notification on the consumer's eventfd as soon as it has a reading to remove
+ * Call this after a non-blocking sbuffer_remove_batch returned 0, right before waiting on the eventfd.
+ * \return false if there already is something to remove (or the buffer is closed), don't wait then
+ */
+bool sbuffer_consumer_arm(sbuffer_t* buffer, int consumer);
+
+/**
+ * \return true if the buffer is closed and the given consumer has read every reading in it
+ */
+bool sbuffer_is_closed_and_empty(sbuffer_t* buffer, int consumer);
 
 
 /**
  * Inserts the sensor data in 'data' at the start of 'buffer' (at the 'head')
+ * What happens while the ring is full, i.e. while the slowest consumer is a full ring behind, depends on the policy.
  * \param buffer a pointer to the buffer that is used
  * \param data a pointer to sensor_data_t data, that will be _copied_ into the buffer
- * \return the current status of the buffer
+ * \return SBUFFER_SUCCESS, SBUFFER_DROPPED if the policy discarded 'data', or SBUFFER_FAILURE if the buffer is closed
  */
 int sbuffer_insert_first(sbuffer_t* buffer, sensor_data_t const* data);
 
 /**
- * Removes & returns the last measurement in the buffer (at the 'tail')
- * \return the removed measurement
+ * Claims the next free slot for a reading of sensor 'id' so it can be decoded straight into the buffer
+ * Blocks or drops like sbuffer_insert_first when the ring is full. The slot is invisible to consumers until
+ * sbuffer_commit, and later readings of the same shard wait for it, so fill it in without blocking.
+ * When the reading cannot go into the ring right away (spilling, dropped, closed), 'data' points to
+ * 'reservation->fallback' instead and sbuffer_commit does what sbuffer_insert_first would have done.
+ * \param reservation filled out, 'reservation->data' always points to writable memory afterwards
+ * \return SBUFFER_SUCCESS, or SBUFFER_FAILURE if the buffer is closed
+ */
+int sbuffer_reserve(sbuffer_t* buffer, sensor_id_t id, sbuffer_reservation_t* reservation);
+
+/**
+ * Makes a reserved reading visible to the consumers
+ * \return SBUFFER_SUCCESS, SBUFFER_DROPPED if the policy discarded the reading, or SBUFFER_FAILURE if the buffer is closed
+ */
+int sbuffer_commit(sbuffer_t* buffer, sbuffer_reservation_t* reservation);
+
+/**
+ * Gives a reserved slot back without a reading, e.g. because the connection broke halfway through a reading
+ * The slot is still published so later readings are not held up, consumers skip it.
  */
-sensor_data_t sbuffer_remove_last(sbuffer_t* buffer, bool fromDatamgr);
+void sbuffer_cancel(sbuffer_t* buffer, sbuffer_reservation_t* reservation);
+
+/**
+ * Removes & returns the last measurement in the buffer (at the 'tail') that this consumer has not seen yet
+ * Blocks until such a measurement is available or the buffer is closed.
+ * \param data will be filled out with the removed measurement
+ * \return SBUFFER_SUCCESS, or SBUFFER_NO_DATA if the buffer is closed and this consumer has seen everything
+ */
+int sbuffer_remove_last(sbuffer_t* buffer, int consumer, sensor_data_t* data);
+
+/**
+ * Removes up to 'max' measurements this consumer has not seen yet, oldest first, in one go
+ * With several shards the shards are drained round-robin: readings of one sensor come out in order,
+ * readings of different sensors may be interleaved differently than they were inserted.
+ * \param out array of at least 'max' elements that will be filled out with the removed measurements
+ * \param min_count block until at least this many measurements are available (0 never blocks), at most the capacity of a shard,
+ * or its spill threshold when the buffer spills to disk
+ * \param timeout_ms give up waiting for 'min_count' measurements after this many milliseconds, -1 waits forever
+ * \return the number of measurements in 'out' (possibly less than 'min_count' on timeout or close),
+ * or SBUFFER_FAILURE if the buffer is closed and this consumer has seen everything
+ */
+ssize_t sbuffer_remove_batch(sbuffer_t* buffer, int consumer, sensor_data_t* out, size_t max, size_t min_count, int timeout_ms);
+
+/**
+ * Waits for readings like sbuffer_remove_batch(buffer, consumer, ..., max, 1, timeout_ms) but does not copy them
+ * The readings all come from one shard and stay in place until sbuffer_release, so release them quickly:
+ * they keep their slots occupied, and with SBUFFER_DROP_OLDEST producers wait for the release.
+ * \param out filled out with up to 'max' pointers into the buffer
+ * \return the number of pointers in 'out', 0 on timeout, or SBUFFER_FAILURE if the buffer is closed and this consumer has seen everything
+ */
+ssize_t sbuffer_peek(sbuffer_t* buffer, int consumer, const sensor_data_t** out, size_t max, int timeout_ms);
+
+/**
+ * Marks every reading returned by the last sbuffer_peek of this consumer as read, the pointers become invalid
+ */
+void sbuffer_release(sbuffer_t* buffer, int consumer);
 
 /**
  * Closes the buffer. This signifies that no more data will be inserted.
  */
 void sbuffer_close(sbuffer_t* buffer);
+
+/**
+ * Fills out 'stats' with a snapshot of the buffer's slot usage
+ */
+void sbuffer_get_stats(sbuffer_t* buffer, sbuffer_stats_t* stats);
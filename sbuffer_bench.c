@@ -0,0 +1,260 @@
+/**
+ * Micro-benchmark for the shared buffer on its own, without sockets or a database.
+ * Producers insert readings stamped with their enqueue time, consumers record how long each reading took to come out.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "config.h"
+#include "sbuffer.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+// latency histogram: 64 power-of-two ranges of nanoseconds, each split in 16 linear sub-buckets
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define BUCKETS (64 * SUB_BUCKETS)
+
+#define MAX_THREADS 32
+#define BENCH_BATCH_MAX 1024
+
+typedef struct {
+    uint64_t counts[BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} histogram_t;
+
+typedef struct {
+    size_t readings;    // per producer
+    int producers;
+    int consumers;
+    uint64_t rate;      // readings per second per producer, 0 is as fast as possible
+    size_t burst;       // readings inserted back to back before a producer paces itself
+    useconds_t slow_us; // pause of the last consumer after every batch, 0 for none
+    size_t batch;
+} bench_options_t;
+
+typedef struct {
+    sbuffer_t* buffer;
+    const bench_options_t* options;
+    int index;
+    int consumer; // sbuffer consumer id
+    uint64_t removed;
+    histogram_t latency;
+} bench_thread_t;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    ASSERT_ELSE_PERROR(clock_gettime(CLOCK_MONOTONIC, &ts) == 0);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bucket_of(uint64_t value) {
+    if (value < SUB_BUCKETS)
+        return value;
+    int magnitude = 63 - __builtin_clzll(value);
+    int sub = (value >> (magnitude - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    return (magnitude - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+static uint64_t bucket_upper_bound(int bucket) {
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+    int magnitude = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+    uint64_t sub = bucket % SUB_BUCKETS;
+    return ((SUB_BUCKETS + sub + 1) << (magnitude - SUB_BUCKET_BITS)) - 1;
+}
+
+static void histogram_record(histogram_t* histogram, uint64_t value) {
+    histogram->counts[bucket_of(value)]++;
+    histogram->total++;
+    if (value > histogram->max)
+        histogram->max = value;
+}
+
+static uint64_t histogram_percentile(const histogram_t* histogram, double percentile) {
+    uint64_t wanted = (uint64_t) (histogram->total * percentile / 100.0);
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen > wanted)
+            return bucket_upper_bound(i);
+    }
+    return histogram->max;
+}
+
+static void* run_producer(void* _thread) {
+    bench_thread_t* thread = _thread;
+    const bench_options_t* options = thread->options;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < options->readings; i++) {
+        if (options->rate != 0 && i % options->burst == 0) {
+            // pace per burst: burst 'i' may not start before i / rate seconds
+            uint64_t due = start + (uint64_t) ((double) i * 1e9 / options->rate);
+            uint64_t now = now_ns();
+            if (due > now) {
+                struct timespec pause = {.tv_sec = (due - now) / 1000000000ULL, .tv_nsec = (due - now) % 1000000000ULL};
+                nanosleep(&pause, NULL);
+            }
+        }
+        sensor_data_t data = {
+            .id = thread->index * 100 + i % 100,
+            .value = i,
+            .ts = now_ns(), // enqueue time instead of a wall clock timestamp
+        };
+        ASSERT_ELSE_PERROR(sbuffer_insert_first(thread->buffer, &data) != SBUFFER_FAILURE);
+    }
+    return NULL;
+}
+
+static void* run_consumer(void* _thread) {
+    bench_thread_t* thread = _thread;
+    const bench_options_t* options = thread->options;
+    bool slow = options->slow_us != 0 && thread->index == options->consumers - 1;
+    sensor_data_t batch[BENCH_BATCH_MAX];
+    ssize_t count;
+    while ((count = sbuffer_remove_batch(thread->buffer, thread->consumer, batch, options->batch, 1, -1)) > 0) {
+        uint64_t now = now_ns();
+        for (ssize_t i = 0; i < count; i++)
+            histogram_record(&thread->latency, now - (uint64_t) batch[i].ts);
+        thread->removed += count;
+        if (slow)
+            usleep(options->slow_us);
+    }
+    return NULL;
+}
+
+static int print_usage() {
+    printf("Usage: sbuffer_bench [options]\n");
+    printf("\t%-16s : readings per producer (default 1000000)\n", "-n readings");
+    printf("\t%-16s : producer threads (default 1)\n", "-p producers");
+    printf("\t%-16s : consumer threads (default 2)\n", "-c consumers");
+    printf("\t%-16s : readings per second per producer, 0 = unlimited (default 0)\n", "-r rate");
+    printf("\t%-16s : readings per burst when rate limited (default 1)\n", "-b burst");
+    printf("\t%-16s : pause of the last consumer after each batch in us (default 0)\n", "-s slow us");
+    printf("\t%-16s : max readings per remove (default 64)\n", "-B batch");
+    printf("\t%-16s : buffer capacity per shard (default " TO_STRING(SBUFFER_CAPACITY) ")\n", "-k capacity");
+    printf("\t%-16s : number of shards (default 1)\n", "-S shards");
+    printf("\t%-16s : block|drop-oldest|drop-newest|downsample (default block)\n", "-o policy");
+    printf("\t%-16s : spill directory (default none)\n", "-d directory");
+    return -1;
+}
+
+int main(int argc, char* argv[]) {
+    bench_options_t options = {
+        .readings = 1000000,
+        .producers = 1,
+        .consumers = 2,
+        .rate = 0,
+        .burst = 1,
+        .slow_us = 0,
+        .batch = 64,
+    };
+    sbuffer_config_t config = SBUFFER_DEFAULT_CONFIG;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:p:c:r:b:s:B:k:S:o:d:")) != -1) {
+        switch (opt) {
+        case 'n':
+            options.readings = strtoull(optarg, NULL, 10);
+            break;
+        case 'p':
+            options.producers = atoi(optarg);
+            break;
+        case 'c':
+            options.consumers = atoi(optarg);
+            break;
+        case 'r':
+            options.rate = strtoull(optarg, NULL, 10);
+            break;
+        case 'b':
+            options.burst = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            options.slow_us = atoi(optarg);
+            break;
+        case 'B':
+            options.batch = strtoull(optarg, NULL, 10);
+            break;
+        case 'k':
+            config.capacity = strtoull(optarg, NULL, 10);
+            break;
+        case 'S':
+            config.shards = atoi(optarg);
+            break;
+        case 'o':
+            if (!sbuffer_policy_from_string(optarg, &config.policy))
+                return print_usage();
+            break;
+        case 'd':
+            config.spill_dir = optarg;
+            break;
+        default:
+            return print_usage();
+        }
+    }
+    if (options.producers < 1 || options.producers > MAX_THREADS || options.consumers < 1 ||
+        options.consumers > SBUFFER_MAX_CONSUMERS || options.burst == 0 || options.batch == 0 ||
+        options.batch > BENCH_BATCH_MAX || config.capacity == 0 || config.shards < 1 ||
+        config.shards > SBUFFER_MAX_SHARDS)
+        return print_usage();
+
+    sbuffer_t* buffer = sbuffer_create_with_config(&config);
+    static bench_thread_t producers[MAX_THREADS];
+    static bench_thread_t consumers[SBUFFER_MAX_CONSUMERS];
+    pthread_t producer_threads[MAX_THREADS];
+    pthread_t consumer_threads[SBUFFER_MAX_CONSUMERS];
+
+    for (int i = 0; i < options.consumers; i++) {
+        consumers[i] = (bench_thread_t){.buffer = buffer, .options = &options, .index = i};
+        consumers[i].consumer = sbuffer_register_consumer(buffer);
+        assert(consumers[i].consumer != SBUFFER_FAILURE);
+        ASSERT_ELSE_PERROR(pthread_create(&consumer_threads[i], NULL, run_consumer, &consumers[i]) == 0);
+    }
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < options.producers; i++) {
+        producers[i] = (bench_thread_t){.buffer = buffer, .options = &options, .index = i};
+        ASSERT_ELSE_PERROR(pthread_create(&producer_threads[i], NULL, run_producer, &producers[i]) == 0);
+    }
+    for (int i = 0; i < options.producers; i++)
+        pthread_join(producer_threads[i], NULL);
+    uint64_t produced = now_ns();
+    sbuffer_close(buffer);
+    for (int i = 0; i < options.consumers; i++)
+        pthread_join(consumer_threads[i], NULL);
+    uint64_t drained = now_ns();
+
+    sbuffer_stats_t stats;
+    sbuffer_get_stats(buffer, &stats);
+    struct rusage usage;
+    ASSERT_ELSE_PERROR(getrusage(RUSAGE_SELF, &usage) == 0);
+
+    printf("inserted %" PRIu64 " readings in %.3f s: %.0f readings/s in, %.0f readings/s end to end\n",
+           stats.inserted, (produced - start) / 1e9, stats.inserted / ((produced - start) / 1e9),
+           stats.inserted / ((drained - start) / 1e9));
+    for (int i = 0; i < options.consumers; i++) {
+        const histogram_t* latency = &consumers[i].latency;
+        printf("consumer %d%s: %" PRIu64 " removed, latency p50 %" PRIu64 " ns, p99 %" PRIu64 " ns, p999 %" PRIu64 " ns, max %" PRIu64 " ns\n",
+               i, options.slow_us != 0 && i == options.consumers - 1 ? " (slow)" : "", consumers[i].removed,
+               histogram_percentile(latency, 50), histogram_percentile(latency, 99),
+               histogram_percentile(latency, 99.9), latency->max);
+    }
+    printf("buffer: fullest shard high water %zu of %zu slots, %" PRIu64 " blocked, %" PRIu64 " dropped oldest, %" PRIu64 " dropped newest, %" PRIu64 " downsampled, %" PRIu64 " spilled, %" PRIu64 " lost to a failed spill\n",
+           stats.shard_high_water, stats.capacity / stats.shards, stats.blocked, stats.dropped_oldest, stats.dropped_newest, stats.downsampled, stats.spilled,
+           stats.spill_failed);
+    printf("peak memory: %ld KiB\n", usage.ru_maxrss);
+
+    sbuffer_destroy(buffer);
+    return 0;
+}
@@ -0,0 +1,105 @@
+/**
+ * Regression test for the consumer wakeups of the shared buffer.
+ * Two consumers read a shard that spills to disk. The slow one moves the spilled readings back into the ring,
+ * which must wake the fast one that caught up and went to sleep. Every reading must come out once, in order.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "config.h"
+#include "sbuffer.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define TEST_READINGS 200
+#define TEST_CONSUMERS 2
+// the consumers must have everything this long after the last insert, without the close waking them up
+#define TEST_TIMEOUT_MS 5000
+
+typedef struct {
+    sbuffer_t* buffer;
+    int consumer;
+    useconds_t pause; // after every batch
+    _Atomic size_t removed;
+    bool failed;
+} test_consumer_t;
+
+static void* run_consumer(void* _consumer) {
+    test_consumer_t* consumer = _consumer;
+    sensor_data_t batch[8];
+    ssize_t count;
+    while ((count = sbuffer_remove_batch(consumer->buffer, consumer->consumer, batch, 8, 1, -1)) > 0) {
+        for (ssize_t i = 0; i < count; i++) {
+            size_t expected = atomic_load(&consumer->removed);
+            if (batch[i].value != (sensor_value_t) expected) {
+                printf("consumer %d got reading %g where %zu was expected\n", consumer->consumer, batch[i].value, expected);
+                consumer->failed = true;
+            }
+            atomic_fetch_add(&consumer->removed, 1);
+        }
+        usleep(consumer->pause);
+    }
+    return NULL;
+}
+
+/**
+ * \return true if every consumer removed every reading within TEST_TIMEOUT_MS
+ */
+static bool wait_for_consumers(test_consumer_t* consumers) {
+    for (int waited = 0; waited < TEST_TIMEOUT_MS; waited++) {
+        bool done = true;
+        for (int i = 0; i < TEST_CONSUMERS; i++)
+            done = done && atomic_load(&consumers[i].removed) == TEST_READINGS;
+        if (done)
+            return true;
+        usleep(1000);
+    }
+    return false;
+}
+
+int main() {
+    char spill_dir[] = "/tmp/sbuffer_test_XXXXXX";
+    ASSERT_ELSE_PERROR(mkdtemp(spill_dir) != NULL);
+    sbuffer_config_t config = SBUFFER_DEFAULT_CONFIG;
+    config.capacity = 64;
+    config.spill_dir = spill_dir;
+    config.spill_threshold = 16;
+    sbuffer_t* buffer = sbuffer_create_with_config(&config);
+
+    test_consumer_t consumers[TEST_CONSUMERS];
+    pthread_t threads[TEST_CONSUMERS];
+    for (int i = 0; i < TEST_CONSUMERS; i++) {
+        consumers[i].buffer = buffer;
+        consumers[i].consumer = sbuffer_register_consumer(buffer);
+        consumers[i].pause = i == 0 ? 0 : 1000;
+        atomic_init(&consumers[i].removed, 0);
+        consumers[i].failed = false;
+        ASSERT_ELSE_PERROR(pthread_create(&threads[i], NULL, run_consumer, &consumers[i]) == 0);
+    }
+    // a burst: the ring reaches the spill threshold and the rest goes to disk while the consumers catch up
+    for (int i = 0; i < TEST_READINGS; i++) {
+        sensor_data_t data = {.id = 1, .value = i, .ts = i};
+        ASSERT_ELSE_PERROR(sbuffer_insert_first(buffer, &data) == SBUFFER_SUCCESS);
+    }
+    bool failed = !wait_for_consumers(consumers);
+    for (int i = 0; i < TEST_CONSUMERS; i++) {
+        if (atomic_load(&consumers[i].removed) != TEST_READINGS)
+            printf("consumer %d is stuck after %zu of %d readings\n", consumers[i].consumer, atomic_load(&consumers[i].removed), TEST_READINGS);
+    }
+    // the close also wakes a stuck consumer, so the test ends either way
+    sbuffer_close(buffer);
+    for (int i = 0; i < TEST_CONSUMERS; i++) {
+        ASSERT_ELSE_PERROR(pthread_join(threads[i], NULL) == 0);
+        failed = failed || consumers[i].failed;
+    }
+    sbuffer_destroy(buffer);
+    rmdir(spill_dir);
+    printf("%s\n", failed ? "FAILED" : "passed");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,479 @@
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "sensor_client.h"
+
+#include "lib/tcpsock.h"
+#include "protocol.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// batches per vectored send or sendmmsg
+#define SENSOR_CLIENT_IOV_MAX 64
+
+typedef enum {
+    CLIENT_DISCONNECTED, // waiting until 'retry_at' to connect again
+    CLIENT_CONNECTING,   // non-blocking connect in progress
+    CLIENT_HANDSHAKE,    // version 2: hello sent, waiting for the ack
+    CLIENT_CONNECTED,
+} client_state_t;
+
+struct sensor_client {
+    sensor_client_config_t config;
+    char* ip;
+    int port;
+    sensor_id_t id;
+    tcpsock_t* socket;
+    client_state_t state;
+    uint64_t state_since; // when the current connection attempt started
+    uint64_t retry_at;
+    unsigned backoff_ms;
+    uint8_t flags; // the flags the batches are built with
+    uint8_t ack[PROTOCOL_HELLO_SIZE];
+    size_t ack_received;
+    // batches[head] up to batches[tail] are finished and wait to be sent, batches[tail] is being filled
+    protocol_batch_t* batches;
+    uint64_t head;
+    uint64_t tail;
+    size_t sent;          // bytes of batches[head] that are sent already
+    size_t waiting_bytes; // bytes of the finished batches that are not sent yet
+    uint32_t sequence;    // of the next reading
+    uint64_t deadline;    // when the oldest reading that is not sent has to go out, 0 if there is none
+    sensor_client_stats_t stats;
+};
+
+static uint64_t now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static protocol_batch_t* slot(sensor_client_t* client, uint64_t index) {
+    return &client->batches[index % client->config.queue_batches];
+}
+
+/**
+ * Starts the batch the next readings go into
+ */
+static void start_batch(sensor_client_t* client) {
+    protocol_batch_t* batch = slot(client, client->tail);
+    if (client->config.version == 1) {
+        // version 1 has no batches, the frames are simply put one after the other
+        batch->size = 0;
+        batch->count = 0;
+        batch->flags = 0;
+    } else {
+        protocol_batch_init(batch, client->flags, client->id, client->sequence);
+    }
+}
+
+/**
+ * \return how many bytes of the oldest batch the server keeps if the connection breaks now
+ * A version 2 batch is thrown away unless it arrived whole, a version 1 frame that arrived whole is stored.
+ */
+static size_t kept_bytes(const sensor_client_t* client) {
+    return client->config.version == 1 ? client->sent - client->sent % PROTOCOL_V1_FRAME_SIZE : 0;
+}
+
+static void drop_oldest(sensor_client_t* client) {
+    protocol_batch_t* batch = slot(client, client->head);
+    // the readings the server kept are not lost
+    client->stats.dropped += batch->count - kept_bytes(client) / PROTOCOL_V1_FRAME_SIZE;
+    client->waiting_bytes -= batch->size - client->sent;
+    client->sent = 0;
+    client->head++;
+}
+
+/**
+ * Gives up on the connection, the next attempt is 'backoff_ms' (with jitter) later
+ */
+static void disconnect(sensor_client_t* client, uint64_t now) {
+    if (client->socket != NULL)
+        tcp_close(&client->socket);
+    client->state = CLIENT_DISCONNECTED;
+    client->stats.failures++;
+    // what the server did not keep of the oldest batch goes again on the next connection
+    size_t kept = kept_bytes(client);
+    client->waiting_bytes += client->sent - kept;
+    client->sent = kept;
+    // spread the reconnects of many sensors after a server restart
+    client->retry_at = now + client->backoff_ms / 2 + rand() % (client->backoff_ms / 2 + 1);
+    client->backoff_ms = client->backoff_ms * 2 < client->config.backoff_max_ms ? client->backoff_ms * 2 : client->config.backoff_max_ms;
+}
+
+static void connected(sensor_client_t* client, uint8_t flags) {
+    client->state = CLIENT_CONNECTED;
+    client->stats.connections++;
+    client->backoff_ms = client->config.backoff_min_ms;
+    if (client->config.version == 1)
+        return;
+    if (flags != client->flags) {
+        // the queued batches were built for other flags, and the server only takes what was agreed on
+        while (client->head != client->tail)
+            drop_oldest(client);
+        client->stats.dropped += slot(client, client->tail)->count;
+        client->flags = flags;
+        client->sequence = 0;
+        start_batch(client);
+        return;
+    }
+    // the server counts sequence numbers per connection
+    client->sequence = 0;
+    for (uint64_t i = client->head; i <= client->tail; i++) {
+        if (flags & PROTOCOL_FLAG_SEQUENCE)
+            protocol_batch_set_sequence(slot(client, i), client->sequence);
+        client->sequence += slot(client, i)->count;
+    }
+}
+
+static void finish_batch(sensor_client_t* client);
+static void service(sensor_client_t* client, int timeout_ms);
+
+static bool queue_full(const sensor_client_t* client) {
+    // the slot after the last finished batch is the one being filled
+    return client->tail - client->head == client->config.queue_batches - 1;
+}
+
+static void start_connect(sensor_client_t* client, uint64_t now) {
+    if (tcp_start_connect(&client->socket, client->port, client->ip) != TCP_NO_ERROR) {
+        client->socket = NULL;
+        disconnect(client, now);
+        return;
+    }
+    client->state = CLIENT_CONNECTING;
+    client->state_since = now;
+}
+
+static void finish_connect(sensor_client_t* client, uint64_t now) {
+    if (tcp_finish_connect(client->socket) != TCP_NO_ERROR) {
+        disconnect(client, now);
+        return;
+    }
+    tcp_set_nodelay(client->socket, client->config.nodelay);
+    if (client->config.version == 1) {
+        connected(client, 0);
+        return;
+    }
+    uint8_t hello[PROTOCOL_HELLO_SIZE];
+    protocol_encode_hello(hello, (protocol_hello_t){.version = PROTOCOL_VERSION, .flags = client->flags});
+    // the send buffer of a new connection is empty
+    int bytes = sizeof(hello);
+    if (tcp_send(client->socket, hello, &bytes) != TCP_NO_ERROR || bytes != sizeof(hello)) {
+        disconnect(client, now);
+        return;
+    }
+    client->state = CLIENT_HANDSHAKE;
+    client->ack_received = 0;
+}
+
+static void receive_ack(sensor_client_t* client, uint64_t now) {
+    int bytes = sizeof(client->ack) - client->ack_received;
+    int result = tcp_receive(client->socket, client->ack + client->ack_received, &bytes);
+    if (result == TCP_SOCKOP_ERROR && errno == EAGAIN)
+        return;
+    if (result != TCP_NO_ERROR) {
+        disconnect(client, now);
+        return;
+    }
+    client->ack_received += bytes;
+    if (client->ack_received < sizeof(client->ack))
+        return;
+    protocol_hello_t ack;
+    if (protocol_decode_hello(client->ack, sizeof(client->ack), &ack) <= 0 || ack.version != PROTOCOL_VERSION) {
+        disconnect(client, now);
+        return;
+    }
+    connected(client, ack.flags);
+}
+
+/**
+ * Marks 'count' bytes of the queue as sent
+ */
+static void advance(sensor_client_t* client, size_t count) {
+    client->stats.sends++;
+    client->stats.bytes += count;
+    client->waiting_bytes -= count;
+    while (count > 0) {
+        size_t rest = slot(client, client->head)->size - client->sent;
+        if (count < rest) {
+            client->sent += count;
+            return;
+        }
+        count -= rest;
+        client->sent = 0;
+        client->head++;
+    }
+}
+
+static void send_tcp(sensor_client_t* client, uint64_t now) {
+    struct iovec iov[SENSOR_CLIENT_IOV_MAX];
+    if (client->config.cork)
+        tcp_set_cork(client->socket, true);
+    while (client->head != client->tail) {
+        int count = 0;
+        for (uint64_t i = client->head; i != client->tail && count < SENSOR_CLIENT_IOV_MAX; i++, count++) {
+            size_t offset = i == client->head ? client->sent : 0;
+            iov[count].iov_base = slot(client, i)->data + offset;
+            iov[count].iov_len = slot(client, i)->size - offset;
+        }
+        // the batches go straight from the queue to the kernel
+        int bytes;
+        int result = tcp_send_iov(client->socket, iov, count, &bytes);
+        if (result == TCP_SOCKOP_ERROR && errno == EAGAIN)
+            break;
+        if (result != TCP_NO_ERROR) {
+            disconnect(client, now);
+            return;
+        }
+        advance(client, bytes);
+    }
+    // uncorking sends the last partial packet
+    if (client->config.cork)
+        tcp_set_cork(client->socket, false);
+}
+
+static void send_udp(sensor_client_t* client) {
+    struct iovec iov[SENSOR_CLIENT_IOV_MAX];
+    struct mmsghdr messages[SENSOR_CLIENT_IOV_MAX];
+    memset(messages, 0, sizeof(messages));
+    while (client->head != client->tail) {
+        unsigned int count = 0;
+        for (uint64_t i = client->head; i != client->tail && count < SENSOR_CLIENT_IOV_MAX; i++, count++) {
+            iov[count].iov_base = slot(client, i)->data;
+            iov[count].iov_len = slot(client, i)->size;
+            messages[count].msg_hdr.msg_iov = &iov[count];
+            messages[count].msg_hdr.msg_iovlen = 1;
+        }
+        if (udp_send_batch(client->socket, messages, &count) != TCP_NO_ERROR) {
+            if (errno == EAGAIN)
+                break;
+            // fire and forget: a datagram that can not be sent is lost, like one that does not arrive
+            drop_oldest(client);
+            continue;
+        }
+        size_t bytes = 0;
+        for (unsigned int i = 0; i < count; i++)
+            bytes += messages[i].msg_len;
+        advance(client, bytes);
+    }
+}
+
+/**
+ * Sends what is queued if a flush is due, finishing the current batch first if its oldest reading waited long enough
+ */
+static void flush_if_due(sensor_client_t* client, uint64_t now) {
+    bool late = client->deadline != 0 && now >= client->deadline;
+    if (!late && client->waiting_bytes < client->config.flush_bytes && !queue_full(client))
+        return;
+    if (late && !queue_full(client))
+        finish_batch(client);
+    if (client->config.udp)
+        send_udp(client);
+    else
+        send_tcp(client, now);
+    if (client->head == client->tail && slot(client, client->tail)->count == 0)
+        client->deadline = 0;
+}
+
+/**
+ * Makes whatever progress is possible, waiting at most 'timeout_ms' (-1: no limit) for the socket
+ */
+static void service(sensor_client_t* client, int timeout_ms) {
+    uint64_t now = now_ms();
+    if (client->state == CLIENT_DISCONNECTED && now >= client->retry_at)
+        start_connect(client, now);
+    if ((client->state == CLIENT_CONNECTING || client->state == CLIENT_HANDSHAKE) &&
+        now - client->state_since >= client->config.connect_timeout_ms)
+        disconnect(client, now);
+    if (client->state == CLIENT_CONNECTED)
+        flush_if_due(client, now);
+
+    struct pollfd pfd = {.fd = -1};
+    uint64_t wake_at = UINT64_MAX;
+    switch (client->state) {
+    case CLIENT_DISCONNECTED:
+        wake_at = client->retry_at;
+        break;
+    case CLIENT_CONNECTING:
+        pfd = (struct pollfd){.fd = client->socket->sd, .events = POLLOUT};
+        wake_at = client->state_since + client->config.connect_timeout_ms;
+        break;
+    case CLIENT_HANDSHAKE:
+        pfd = (struct pollfd){.fd = client->socket->sd, .events = POLLIN};
+        wake_at = client->state_since + client->config.connect_timeout_ms;
+        break;
+    case CLIENT_CONNECTED:
+        // nothing to wait for when the caller does not want to wait
+        if (timeout_ms == 0)
+            return;
+        if (client->head != client->tail)
+            pfd = (struct pollfd){.fd = client->socket->sd, .events = POLLOUT};
+        else if (client->deadline != 0)
+            wake_at = client->deadline;
+        // the server never sends anything after the ack, a readable socket means it closed the connection
+        if (!client->config.udp)
+            pfd = (struct pollfd){.fd = client->socket->sd, .events = pfd.events | POLLIN};
+        break;
+    }
+    if (wake_at != UINT64_MAX) {
+        int until = wake_at > now ? (int) (wake_at - now) : 0;
+        if (timeout_ms < 0 || until < timeout_ms)
+            timeout_ms = until;
+    }
+    if (poll(&pfd, 1, timeout_ms) <= 0)
+        return;
+
+    now = now_ms();
+    switch (client->state) {
+    case CLIENT_CONNECTING:
+        finish_connect(client, now);
+        break;
+    case CLIENT_HANDSHAKE:
+        receive_ack(client, now);
+        break;
+    case CLIENT_CONNECTED:
+        if (!client->config.udp && (pfd.revents & (POLLIN | POLLERR | POLLHUP))) {
+            disconnect(client, now);
+            break;
+        }
+        flush_if_due(client, now);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * Moves the batch that is being filled to the queue and starts a new one
+ */
+static void finish_batch(sensor_client_t* client) {
+    if (slot(client, client->tail)->count == 0)
+        return;
+    // a connected server gets the time to make room, otherwise the oldest readings make way for the newest
+    while (queue_full(client)) {
+        if (client->state != CLIENT_CONNECTED) {
+            drop_oldest(client);
+            break;
+        }
+        service(client, -1);
+    }
+    protocol_batch_t* batch = slot(client, client->tail);
+    client->waiting_bytes += client->config.version == 1 ? batch->size : protocol_batch_finish(batch);
+    client->tail++;
+    start_batch(client);
+}
+
+sensor_client_t* sensor_client_create(const char* ip, int port, sensor_id_t id, const sensor_client_config_t* config) {
+    assert(ip && config);
+    unsigned max_readings = config->udp ? PROTOCOL_MAX_DATAGRAM_READINGS : PROTOCOL_MAX_BATCH_READINGS;
+    if ((config->version != 1 && config->version != 2) || (config->udp && config->version != 2) || config->batch_readings == 0 ||
+        config->batch_readings > max_readings || config->queue_batches < 2 || config->backoff_min_ms == 0 ||
+        config->backoff_max_ms < config->backoff_min_ms)
+        return NULL;
+
+    sensor_client_t* client = calloc(1, sizeof(*client));
+    assert(client != NULL);
+    client->config = *config;
+    client->ip = strdup(ip);
+    client->port = port;
+    client->id = id;
+    client->backoff_ms = config->backoff_min_ms;
+    client->flags = config->udp ? PROTOCOL_UDP_FLAGS : config->sequence ? PROTOCOL_FLAG_SEQUENCE : 0;
+    client->batches = malloc(config->queue_batches * sizeof(*client->batches));
+    assert(client->ip != NULL && client->batches != NULL);
+    start_batch(client);
+
+    uint64_t now = now_ms();
+    int result;
+    if (config->udp) {
+        // no connection to set up, the datagrams can go right away
+        result = udp_active_open(&client->socket, port, client->ip);
+        client->state = CLIENT_CONNECTED;
+    } else {
+        result = tcp_start_connect(&client->socket, port, client->ip);
+        client->state = CLIENT_CONNECTING;
+        client->state_since = now;
+        // the server not being there yet is no reason to fail, a wrong address is
+        if (result == TCP_SOCKOP_ERROR) {
+            client->socket = NULL;
+            disconnect(client, now);
+            result = TCP_NO_ERROR;
+        }
+    }
+    if (result != TCP_NO_ERROR) {
+        free(client->batches);
+        free(client->ip);
+        free(client);
+        return NULL;
+    }
+    return client;
+}
+
+void sensor_client_destroy(sensor_client_t* client, unsigned timeout_ms) {
+    assert(client);
+    sensor_client_flush(client, timeout_ms);
+    if (client->socket != NULL)
+        tcp_close(&client->socket);
+    free(client->batches);
+    free(client->ip);
+    free(client);
+}
+
+void sensor_client_add(sensor_client_t* client, sensor_value_t value, sensor_ts_t ts) {
+    assert(client);
+    protocol_batch_t* batch = slot(client, client->tail);
+    if (client->config.version == 1) {
+        protocol_encode_v1(batch->data + batch->size, client->id, value, ts);
+        batch->size += PROTOCOL_V1_FRAME_SIZE;
+        batch->count++;
+    } else {
+        bool added = protocol_batch_add(batch, value, ts);
+        assert(added);
+    }
+    client->sequence++;
+    client->stats.readings++;
+    uint64_t now = now_ms();
+    if (client->deadline == 0)
+        client->deadline = now + client->config.flush_ms;
+    bool full = batch->count == client->config.batch_readings;
+    if (full)
+        finish_batch(client);
+    if (full || now >= client->deadline || client->waiting_bytes >= client->config.flush_bytes)
+        service(client, 0);
+}
+
+void sensor_client_wait(sensor_client_t* client, unsigned ms) {
+    assert(client);
+    uint64_t end = now_ms() + ms;
+    uint64_t now;
+    do {
+        service(client, (int) ms);
+        now = now_ms();
+        ms = end > now ? end - now : 0;
+    } while (ms > 0);
+}
+
+bool sensor_client_flush(sensor_client_t* client, unsigned timeout_ms) {
+    assert(client);
+    uint64_t end = now_ms() + timeout_ms;
+    finish_batch(client);
+    while (client->head != client->tail) {
+        uint64_t now = now_ms();
+        if (now >= end)
+            break;
+        client->deadline = now;
+        service(client, (int) (end - now));
+    }
+    return client->head == client->tail;
+}
+
+void sensor_client_get_stats(const sensor_client_t* client, sensor_client_stats_t* stats) {
+    assert(client && stats);
+    *stats = client->stats;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+/**
+ * Client side of the sensor protocol, on top of lib/tcpsock: readings are coalesced into batches in a local queue
+ * and sent with one vectored send (or one sendmmsg over UDP) per flush, when enough bytes are waiting or the oldest
+ * reading has waited long enough. The connection is set up without blocking and set up again with exponential
+ * backoff when it fails or breaks; readings keep being queued in the meantime, the oldest are dropped once the queue is full.
+ * Nothing happens in the background: the client only makes progress inside its functions, so a caller that has
+ * nothing to add should wait with sensor_client_wait instead of sleep. Not thread safe.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct sensor_client sensor_client_t;
+
+typedef struct {
+    int version;              // protocol version over TCP, 1 or 2
+    bool udp;                 // send the version 2 batches as datagrams instead, always numbered
+    bool sequence;            // ask for sequence numbers over TCP, they start at 0 on every connection
+    unsigned batch_readings;  // readings per batch, at most PROTOCOL_MAX_BATCH_READINGS (PROTOCOL_MAX_DATAGRAM_READINGS over UDP)
+    size_t flush_bytes;       // send as soon as this many bytes of finished batches are waiting
+    unsigned flush_ms;        // send a reading at the latest this long after it was added
+    bool nodelay;             // TCP_NODELAY: a flush goes out right away instead of waiting for more data
+    bool cork;                // TCP_CORK while a flush is sent, so it leaves in as few full packets as possible
+    unsigned connect_timeout_ms; // give up on a connection (and its handshake) that takes longer
+    unsigned backoff_min_ms;  // wait this long before the first reconnect, twice as long after every failure
+    unsigned backoff_max_ms;  // up to this
+    unsigned queue_batches;   // batches kept while they can not be sent, at least 2
+} sensor_client_config_t;
+
+#define SENSOR_CLIENT_DEFAULT_CONFIG        \
+    ((sensor_client_config_t){              \
+        .version = 2,                       \
+        .udp = false,                       \
+        .sequence = false,                  \
+        .batch_readings = 64,               \
+        .flush_bytes = 16 * 1024,           \
+        .flush_ms = 100,                    \
+        .nodelay = true,                    \
+        .cork = false,                      \
+        .connect_timeout_ms = 5000,         \
+        .backoff_min_ms = 100,              \
+        .backoff_max_ms = 10000,            \
+        .queue_batches = 256,               \
+    })
+
+typedef struct {
+    uint64_t readings;    // readings added
+    uint64_t dropped;     // readings dropped because the queue was full while they could not be sent
+    uint64_t connections; // connections that were set up, including the handshake
+    uint64_t failures;    // connection attempts that failed and connections that broke
+    uint64_t sends;       // system calls that sent readings
+    uint64_t bytes;       // bytes sent
+} sensor_client_stats_t;
+
+/**
+ * Creates a client for sensor 'id' and starts connecting to the server
+ * \return the new client, or NULL if 'ip', 'port' or 'config' is not valid
+ */
+sensor_client_t* sensor_client_create(const char* ip, int port, sensor_id_t id, const sensor_client_config_t* config);
+
+/**
+ * Flushes for at most 'timeout_ms' (see sensor_client_flush), closes the connection and frees the client
+ */
+void sensor_client_destroy(sensor_client_t* client, unsigned timeout_ms);
+
+/**
+ * Queues a reading. Only makes a system call when a batch is full or a flush is due.
+ * Blocks while the queue is full and the server is connected but slower than the readings come in.
+ */
+void sensor_client_add(sensor_client_t* client, sensor_value_t value, sensor_ts_t ts);
+
+/**
+ * Spends 'ms' milliseconds sending, connecting and handshaking as needed, instead of sleeping
+ */
+void sensor_client_wait(sensor_client_t* client, unsigned ms);
+
+/**
+ * Sends everything that is queued, waiting at most 'timeout_ms' for the server
+ * \return true if nothing is left in the queue
+ */
+bool sensor_client_flush(sensor_client_t* client, unsigned timeout_ms);
+
+void sensor_client_get_stats(const sensor_client_t* client, sensor_client_stats_t* stats);
@@ -8,78 +8,161 @@
 
 #include "sensor_db.h"
 
+#include "storage_backend.h"
+
 #include <assert.h>
+#include <stdatomic.h>
 #include <stdbool.h>
-#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char* const engine_names[] = {
+    [STORAGEMGR_ENGINE_SQLITE] = "sqlite",
+    [STORAGEMGR_ENGINE_TSDB] = "tsdb",
+    [STORAGEMGR_ENGINE_BINLOG] = "binlog",
+    [STORAGEMGR_ENGINE_NULL] = "null",
+};
+
+static const storage_backend_t* const backends[] = {
+    [STORAGEMGR_ENGINE_SQLITE] = &storage_sqlite_backend,
+    [STORAGEMGR_ENGINE_TSDB] = &storage_tsdb_backend,
+    [STORAGEMGR_ENGINE_BINLOG] = &storage_binlog_backend,
+    [STORAGEMGR_ENGINE_NULL] = &storage_null_backend,
+};
+
+static const char* const sync_names[] = {
+    [STORAGEMGR_SYNC_OFF] = "off",
+    [STORAGEMGR_SYNC_NORMAL] = "normal",
+    [STORAGEMGR_SYNC_FULL] = "full",
+    [STORAGEMGR_SYNC_EXTRA] = "extra",
+};
+
+struct db_connection {
+    const storage_backend_t* backend;
+    void* state;
+    storage_shared_t shared;
+};
+
+uint64_t storage_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int storage_group_timeout(const storage_shared_t* shared, uint64_t opened_at) {
+    uint64_t deadline = opened_at + atomic_load_explicit(&shared->commit_ms, memory_order_relaxed);
+    uint64_t now = storage_now_ms();
+    return deadline > now ? (int) (deadline - now) : 0;
+}
 
-#define RUN_QUERY(connection, callback, query_failed, format...)                \
-    do {                                                                        \
-        char* sql_query = NULL;                                                 \
-        ASSERT_ELSE_PERROR(asprintf(&sql_query, format) > 0);                   \
-        char* err_msg = NULL;                                                   \
-        query_failed = false;                                                   \
-        int retries = 0;                                                        \
-        int rc = !SQLITE_OK;                                                    \
-        do {                                                                    \
-            rc = sqlite3_exec(connection, sql_query, callback, NULL, &err_msg); \
-            retries++;                                                          \
-        } while (rc != SQLITE_OK && retries < 3);                               \
-        if (rc != SQLITE_OK) {                                                  \
-            printf("Query \" %s \" Failed :%s\n", sql_query, err_msg);          \
-            printf("Connection to SQL server lost\n");                          \
-            sqlite3_free(err_msg);                                              \
-            sqlite3_close(connection);                                          \
-            query_failed = true;                                                \
-        }                                                                       \
-        free(sql_query);                                                        \
-    } while (false)
-
-DBCONN* storagemgr_init_connection(bool clear_up_flag) {
-    sqlite3* db = NULL;
-    int rc = sqlite3_open(TO_STRING(DB_NAME), &db); // rc stands for result code
-    if (rc != SQLITE_OK) {
-        printf("Unable to connect to SQL server: %s\n", sqlite3_errmsg(db));
-        sqlite3_close(db);
+DBCONN* storagemgr_init_connection(bool clear_up_flag, const storagemgr_config_t* config) {
+    assert(config && config->engine <= STORAGEMGR_ENGINE_NULL && config->shard < config->shards);
+    DBCONN* conn = calloc(1, sizeof(*conn));
+    assert(conn != NULL);
+    conn->backend = backends[config->engine];
+    conn->shared.commit_rows = config->commit_rows > 0 ? config->commit_rows : 1;
+    conn->shared.commit_ms = config->commit_ms;
+    conn->shared.synchronous = config->synchronous;
+    conn->state = conn->backend->init(clear_up_flag, config, &conn->shared);
+    if (conn->state == NULL) {
+        free(conn);
         return NULL;
     }
-
-    printf("Connection to SQL server established\n");
-
-    char* query =
-        clear_up_flag == 1
-            ? "DROP TABLE IF EXISTS " TO_STRING(
-                  TABLE_NAME) ";"
-                              "CREATE TABLE " TO_STRING(
-                                  TABLE_NAME) " (id INTEGER PRIMARY KEY "
-                                              "AUTOINCREMENT,sensor_id INT, "
-                                              "sensor_value DECIMAL(4,2), "
-                                              "timestamp TIMESTAMP);"
-            : "CREATE TABLE IF NOT EXISTS " TO_STRING(
-                  TABLE_NAME) " (id INTEGER PRIMARY KEY AUTOINCREMENT,sensor_id "
-                              "INT, sensor_value DECIMAL(4,2), timestamp "
-                              "TIMESTAMP);";
-    bool query_failed = false;
-
-    RUN_QUERY(db, NULL, query_failed, query, NULL);
-
-    assert(db != NULL);
-    query_failed ? printf("A new table couldn't be created\n")
-                 : printf("New table " TO_STRING(TABLE_NAME) " created\n");
-    return query_failed ? NULL : db;
+    return conn;
 }
 
-void storagemgr_disconnect(DBCONN* conn) {
-    sqlite3_close(conn);
+void storagemgr_disconnect(DBCONN* conn, storagemgr_stats_t* stats) {
+    assert(conn);
+    storagemgr_stats_t backend_stats;
+    conn->backend->close(conn->state, &backend_stats);
+    if (stats != NULL) {
+        stats->rows = atomic_load_explicit(&conn->shared.rows, memory_order_relaxed);
+        stats->lost = atomic_load_explicit(&conn->shared.lost, memory_order_relaxed);
+        stats->transactions = atomic_load_explicit(&conn->shared.transactions, memory_order_relaxed);
+        stats->checkpoints = backend_stats.checkpoints;
+        stats->bytes = backend_stats.bytes;
+    }
+    free(conn);
 }
 
 int storagemgr_insert_sensor(DBCONN* conn, sensor_id_t id, sensor_value_t value,
                              sensor_ts_t ts) {
-    bool query_failed = false;
-    RUN_QUERY(
-        conn, NULL, query_failed,
-        "INSERT INTO  " TO_STRING(
-            TABLE_NAME) "(sensor_id,sensor_value,timestamp) VALUES (%d,%f,%ld);",
-        id, value, ts);
-    return query_failed;
+    sensor_data_t data = {.id = id, .value = value, .ts = ts};
+    return storagemgr_insert_batch(conn, &data, 1);
+}
+
+int storagemgr_insert_batch(DBCONN* conn, const sensor_data_t* data, size_t count) {
+    assert(conn && (data || count == 0));
+    if (count == 0)
+        return 0;
+    return conn->backend->insert_batch(conn->state, data, count);
+}
+
+int storagemgr_flush(DBCONN* conn) {
+    assert(conn);
+    return conn->backend->flush(conn->state);
+}
+
+int storagemgr_commit_timeout(DBCONN* conn) {
+    assert(conn);
+    return conn->backend->commit_timeout(conn->state);
+}
+
+void storagemgr_set_group_commit(DBCONN* conn, unsigned commit_rows, unsigned commit_ms) {
+    assert(conn);
+    atomic_store_explicit(&conn->shared.commit_rows, commit_rows > 0 ? commit_rows : 1, memory_order_relaxed);
+    atomic_store_explicit(&conn->shared.commit_ms, commit_ms, memory_order_relaxed);
+}
+
+void storagemgr_set_synchronous(DBCONN* conn, storagemgr_sync_t synchronous) {
+    assert(conn && synchronous <= STORAGEMGR_SYNC_EXTRA);
+    atomic_store_explicit(&conn->shared.synchronous, synchronous, memory_order_relaxed);
+}
+
+void storagemgr_get_stats(DBCONN* conn, storagemgr_stats_t* stats) {
+    assert(conn && stats);
+    conn->backend->stats(conn->state, stats);
+    stats->rows = atomic_load_explicit(&conn->shared.rows, memory_order_relaxed);
+    stats->lost = atomic_load_explicit(&conn->shared.lost, memory_order_relaxed);
+    stats->transactions = atomic_load_explicit(&conn->shared.transactions, memory_order_relaxed);
+}
+
+unsigned storagemgr_shard_of(sensor_id_t id, unsigned shards) {
+    assert(shards > 0);
+    return id % shards;
+}
+
+char* storagemgr_shard_path(const char* name, unsigned shard, unsigned shards) {
+    char* path = NULL;
+    if (shards <= 1) {
+        path = strdup(name);
+        assert(path != NULL);
+        return path;
+    }
+    const char* extension = strrchr(name, '.');
+    if (extension == NULL)
+        extension = name + strlen(name);
+    ASSERT_ELSE_PERROR(asprintf(&path, "%.*s.%u%s", (int) (extension - name), name, shard, extension) > 0);
+    return path;
+}
+
+bool storagemgr_sync_from_string(const char* name, storagemgr_sync_t* synchronous) {
+    for (storagemgr_sync_t i = STORAGEMGR_SYNC_OFF; i <= STORAGEMGR_SYNC_EXTRA; i++) {
+        if (strcmp(name, sync_names[i]) == 0) {
+            *synchronous = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool storagemgr_engine_from_string(const char* name, storagemgr_engine_t* engine) {
+    for (storagemgr_engine_t i = STORAGEMGR_ENGINE_SQLITE; i <= STORAGEMGR_ENGINE_NULL; i++) {
+        if (strcmp(name, engine_names[i]) == 0) {
+            *engine = i;
+            return true;
+        }
+    }
+    return false;
 }
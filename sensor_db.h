@@ -2,6 +2,29 @@
 
 /**
  * \author Mathieu Erbas
+ *
+ * The database runs in WAL mode with group commit: readings go into an open transaction that is committed once it
+ * holds 'commit_rows' readings or its first reading is 'commit_ms' old, so the disk is synced once per group instead
+ * of once per reading. A crash loses at most the open transaction (and with STORAGEMGR_SYNC_NORMAL or lower, a power
+ * loss also the commits since the last sync). The WAL is checkpointed by a background thread with its own connection,
+ * never on the thread that inserts.
+ *
+ * Instead of sqlite, the connection can store the readings in the compressed time series store of tsdb.h (TSDB_NAME
+ * and TSDB_NAME.idx). A group commit then appends the blocks that were sealed since the last one, in one write per file.
+ * Blocks that are still open live in memory: a crash loses at most the last tsdb block_age_ms of every sensor.
+ * The synchronous level decides whether a group commit waits for the disk (FULL and EXTRA) or not.
+ *
+ * The binary log (BINLOG_NAME) is the cheapest way to keep every reading, for when they are analysed offline: after a
+ * header of BINLOG_HEADER_SIZE bytes (BINLOG_MAGIC) it holds one record of BINLOG_RECORD_SIZE bytes per reading,
+ * <sensor id u16><value f64><timestamp i64> in little endian. A group commit is one write of the buffered records,
+ * with FULL and EXTRA followed by an fdatasync. The null engine throws the readings away, it shows how fast the
+ * server can go when storing costs nothing.
+ *
+ * Each engine is a backend behind the operations of storage_backend.h, the storagemgr_* functions pass the calls on.
+ *
+ * Several connections can store in parallel when the sensors are split over them: the connection for shard 'shard' of
+ * 'shards' stores the sensors with storagemgr_shard_of(id, shards) == shard, in files of its own named by
+ * storagemgr_shard_path (Sensor.db becomes Sensor.0.db, Sensor.1.db, ...). shard_dump reads them back as one dataset.
  */
 
 #ifndef _GNU_SOURCE
@@ -21,26 +44,87 @@
     #define TABLE_NAME SensorData
 #endif
 
-#define DBCONN sqlite3
+#ifndef TSDB_NAME
+    #define TSDB_NAME Sensor.tsdb
+#endif
+
+#ifndef BINLOG_NAME
+    #define BINLOG_NAME Sensor.binlog
+#endif
+
+#define BINLOG_MAGIC "SNSRLOG1"
+#define BINLOG_HEADER_SIZE 8
+#define BINLOG_RECORD_SIZE 18
+
+// the storage engine that was picked together with its state
+typedef struct db_connection db_connection_t;
+
+#define DBCONN db_connection_t
 
 typedef int (*callback_t)(void*, int, char**, char**);
 
+typedef enum {
+    STORAGEMGR_ENGINE_SQLITE, // rows in TABLE_NAME of DB_NAME
+    STORAGEMGR_ENGINE_TSDB,   // compressed blocks per sensor in TSDB_NAME
+    STORAGEMGR_ENGINE_BINLOG, // fixed size records in BINLOG_NAME
+    STORAGEMGR_ENGINE_NULL,   // nowhere
+} storagemgr_engine_t;
+
+// PRAGMA synchronous, in the same order as sqlite numbers them
+typedef enum {
+    STORAGEMGR_SYNC_OFF,    // never waits for the disk, an OS crash can lose commits
+    STORAGEMGR_SYNC_NORMAL, // only checkpoints wait for the disk, a power loss can lose the last commits
+    STORAGEMGR_SYNC_FULL,   // every commit waits for the disk
+    STORAGEMGR_SYNC_EXTRA,  // FULL, and deleting a journal waits too
+} storagemgr_sync_t;
+
+typedef struct {
+    storagemgr_engine_t engine;
+    unsigned commit_rows;          // commit as soon as the open transaction holds this many readings, at least 1
+    unsigned commit_ms;            // commit at the latest this long after the first reading of the transaction
+    storagemgr_sync_t synchronous;
+    unsigned checkpoint_pages;     // sqlite: wake the checkpoint thread once the WAL holds this many pages
+    unsigned shard;                // which of the 'shards' connections this is
+    unsigned shards;               // 1 uses the files without a shard number
+} storagemgr_config_t;
+
+#define STORAGEMGR_DEFAULT_CONFIG                \
+    ((storagemgr_config_t){                      \
+        .engine = STORAGEMGR_ENGINE_SQLITE,      \
+        .commit_rows = 500,                      \
+        .commit_ms = 50,                         \
+        .synchronous = STORAGEMGR_SYNC_NORMAL,   \
+        .checkpoint_pages = 1000,                \
+        .shard = 0,                              \
+        .shards = 1,                             \
+    })
+
+typedef struct {
+    uint64_t rows;         // readings committed
+    uint64_t lost;         // readings rolled back because an insert or commit failed
+    uint64_t transactions; // commits (tsdb: group commits that wrote blocks, null: batches)
+    uint64_t checkpoints;  // sqlite: checkpoints run by the background thread
+    uint64_t bytes;        // tsdb and binlog: bytes appended to the files
+} storagemgr_stats_t;
+
 /**
  * Make a connection to the database server
- * Create (open) a database with name DB_NAME having 1 table named TABLE_NAME
+ * Create (open) a database with name DB_NAME having 1 table named TABLE_NAME, or the files of the engine in 'config'
  * \param clear_up_flag if the table existed, clear up the existing data when clear_up_flag is set to 1
+ * \param config how to group commits, copied
  * \return the connection for success, NULL if an error occurs
  */
-DBCONN* storagemgr_init_connection(bool clear_up_flag);
+DBCONN* storagemgr_init_connection(bool clear_up_flag, const storagemgr_config_t* config);
 
 /**
- * Disconnect from the database server
+ * Commit what is still open and disconnect from the database server
  * \param conn pointer to the current connection
+ * \param stats if not NULL, filled out with the totals, including what was written while disconnecting
  */
-void storagemgr_disconnect(DBCONN* conn);
+void storagemgr_disconnect(DBCONN* conn, storagemgr_stats_t* stats);
 
 /**
- * Write an INSERT query to insert a single sensor measurement
+ * Insert a single sensor measurement, see storagemgr_insert_batch
  * \param conn pointer to the current connection
  * \param id the sensor id
  * \param value the measurement value
@@ -48,3 +132,64 @@ void storagemgr_disconnect(DBCONN* conn);
  * \return zero for success, and non-zero if an error occurs
  */
 int storagemgr_insert_sensor(DBCONN* conn, sensor_id_t id, sensor_value_t value, sensor_ts_t ts);
+
+/**
+ * Insert 'count' sensor measurements with the prepared INSERT statement into the open transaction,
+ * and commit it if it is full or old enough. If an insert fails, the whole open transaction is rolled back.
+ * \param conn pointer to the current connection
+ * \param data the measurements to insert
+ * \param count the number of measurements in 'data'
+ * \return zero for success, and non-zero if an error occurs
+ */
+int storagemgr_insert_batch(DBCONN* conn, const sensor_data_t* data, size_t count);
+
+/**
+ * Commit the open transaction, if there is one
+ * \return zero for success, and non-zero if an error occurs
+ */
+int storagemgr_flush(DBCONN* conn);
+
+/**
+ * \return how many milliseconds the open transaction may stay open, 0 if it is due, or -1 if there is none
+ */
+int storagemgr_commit_timeout(DBCONN* conn);
+
+/**
+ * Change the group commit limits while the connection is in use, from any thread
+ * They apply from the next insert on
+ */
+void storagemgr_set_group_commit(DBCONN* conn, unsigned commit_rows, unsigned commit_ms);
+
+/**
+ * Change PRAGMA synchronous while the connection is in use, from any thread
+ * It applies from the next transaction on
+ */
+void storagemgr_set_synchronous(DBCONN* conn, storagemgr_sync_t synchronous);
+
+/**
+ * Fills out 'stats' with the totals since the connection was made, on the thread that uses the connection
+ */
+void storagemgr_get_stats(DBCONN* conn, storagemgr_stats_t* stats);
+
+/**
+ * \return the shard that stores the readings of sensor 'id' when they are split over 'shards' connections
+ */
+unsigned storagemgr_shard_of(sensor_id_t id, unsigned shards);
+
+/**
+ * \return the file name of shard 'shard' of 'shards' for the file 'name': 'name' itself if there is only one shard,
+ * otherwise the shard number is put before the extension. The caller frees it.
+ */
+char* storagemgr_shard_path(const char* name, unsigned shard, unsigned shards);
+
+/**
+ * Looks up a synchronous level by its command line name: off, normal, full or extra
+ * \return false if 'name' is not a level
+ */
+bool storagemgr_sync_from_string(const char* name, storagemgr_sync_t* synchronous);
+
+/**
+ * Looks up a storage engine by its command line name: sqlite, tsdb, binlog or null
+ * \return false if 'name' is not an engine
+ */
+bool storagemgr_engine_from_string(const char* name, storagemgr_engine_t* engine);
@@ -3,12 +3,15 @@
  */
 
 #include "config.h"
-#include "lib/tcpsock.h"
+#include "protocol.h"
+#include "sensor_client.h"
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <getopt.h>
 #include <unistd.h>
 
 // conditional compilation option to control the number of measurements this
@@ -53,6 +56,11 @@
 #define INITIAL_TEMPERATURE 22.5
 #define TEMP_DEV 0.5 // max deviation from previous temp in celsius
 
+// readings per batch when the sensor does not sleep between readings
+#define FAST_BATCH_SIZE 64
+// how long the last readings get to reach the server before the sensor stops
+#define CLOSE_TIMEOUT_MS 5000
+
 void print_help(void);
 
 double normalized_rand() {
@@ -72,69 +80,107 @@ double normalized_rand() {
  * argv[2] = sleep time
  * argv[3] = server IP
  * argv[4] = server port
+ *
+ * They can be preceded by options:
+ * -v 1|2   protocol version, 2 by default
+ * -b count readings per batch, FAST_BATCH_SIZE without sleep time and 1 otherwise
+ * -s       number the version 2 batches so the server can count lost readings
+ * -u       send the version 2 batches as UDP datagrams, always numbered, at most PROTOCOL_MAX_DATAGRAM_READINGS readings each
+ * -f ms    send a reading at the latest this long after it was taken
+ * -c       send with TCP_CORK instead of TCP_NODELAY
+ *
+ * The sensor does not need the server to be up: it connects in the background and reconnects when the connection breaks.
  */
 
 int main(int argc, char* argv[]) {
     sensor_data_t data;
     int server_port;
     char server_ip[] = "000.000.000.000";
-    tcpsock_t* client;
-    int i, bytes, sleep_time;
+    sensor_client_t* client;
+    int i, sleep_time;
+    int batch_size = 0;
+    sensor_client_config_t config = SENSOR_CLIENT_DEFAULT_CONFIG;
 
     LOG_OPEN();
-    
-    if (argc != 5) {
+
+    int opt;
+    while ((opt = getopt(argc, argv, "v:b:suf:c")) != -1) {
+        switch (opt) {
+        case 'v':
+            config.version = atoi(optarg);
+            break;
+        case 'b':
+            batch_size = atoi(optarg);
+            break;
+        case 's':
+            config.sequence = true;
+            break;
+        case 'u':
+            config.udp = true;
+            break;
+        case 'f':
+            config.flush_ms = atoi(optarg);
+            break;
+        case 'c':
+            config.cork = true;
+            config.nodelay = false;
+            break;
+        default:
+            print_help();
+            exit(EXIT_SUCCESS);
+        }
+    }
+    if (argc - optind != 4 || batch_size < 0) {
         print_help();
         exit(EXIT_SUCCESS);
     } else {
         // to do: user input validation!
-        data.id = atoi(argv[1]);
-        sleep_time = atoi(argv[2]);
-        strncpy(server_ip, argv[3], strlen(server_ip));
-        server_port = atoi(argv[4]);
+        data.id = atoi(argv[optind]);
+        sleep_time = atoi(argv[optind + 1]);
+        strncpy(server_ip, argv[optind + 2], strlen(server_ip));
+        server_port = atoi(argv[optind + 3]);
     }
+    config.batch_readings = batch_size > 0 ? batch_size : sleep_time == 0 ? FAST_BATCH_SIZE : 1;
 
     srand48(time(NULL));
     srand(time(NULL));
 
-    // open TCP connection to the server; server is listening to SERVER_IP and PORT
-    if (tcp_active_open(&client, server_port, server_ip) != TCP_NO_ERROR)
+    client = sensor_client_create(server_ip, server_port, data.id, &config);
+    if (client == NULL) {
+        print_help();
         exit(EXIT_FAILURE);
+    }
 
     data.value = INITIAL_TEMPERATURE;
     i = LOOPS;
     while (i) {
         data.value = data.value + TEMP_DEV * (normalized_rand() - (data.value - INITIAL_TEMPERATURE) / 100.0);
         time(&data.ts);
-        // send data to server in this order (!!):
-        // <sensor_id><temperature><timestamp> remark: don't send as a struct!
-        bytes = sizeof(data.id);
-        if (tcp_send(client, (void*) &data.id, &bytes) != TCP_NO_ERROR)
-            exit(EXIT_FAILURE);
-        bytes = sizeof(data.value);
-        if (tcp_send(client, (void*) &data.value, &bytes) != TCP_NO_ERROR)
-            exit(EXIT_FAILURE);
-        bytes = sizeof(data.ts);
-        if (tcp_send(client, (void*) &data.ts, &bytes) != TCP_NO_ERROR)
-            exit(EXIT_FAILURE);
+        sensor_client_add(client, data.value, data.ts);
         LOG_PRINTF(data.id, data.value, data.ts);
-        sleep(sleep_time);
+        // keeps sending and reconnecting while the sensor sleeps
+        if (sleep_time > 0)
+            sensor_client_wait(client, sleep_time * 1000);
         UPDATE(i);
     }
 
-    if (tcp_close(&client) != TCP_NO_ERROR)
-        exit(EXIT_FAILURE);
+    bool flushed = sensor_client_flush(client, CLOSE_TIMEOUT_MS);
+    sensor_client_stats_t stats;
+    sensor_client_get_stats(client, &stats);
+    sensor_client_destroy(client, 0);
+    printf("Sensor %" PRIu16 ": %" PRIu64 " readings (%" PRIu64 " dropped%s), %" PRIu64 " bytes in %" PRIu64 " sends, %" PRIu64 " connections, %" PRIu64 " failures\n",
+           data.id, stats.readings, stats.dropped, flushed ? "" : ", the last ones not sent", stats.bytes, stats.sends, stats.connections, stats.failures);
 
     LOG_CLOSE();
 
-    exit(EXIT_SUCCESS);
+    exit(flushed ? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
 /**
  * Helper method to print a message on how to use this application
  */
 void print_help(void) {
-    printf("Use this program with 4 command line options: \n");
+    printf("Use this program with 4 command line options, optionally preceded by -v 1|2 (protocol version), -b <readings per batch>, -s (sequence numbers), -u (UDP), -f <flush ms> and -c (TCP_CORK): \n");
     printf("\t%-15s : a unique sensor node ID\n", "\'ID\'");
     printf("\t%-15s : node sleep time (in sec) between two measurements\n", "\'sleep time\'");
     printf("\t%-15s : TCP server IP address\n", "\'server IP\'");
@@ -0,0 +1,216 @@
+/**
+ * Prints the readings a server stored with several writers (-W) as one dataset, oldest first, one per line:
+ * <sensor id> <value> <timestamp>
+ * With -s only the shard that holds the sensor is read. The sqlite shards are attached to one connection and
+ * queried through a view over all of them, the files of the other engines are read and merged here.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "sensor_db.h"
+#include "tsdb.h"
+
+#include <assert.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    sensor_data_t* readings;
+    size_t count;
+    size_t capacity;
+    // filter
+    int id;
+    sensor_ts_t from;
+    sensor_ts_t to;
+} dataset_t;
+
+static int print_usage() {
+    printf("Usage: <command> [-e sqlite|tsdb|binlog] [-s sensor id] [-f from timestamp] [-t to timestamp] <storage writers> \n");
+    return -1;
+}
+
+static void print_reading(sensor_id_t id, sensor_value_t value, sensor_ts_t ts) {
+    printf("%" PRIu16 " %g %ld\n", id, value, (long int) ts);
+}
+
+static bool add_reading(void* _dataset, sensor_id_t id, sensor_value_t value, sensor_ts_t ts) {
+    dataset_t* dataset = _dataset;
+    if (dataset->count == dataset->capacity) {
+        dataset->capacity = dataset->capacity > 0 ? dataset->capacity * 2 : 1024;
+        dataset->readings = realloc(dataset->readings, dataset->capacity * sizeof(*dataset->readings));
+        assert(dataset->readings != NULL);
+    }
+    dataset->readings[dataset->count++] = (sensor_data_t){.id = id, .value = value, .ts = ts};
+    return true;
+}
+
+static int compare_readings(const void* _a, const void* _b) {
+    const sensor_data_t* a = _a;
+    const sensor_data_t* b = _b;
+    if (a->ts != b->ts)
+        return a->ts < b->ts ? -1 : 1;
+    return (int) a->id - (int) b->id;
+}
+
+static uint64_t get_le(const uint8_t* in, int size) {
+    uint64_t value = 0;
+    for (int i = 0; i < size; i++)
+        value |= (uint64_t) in[i] << (8 * i);
+    return value;
+}
+
+/**
+ * \return false if the log can not be read or is no binary log
+ */
+static bool read_binlog(const char* path, dataset_t* dataset) {
+    FILE* log = fopen(path, "r");
+    if (log == NULL)
+        return false;
+    char magic[BINLOG_HEADER_SIZE];
+    if (fread(magic, 1, sizeof(magic), log) != sizeof(magic) || memcmp(magic, BINLOG_MAGIC, sizeof(magic)) != 0) {
+        fclose(log);
+        return false;
+    }
+    uint8_t record[BINLOG_RECORD_SIZE];
+    // a record cut off by a crash is left out
+    while (fread(record, 1, sizeof(record), log) == sizeof(record)) {
+        sensor_id_t id = get_le(record, 2);
+        uint64_t bits = get_le(record + 2, 8);
+        sensor_ts_t ts = get_le(record + 10, 8);
+        sensor_value_t value;
+        memcpy(&value, &bits, sizeof(value));
+        if ((dataset->id == TSDB_ALL_SENSORS || id == dataset->id) && ts >= dataset->from && ts <= dataset->to)
+            add_reading(dataset, id, value, ts);
+    }
+    bool failed = ferror(log);
+    fclose(log);
+    return !failed;
+}
+
+/**
+ * Attaches every shard that is read and queries the view over them
+ * \return the number of readings printed, or -1 if a shard can not be read
+ */
+static int64_t query_sqlite(unsigned shards, unsigned first, unsigned last, const dataset_t* dataset) {
+    sqlite3* db = NULL;
+    if (sqlite3_open_v2(":memory:", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_URI, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return -1;
+    }
+    char* view = strdup("CREATE TEMP VIEW " TO_STRING(TABLE_NAME) " AS ");
+    assert(view != NULL);
+    bool failed = false;
+    for (unsigned shard = first; shard <= last && !failed; shard++) {
+        char* path = storagemgr_shard_path(TO_STRING(DB_NAME), shard, shards);
+        // read only, so a shard that is not there is not created
+        char* sql = sqlite3_mprintf("ATTACH 'file:' || %Q || '?mode=ro' AS shard%u;", path, shard);
+        failed = sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK;
+        sqlite3_free(sql);
+        free(path);
+        char* grown = NULL;
+        ASSERT_ELSE_PERROR(asprintf(&grown, "%s%sSELECT sensor_id,sensor_value,timestamp FROM shard%u." TO_STRING(TABLE_NAME),
+                                    view, shard == first ? "" : " UNION ALL ", shard) > 0);
+        free(view);
+        view = grown;
+    }
+    sqlite3_stmt* query = NULL;
+    failed = failed || sqlite3_exec(db, view, NULL, NULL, NULL) != SQLITE_OK ||
+             sqlite3_prepare_v2(db, "SELECT sensor_id,sensor_value,timestamp FROM " TO_STRING(TABLE_NAME)
+                                    " WHERE (?1 < 0 OR sensor_id = ?1) AND timestamp BETWEEN ?2 AND ?3 ORDER BY timestamp,sensor_id;",
+                                -1, &query, NULL) != SQLITE_OK;
+    free(view);
+    int64_t count = 0;
+    if (!failed) {
+        sqlite3_bind_int(query, 1, dataset->id);
+        sqlite3_bind_int64(query, 2, dataset->from);
+        sqlite3_bind_int64(query, 3, dataset->to);
+        int rc;
+        while ((rc = sqlite3_step(query)) == SQLITE_ROW) {
+            print_reading(sqlite3_column_int(query, 0), sqlite3_column_double(query, 1), sqlite3_column_int64(query, 2));
+            count++;
+        }
+        failed = rc != SQLITE_DONE;
+    }
+    if (failed) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+        count = -1;
+    }
+    sqlite3_finalize(query);
+    sqlite3_close(db);
+    return count;
+}
+
+/**
+ * Reads the shards of a time series store or binary log into 'dataset' and prints them merged
+ * \return the number of readings printed, or -1 if a shard can not be read
+ */
+static int64_t query_files(storagemgr_engine_t engine, unsigned shards, unsigned first, unsigned last, dataset_t* dataset) {
+    for (unsigned shard = first; shard <= last; shard++) {
+        char* path = storagemgr_shard_path(engine == STORAGEMGR_ENGINE_TSDB ? TO_STRING(TSDB_NAME) : TO_STRING(BINLOG_NAME), shard, shards);
+        bool read = engine == STORAGEMGR_ENGINE_TSDB ? tsdb_query(path, dataset->id, dataset->from, dataset->to, add_reading, dataset) >= 0
+                                                     : read_binlog(path, dataset);
+        if (!read) {
+            perror(path);
+            free(path);
+            return -1;
+        }
+        free(path);
+    }
+    // each shard is in the order it was stored, the shards run next to each other
+    qsort(dataset->readings, dataset->count, sizeof(*dataset->readings), compare_readings);
+    for (size_t i = 0; i < dataset->count; i++)
+        print_reading(dataset->readings[i].id, dataset->readings[i].value, dataset->readings[i].ts);
+    return dataset->count;
+}
+
+int main(int argc, char* argv[]) {
+    storagemgr_engine_t engine = STORAGEMGR_ENGINE_SQLITE;
+    dataset_t dataset = {.id = TSDB_ALL_SENSORS, .from = INT64_MIN, .to = INT64_MAX};
+    int opt;
+    while ((opt = getopt(argc, argv, "e:s:f:t:")) != -1) {
+        switch (opt) {
+        case 'e':
+            if (!storagemgr_engine_from_string(optarg, &engine) || engine == STORAGEMGR_ENGINE_NULL)
+                return print_usage();
+            break;
+        case 's':
+            dataset.id = atoi(optarg);
+            if (dataset.id < 0 || dataset.id > UINT16_MAX)
+                return print_usage();
+            break;
+        case 'f':
+            dataset.from = strtoll(optarg, NULL, 10);
+            break;
+        case 't':
+            dataset.to = strtoll(optarg, NULL, 10);
+            break;
+        default:
+            return print_usage();
+        }
+    }
+    if (argc - optind != 1)
+        return print_usage();
+    int shards = atoi(argv[optind]);
+    if (shards < 1)
+        return print_usage();
+
+    // one sensor lives in one shard
+    unsigned first = 0, last = shards - 1;
+    if (dataset.id != TSDB_ALL_SENSORS)
+        first = last = storagemgr_shard_of(dataset.id, shards);
+
+    int64_t count = engine == STORAGEMGR_ENGINE_SQLITE ? query_sqlite(shards, first, last, &dataset)
+                                                       : query_files(engine, shards, first, last, &dataset);
+    free(dataset.readings);
+    if (count < 0)
+        return 1;
+    fprintf(stderr, "%" PRId64 " readings\n", count);
+    return 0;
+}
@@ -0,0 +1,192 @@
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "spill_log.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct spill_segment {
+    struct spill_segment* next;
+    char* path;
+    sensor_data_t* records; // NULL while the segment is neither written nor read
+    size_t written;
+    size_t popped;
+} spill_segment_t;
+
+struct spill_log {
+    char* dir;
+    char* name;
+    size_t segment_records;
+    unsigned next_id;
+    spill_segment_t* head; // oldest segment, the one that is popped from
+    spill_segment_t* tail; // segment that is appended to
+    size_t backlog;
+};
+
+static size_t segment_bytes(spill_log_t* log) {
+    return log->segment_records * sizeof(sensor_data_t);
+}
+
+static bool segment_map(spill_log_t* log, spill_segment_t* segment, bool create) {
+    int fd = open(segment->path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        perror("spill_log: open");
+        return false;
+    }
+    if (create && ftruncate(fd, segment_bytes(log)) != 0) {
+        perror("spill_log: ftruncate");
+        close(fd);
+        return false;
+    }
+    void* records = mmap(NULL, segment_bytes(log), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // the mapping keeps the file referenced
+    close(fd);
+    if (records == MAP_FAILED) {
+        perror("spill_log: mmap");
+        return false;
+    }
+    segment->records = records;
+    return true;
+}
+
+static void segment_unmap(spill_log_t* log, spill_segment_t* segment) {
+    if (segment->records == NULL)
+        return;
+    ASSERT_ELSE_PERROR(munmap(segment->records, segment_bytes(log)) == 0);
+    segment->records = NULL;
+}
+
+static spill_segment_t* segment_create(spill_log_t* log) {
+    spill_segment_t* segment = calloc(1, sizeof(*segment));
+    assert(segment != NULL);
+    ASSERT_ELSE_PERROR(asprintf(&segment->path, "%s/%s-%d-%u.seg", log->dir, log->name, (int) getpid(), log->next_id++) > 0);
+    if (!segment_map(log, segment, true)) {
+        unlink(segment->path);
+        free(segment->path);
+        free(segment);
+        return NULL;
+    }
+    return segment;
+}
+
+static void segment_destroy(spill_log_t* log, spill_segment_t* segment) {
+    segment_unmap(log, segment);
+    unlink(segment->path);
+    free(segment->path);
+    free(segment);
+}
+
+/**
+ * \return the oldest segment that still has records to pop, or NULL
+ */
+static spill_segment_t* read_segment(spill_log_t* log) {
+    spill_segment_t* segment = log->head;
+    if (segment == NULL || segment->popped == segment->written)
+        return NULL;
+    if (segment->records == NULL && !segment_map(log, segment, false))
+        return NULL;
+    return segment;
+}
+
+spill_log_t* spill_log_open(const char* dir, const char* name, size_t segment_records) {
+    assert(dir && name && segment_records > 0);
+    struct stat st;
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        printf("Spill directory %s does not exist\n", dir);
+        return NULL;
+    }
+    spill_log_t* log = calloc(1, sizeof(*log));
+    assert(log != NULL);
+    log->dir = strdup(dir);
+    log->name = strdup(name);
+    log->segment_records = segment_records;
+    return log;
+}
+
+void spill_log_close(spill_log_t* log) {
+    assert(log);
+    while (log->head != NULL) {
+        spill_segment_t* next = log->head->next;
+        segment_destroy(log, log->head);
+        log->head = next;
+    }
+    free(log->dir);
+    free(log->name);
+    free(log);
+}
+
+int spill_log_append(spill_log_t* log, const sensor_data_t* data) {
+    assert(log && data);
+    if (log->tail == NULL || log->tail->written == log->segment_records) {
+        spill_segment_t* segment = segment_create(log);
+        if (segment == NULL)
+            return SPILL_LOG_FAILURE;
+        if (log->tail == NULL) {
+            log->head = segment;
+        } else {
+            log->tail->next = segment;
+            // a full segment is only mapped again when it is read
+            if (log->tail->popped == 0)
+                segment_unmap(log, log->tail);
+        }
+        log->tail = segment;
+    }
+    log->tail->records[log->tail->written++] = *data;
+    log->backlog++;
+    return SPILL_LOG_SUCCESS;
+}
+
+size_t spill_log_peek(spill_log_t* log, sensor_data_t* out, size_t max) {
+    assert(log && out);
+    size_t count = 0;
+    spill_segment_t* segment = read_segment(log);
+    size_t offset = segment != NULL ? segment->popped : 0;
+    while (segment != NULL && count < max) {
+        if (offset == segment->written) {
+            if (segment->written < log->segment_records || segment->next == NULL)
+                break;
+            segment = segment->next;
+            offset = 0;
+            if (segment->records == NULL && !segment_map(log, segment, false))
+                break;
+            continue;
+        }
+        out[count++] = segment->records[offset++];
+    }
+    return count;
+}
+
+void spill_log_pop(spill_log_t* log, size_t count) {
+    assert(log && count <= log->backlog);
+    log->backlog -= count;
+    while (count > 0) {
+        spill_segment_t* segment = read_segment(log);
+        assert(segment != NULL);
+        size_t n = segment->written - segment->popped;
+        if (n > count)
+            n = count;
+        segment->popped += n;
+        count -= n;
+        if (segment->popped == log->segment_records) {
+            // every record now lives in the sbuffer, the file is not needed anymore
+            log->head = segment->next;
+            if (log->tail == segment)
+                log->tail = NULL;
+            segment_destroy(log, segment);
+        }
+    }
+}
+
+size_t spill_log_backlog(spill_log_t* log) {
+    assert(log);
+    return log->backlog;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+/**
+ * Append-only overflow log of sensor readings, split over memory-mapped segment files.
+ * The sbuffer moves readings in here when its ring is too full and moves them back in order once there is room.
+ * Not thread safe: the sbuffer serializes all calls.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SPILL_LOG_SUCCESS 0
+#define SPILL_LOG_FAILURE -1
+
+typedef struct spill_log spill_log_t;
+
+/**
+ * Creates an empty log that stores its segment files in 'dir'
+ * \param name prefix of the segment file names, so several logs can share a directory
+ * \param segment_records the number of readings per segment file
+ * \return the new log, or NULL if 'dir' is not usable
+ */
+spill_log_t* spill_log_open(const char* dir, const char* name, size_t segment_records);
+
+/**
+ * Removes all segment files that are still around and frees the log
+ */
+void spill_log_close(spill_log_t* log);
+
+/**
+ * Appends 'data' to the newest segment, starting a new segment file when it is full
+ * \return SPILL_LOG_SUCCESS, or SPILL_LOG_FAILURE if a new segment could not be created
+ */
+int spill_log_append(spill_log_t* log, const sensor_data_t* data);
+
+/**
+ * Copies up to 'max' of the oldest readings that were not popped yet to 'out', without removing them
+ * \return the number of readings copied
+ */
+size_t spill_log_peek(spill_log_t* log, sensor_data_t* out, size_t max);
+
+/**
+ * Removes the 'count' oldest readings after the caller has moved them elsewhere
+ * A segment file is deleted as soon as its last reading is removed.
+ */
+void spill_log_pop(spill_log_t* log, size_t count);
+
+/**
+ * \return the number of readings that were appended but not popped yet
+ */
+size_t spill_log_backlog(spill_log_t* log);
@@ -0,0 +1,71 @@
+#pragma once
+
+/**
+ * Interface between the storage manager (sensor_db.c) and the storage backends it can run on.
+ * A backend keeps its own state and does its own group commits: insert_batch adds readings to the open group and
+ * commits it once it holds commit_rows readings or is commit_ms old, flush commits the open group right away.
+ * All operations are called from the thread that uses the connection.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "sensor_db.h"
+
+#include <stdatomic.h>
+
+// shared by a connection and its backend: the settings can change from any thread, the totals are read from any thread
+typedef struct {
+    _Atomic unsigned commit_rows;
+    _Atomic unsigned commit_ms;
+    _Atomic int synchronous;
+    _Atomic uint64_t rows;
+    _Atomic uint64_t lost;
+    _Atomic uint64_t transactions;
+} storage_shared_t;
+
+typedef struct {
+    /**
+     * Opens the storage and sets it up for 'config'
+     * \param shared lives as long as the backend, the backend counts its totals in it
+     * \return the state passed to the other operations, or NULL if the storage can not be opened
+     */
+    void* (*init)(bool clear_up_flag, const storagemgr_config_t* config, storage_shared_t* shared);
+    /**
+     * \return zero for success, and non-zero if an error occurs
+     */
+    int (*insert_batch)(void* state, const sensor_data_t* data, size_t count);
+    /**
+     * \return zero for success, and non-zero if an error occurs
+     */
+    int (*flush)(void* state);
+    /**
+     * \return the milliseconds until the backend has to be flushed, 0 if it is due, or -1 if nothing waits
+     */
+    int (*commit_timeout)(void* state);
+    /**
+     * Writes out what is still open and frees the state
+     * \param stats filled out with the totals that only the backend knows (see stats)
+     */
+    void (*close)(void* state, storagemgr_stats_t* stats);
+    /**
+     * Fills out the totals that only the backend knows: checkpoints and bytes
+     */
+    void (*stats)(void* state, storagemgr_stats_t* stats);
+} storage_backend_t;
+
+extern const storage_backend_t storage_sqlite_backend;
+extern const storage_backend_t storage_tsdb_backend;
+extern const storage_backend_t storage_binlog_backend;
+extern const storage_backend_t storage_null_backend;
+
+/**
+ * \return CLOCK_MONOTONIC in milliseconds
+ */
+uint64_t storage_now_ms(void);
+
+/**
+ * \return the milliseconds until a group that opened at 'opened_at' has to be committed, 0 if it is due
+ */
+int storage_group_timeout(const storage_shared_t* shared, uint64_t opened_at);
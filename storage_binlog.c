@@ -0,0 +1,179 @@
+/**
+ * Storage backend that appends the readings to a binary log, for a cheap ingest when they are analysed offline
+ * A group commit is one write of the buffered records, and with STORAGEMGR_SYNC_FULL or higher an fdatasync.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "storage_backend.h"
+
+#include "logger.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct {
+    storage_shared_t* shared;
+    char* path;
+    int fd;
+    off_t size;          // what the file holds, a failed commit is cut off at this size
+    uint8_t* records;    // the open group
+    size_t pending;      // records in it
+    size_t capacity;     // records that fit in it
+    uint64_t opened_at;  // when the first of them was added, in ms
+    uint64_t bytes;      // appended since the log was opened
+} binlog_backend_t;
+
+static void put_le(uint8_t* out, uint64_t value, int size) {
+    for (int i = 0; i < size; i++)
+        out[i] = value >> (8 * i);
+}
+
+static bool write_all(int fd, const uint8_t* buffer, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, buffer, size);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buffer += written;
+        size -= written;
+    }
+    return true;
+}
+
+/**
+ * Checks the header of a log that is appended to, and cuts off a record a crash left half written
+ */
+static bool recover(binlog_backend_t* backend) {
+    struct stat st;
+    if (fstat(backend->fd, &st) != 0)
+        return false;
+    if (st.st_size == 0) {
+        if (!write_all(backend->fd, (const uint8_t*) BINLOG_MAGIC, BINLOG_HEADER_SIZE))
+            return false;
+        backend->size = BINLOG_HEADER_SIZE;
+        return true;
+    }
+    char magic[BINLOG_HEADER_SIZE];
+    if (pread(backend->fd, magic, sizeof(magic), 0) != sizeof(magic) || memcmp(magic, BINLOG_MAGIC, sizeof(magic)) != 0) {
+        errno = EINVAL;
+        return false;
+    }
+    backend->size = st.st_size - (st.st_size - BINLOG_HEADER_SIZE) % BINLOG_RECORD_SIZE;
+    if (backend->size != st.st_size) {
+        logger_log(LOGGER_WARNING, LOGGER_CLASS_SERVER, "Cutting a half written record off %s\n", backend->path);
+        if (ftruncate(backend->fd, backend->size) != 0)
+            return false;
+    }
+    return true;
+}
+
+static void* binlog_init(bool clear_up_flag, const storagemgr_config_t* config, storage_shared_t* shared) {
+    binlog_backend_t* backend = calloc(1, sizeof(*backend));
+    assert(backend != NULL);
+    backend->shared = shared;
+    backend->path = storagemgr_shard_path(TO_STRING(BINLOG_NAME), config->shard, config->shards);
+    backend->fd = open(backend->path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC | (clear_up_flag ? O_TRUNC : 0), 0644);
+    if (backend->fd < 0 || !recover(backend)) {
+        logger_log(LOGGER_ERROR, LOGGER_CLASS_SERVER, "Unable to open %s: %m\n", backend->path);
+        if (backend->fd >= 0)
+            close(backend->fd);
+        free(backend->path);
+        free(backend);
+        return NULL;
+    }
+    logger_log(LOGGER_INFO, LOGGER_CLASS_SERVER, "Binary log %s opened\n", backend->path);
+    return backend;
+}
+
+static int binlog_flush(void* _backend) {
+    binlog_backend_t* backend = _backend;
+    if (backend->pending == 0)
+        return 0;
+    size_t size = backend->pending * BINLOG_RECORD_SIZE;
+    bool sync = atomic_load_explicit(&backend->shared->synchronous, memory_order_relaxed) >= STORAGEMGR_SYNC_FULL;
+    bool written = write_all(backend->fd, backend->records, size) && (!sync || fdatasync(backend->fd) == 0);
+    if (!written) {
+        logger_log(LOGGER_ERROR, LOGGER_CLASS_SERVER, "Writing %s failed: %m\n", backend->path);
+        // a record that is cut in half would shift every record after it
+        if (ftruncate(backend->fd, backend->size) != 0)
+            logger_log(LOGGER_ERROR, LOGGER_CLASS_SERVER, "Undoing the write failed: %m\n");
+        logger_log(LOGGER_ERROR, LOGGER_CLASS_SERVER, "%zu readings were not stored\n", backend->pending);
+        atomic_fetch_add_explicit(&backend->shared->lost, backend->pending, memory_order_relaxed);
+    } else {
+        backend->size += size;
+        backend->bytes += size;
+        atomic_fetch_add_explicit(&backend->shared->rows, backend->pending, memory_order_relaxed);
+        atomic_fetch_add_explicit(&backend->shared->transactions, 1, memory_order_relaxed);
+    }
+    backend->pending = 0;
+    return written ? 0 : 1;
+}
+
+static int binlog_commit_timeout(void* _backend) {
+    binlog_backend_t* backend = _backend;
+    return backend->pending > 0 ? storage_group_timeout(backend->shared, backend->opened_at) : -1;
+}
+
+static int binlog_insert_batch(void* _backend, const sensor_data_t* data, size_t count) {
+    binlog_backend_t* backend = _backend;
+    if (backend->pending == 0)
+        backend->opened_at = storage_now_ms();
+    if (backend->pending + count > backend->capacity) {
+        backend->capacity = backend->capacity > 0 ? backend->capacity : 256;
+        while (backend->capacity < backend->pending + count)
+            backend->capacity *= 2;
+        backend->records = realloc(backend->records, backend->capacity * BINLOG_RECORD_SIZE);
+        assert(backend->records != NULL);
+    }
+    uint8_t* record = backend->records + backend->pending * BINLOG_RECORD_SIZE;
+    for (size_t i = 0; i < count; i++, record += BINLOG_RECORD_SIZE) {
+        uint64_t value;
+        memcpy(&value, &data[i].value, sizeof(value));
+        put_le(record, data[i].id, 2);
+        put_le(record + 2, value, 8);
+        put_le(record + 10, data[i].ts, 8);
+    }
+    backend->pending += count;
+    if (backend->pending >= atomic_load_explicit(&backend->shared->commit_rows, memory_order_relaxed) || binlog_commit_timeout(backend) == 0)
+        return binlog_flush(backend);
+    return 0;
+}
+
+static void binlog_stats(void* _backend, storagemgr_stats_t* stats) {
+    binlog_backend_t* backend = _backend;
+    stats->checkpoints = 0;
+    stats->bytes = backend->bytes;
+}
+
+static void binlog_close(void* _backend, storagemgr_stats_t* stats) {
+    binlog_backend_t* backend = _backend;
+    binlog_flush(backend);
+    // whatever the synchronous level, like the time series store
+    if (fdatasync(backend->fd) != 0 || close(backend->fd) != 0)
+        logger_log(LOGGER_ERROR, LOGGER_CLASS_SERVER, "Closing %s failed: %m\n", backend->path);
+    binlog_stats(backend, stats);
+    free(backend->path);
+    free(backend->records);
+    free(backend);
+}
+
+const storage_backend_t storage_binlog_backend = {
+    .init = binlog_init,
+    .insert_batch = binlog_insert_batch,
+    .flush = binlog_flush,
+    .commit_timeout = binlog_commit_timeout,
+    .close = binlog_close,
+    .stats = binlog_stats,
+};
@@ -0,0 +1,59 @@
+/**
+ * Storage backend that counts the readings and throws them away
+ * With it the server runs as fast as everything but the storage lets it: an upper bound for the pipeline.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "storage_backend.h"
+
+#include "logger.h"
+
+#include <stdatomic.h>
+
+static void* null_init(bool clear_up_flag, const storagemgr_config_t* config, storage_shared_t* shared) {
+    (void) clear_up_flag;
+    (void) config;
+    logger_log(LOGGER_INFO, LOGGER_CLASS_SERVER, "Readings are not stored\n");
+    // the state only has to be something else than NULL
+    return shared;
+}
+
+static int null_insert_batch(void* state, const sensor_data_t* data, size_t count) {
+    (void) data;
+    storage_shared_t* shared = state;
+    atomic_fetch_add_explicit(&shared->rows, count, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shared->transactions, 1, memory_order_relaxed);
+    return 0;
+}
+
+static int null_flush(void* state) {
+    (void) state;
+    return 0;
+}
+
+static int null_commit_timeout(void* state) {
+    (void) state;
+    return -1;
+}
+
+static void null_stats(void* state, storagemgr_stats_t* stats) {
+    (void) state;
+    stats->checkpoints = 0;
+    stats->bytes = 0;
+}
+
+static void null_close(void* state, storagemgr_stats_t* stats) {
+    null_stats(state, stats);
+}
+
+const storage_backend_t storage_null_backend = {
+    .init = null_init,
+    .insert_batch = null_insert_batch,
+    .flush = null_flush,
+    .commit_timeout = null_commit_timeout,
+    .close = null_close,
+    .stats = null_stats,
+};
@@ -0,0 +1,363 @@
+/**
+ * \author Mathieu Erbas
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "storage_backend.h"
+
+#include "logger.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RUN_QUERY(connection, callback, query_failed, format...)                \
+    do {                                                                        \
+        char* sql_query = NULL;                                                 \
+        ASSERT_ELSE_PERROR(asprintf(&sql_query, format) > 0);                   \
+        char* err_msg = NULL;                                                   \
+        query_failed = false;                                                   \
+        int retries = 0;                                                        \
+        int rc = !SQLITE_OK;                                                    \
+        do {                                                                    \
+            rc = sqlite3_exec(connection, sql_query, callback, NULL, &err_msg); \
+            retries++;                                                          \
+        } while (rc != SQLITE_OK && retries < 3);                               \
+        if (rc != SQLITE_OK) {                                                  \
+            logger_log(LOGGER_ERROR, LOGGER_CLASS_SERVER,                       \
+                       "Query \" %s \" Failed :%s\n", sql_query, err_msg);      \
+            logger_log(LOGGER_ERROR, LOGGER_CLASS_SERVER,                       \
+                       "Connection to SQL server lost\n");                      \
+            sqlite3_free(err_msg);                                              \
+            sqlite3_close(connection);                                          \
+            query_failed = true;                                                \
+        }                                                                       \
+        free(sql_query);                                                        \
+    } while (false)
+
+// the checkpoint thread also wakes up this often without being asked, to catch a WAL that stopped growing
+#define CHECKPOINT_INTERVAL_MS 1000
+
+typedef struct {
+    pthread_t thread;
+    sqlite3* db; // a connection of its own, so checkpoints never wait for or hold up an insert
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool requested;
+    bool stopping;
+    unsigned pages; // the WAL size that wakes the thread
+    _Atomic uint64_t checkpoints;
+} checkpointer_t;
+
+typedef struct {
+    storage_shared_t* shared;
+    char* path;
+    sqlite3* db;
+    // prepared once, so a reading only costs binding its values instead of parsing a query
+    sqlite3_stmt* begin;
+    sqlite3_stmt* insert;
+    sqlite3_stmt* commit;
+    sqlite3_stmt* rollback;
+    int applied_synchronous;
+    bool in_transaction;
+    size_t pending;     // readings in the open transaction
+    uint64_t opened_at; // when the first of them was inserted, in ms
+    checkpointer_t checkpointer;
+} sqlite_backend_t;
+
+static sqlite3_stmt* prepare(sqlite3* db, const char* sql) {
+    sqlite3_stmt* statement = NULL;
+    if (sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &statement, NULL) != SQLITE_OK) {
+        logger_log(LOGGER_ERROR, LOGGER_CLASS_SERVER, "Query \" %s \" Failed :%s\n", sql, sqlite3_errmsg(db));
+        return NULL;
+    }
+    return statement;
+}
+
+/**
+ * Runs a statement without results and makes it ready for the next run
+ * \return true if it succeeded
+ */
+static bool run(sqlite_backend_t* backend, sqlite3_stmt* statement) {
+    int rc = sqlite3_step(statement);
+    sqlite3_reset(statement);
+    if (rc != SQLITE_DONE) {
+        logger_log(LOGGER_ERROR, LOGGER_CLASS_SERVER, "Query \" %s \" Failed :%s\n", sqlite3_sql(statement), sqlite3_errmsg(backend->db));
+        return false;
+    }
+    return true;
+}
+
+static bool exec(sqlite_backend_t* backend, const char* sql) {
+    char* err_msg = NULL;
+    if (sqlite3_exec(backend->db, sql, NULL, NULL, &err_msg) != SQLITE_OK) {
+        logger_log(LOGGER_ERROR, LOGGER_CLASS_SERVER, "Query \" %s \" Failed :%s\n", sql, err_msg);
+        sqlite3_free(err_msg);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Switches to the synchronous level that was asked for last, outside of a transaction
+ */
+static bool apply_synchronous(sqlite_backend_t* backend) {
+    int synchronous = atomic_load_explicit(&backend->shared->synchronous, memory_order_relaxed);
+    if (synchronous == backend->applied_synchronous)
+        return true;
+    char sql[32];
+    snprintf(sql, sizeof(sql), "PRAGMA synchronous=%d;", synchronous);
+    if (!exec(backend, sql))
+        return false;
+    backend->applied_synchronous = synchronous;
+    return true;
+}
+
+/**
+ * Called by sqlite on the inserting thread after every commit, with the number of pages in the WAL
+ */
+static int wal_committed(void* _checkpointer, sqlite3* db, const char* name, int pages) {
+    (void) db;
+    (void) name;
+    checkpointer_t* checkpointer = _checkpointer;
+    if ((unsigned) pages < checkpointer->pages)
+        return SQLITE_OK;
+    pthread_mutex_lock(&checkpointer->lock);
+    checkpointer->requested = true;
+    pthread_cond_signal(&checkpointer->wake);
+    pthread_mutex_unlock(&checkpointer->lock);
+    return SQLITE_OK;
+}
+
+static void checkpoint(checkpointer_t* checkpointer, int mode) {
+    int rc = sqlite3_wal_checkpoint_v2(checkpointer->db, NULL, mode, NULL, NULL);
+    // busy: a commit was going on, the next wake up tries again
+    if (rc == SQLITE_OK)
+        atomic_fetch_add_explicit(&checkpointer->checkpoints, 1, memory_order_relaxed);
+    else if (rc != SQLITE_BUSY)
+        logger_log(LOGGER_WARNING, LOGGER_CLASS_SERVER, "Checkpoint failed: %s\n", sqlite3_errmsg(checkpointer->db));
+}
+
+static void* run_checkpointer(void* _checkpointer) {
+    checkpointer_t* checkpointer = _checkpointer;
+    pthread_mutex_lock(&checkpointer->lock);
+    while (!checkpointer->stopping) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += CHECKPOINT_INTERVAL_MS / 1000;
+        while (!checkpointer->requested && !checkpointer->stopping)
+            if (pthread_cond_timedwait(&checkpointer->wake, &checkpointer->lock, &until) != 0)
+                break;
+        checkpointer->requested = false;
+        pthread_mutex_unlock(&checkpointer->lock);
+        // passive: copies what it can without waiting for the writer, the writer never waits for it either
+        checkpoint(checkpointer, SQLITE_CHECKPOINT_PASSIVE);
+        pthread_mutex_lock(&checkpointer->lock);
+    }
+    pthread_mutex_unlock(&checkpointer->lock);
+    // nothing is written anymore: copy everything and empty the WAL file
+    checkpoint(checkpointer, SQLITE_CHECKPOINT_TRUNCATE);
+    return NULL;
+}
+
+static bool checkpointer_start(sqlite_backend_t* backend, unsigned pages) {
+    checkpointer_t* checkpointer = &backend->checkpointer;
+    if (sqlite3_open(backend->path, &checkpointer->db) != SQLITE_OK) {
+        logger_log(LOGGER_ERROR, LOGGER_CLASS_SERVER, "Unable to open a checkpoint connection: %s\n", sqlite3_errmsg(checkpointer->db));
+        sqlite3_close(checkpointer->db);
+        checkpointer->db = NULL;
+        return false;
+    }
+    checkpointer->pages = pages;
+    ASSERT_ELSE_PERROR(pthread_mutex_init(&checkpointer->lock, NULL) == 0);
+    ASSERT_ELSE_PERROR(pthread_cond_init(&checkpointer->wake, NULL) == 0);
+    // replaces the automatic checkpoint, which would run on the inserting thread right after a commit
+    sqlite3_wal_hook(backend->db, wal_committed, checkpointer);
+    ASSERT_ELSE_PERROR(pthread_create(&checkpointer->thread, NULL, run_checkpointer, checkpointer) == 0);
+    return true;
+}
+
+static void checkpointer_stop(sqlite_backend_t* backend) {
+    checkpointer_t* checkpointer = &backend->checkpointer;
+    pthread_mutex_lock(&checkpointer->lock);
+    checkpointer->stopping = true;
+    pthread_cond_signal(&checkpointer->wake);
+    pthread_mutex_unlock(&checkpointer->lock);
+    ASSERT_ELSE_PERROR(pthread_join(checkpointer->thread, NULL) == 0);
+    sqlite3_wal_hook(backend->db, NULL, NULL);
+    pthread_cond_destroy(&checkpointer->wake);
+    pthread_mutex_destroy(&checkpointer->lock);
+    sqlite3_close(checkpointer->db);
+    checkpointer->db = NULL;
+}
+
+static bool sqlite_connect(sqlite_backend_t* backend, bool clear_up_flag, const storagemgr_config_t* config) {
+    sqlite3* db = NULL;
+    int rc = sqlite3_open(backend->path, &db); // rc stands for result code
+    if (rc != SQLITE_OK) {
+        logger_log(LOGGER_ERROR, LOGGER_CLASS_SERVER, "Unable to connect to SQL server: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return false;
+    }
+
+    logger_log(LOGGER_INFO, LOGGER_CLASS_SERVER, "Connection to SQL server established\n");
+
+    char* query =
+        clear_up_flag == 1
+            ? "DROP TABLE IF EXISTS " TO_STRING(
+                  TABLE_NAME) ";"
+                              "CREATE TABLE " TO_STRING(
+                                  TABLE_NAME) " (id INTEGER PRIMARY KEY "
+                                              "AUTOINCREMENT,sensor_id INT, "
+                                              "sensor_value DECIMAL(4,2), "
+                                              "timestamp TIMESTAMP);"
+            : "CREATE TABLE IF NOT EXISTS " TO_STRING(
+                  TABLE_NAME) " (id INTEGER PRIMARY KEY AUTOINCREMENT,sensor_id "
+                              "INT, sensor_value DECIMAL(4,2), timestamp "
+                              "TIMESTAMP);";
+    bool query_failed = false;
+
+    RUN_QUERY(db, NULL, query_failed, query, NULL);
+
+    assert(db != NULL);
+    query_failed ? logger_log(LOGGER_ERROR, LOGGER_CLASS_SERVER, "A new table couldn't be created\n")
+                 : logger_log(LOGGER_INFO, LOGGER_CLASS_SERVER, "New table " TO_STRING(TABLE_NAME) " created\n");
+    if (query_failed)
+        return false;
+
+    backend->db = db;
+    backend->applied_synchronous = -1;
+    // readers (the checkpoint thread) and the writer no longer block each other, and a commit only appends to the WAL
+    if (!exec(backend, "PRAGMA journal_mode=WAL;") || !apply_synchronous(backend))
+        return false;
+    backend->begin = prepare(db, "BEGIN;");
+    backend->insert = prepare(db, "INSERT INTO " TO_STRING(TABLE_NAME) "(sensor_id,sensor_value,timestamp) VALUES (?,?,?);");
+    backend->commit = prepare(db, "COMMIT;");
+    backend->rollback = prepare(db, "ROLLBACK;");
+    return backend->begin != NULL && backend->insert != NULL && backend->commit != NULL && backend->rollback != NULL &&
+           checkpointer_start(backend, config->checkpoint_pages);
+}
+
+static void sqlite_disconnect(sqlite_backend_t* backend) {
+    if (backend->checkpointer.db != NULL)
+        checkpointer_stop(backend);
+    // finalizing or closing NULL is a no-op
+    sqlite3_finalize(backend->begin);
+    sqlite3_finalize(backend->insert);
+    sqlite3_finalize(backend->commit);
+    sqlite3_finalize(backend->rollback);
+    sqlite3_close(backend->db);
+    free(backend->path);
+}
+
+static void* sqlite_init(bool clear_up_flag, const storagemgr_config_t* config, storage_shared_t* shared) {
+    sqlite_backend_t* backend = calloc(1, sizeof(*backend));
+    assert(backend != NULL);
+    backend->shared = shared;
+    backend->path = storagemgr_shard_path(TO_STRING(DB_NAME), config->shard, config->shards);
+    if (!sqlite_connect(backend, clear_up_flag, config)) {
+        sqlite_disconnect(backend);
+        free(backend);
+        return NULL;
+    }
+    return backend;
+}
+
+static bool insert_rows(sqlite_backend_t* backend, const sensor_data_t* data, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        sqlite3_bind_int(backend->insert, 1, data[i].id);
+        sqlite3_bind_double(backend->insert, 2, data[i].value);
+        sqlite3_bind_int64(backend->insert, 3, data[i].ts);
+        if (!run(backend, backend->insert))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Rolls the open transaction back after a failed insert or commit
+ */
+static void abort_transaction(sqlite_backend_t* backend) {
+    // a failed commit can have rolled back already, then this fails too
+    if (!sqlite3_get_autocommit(backend->db))
+        run(backend, backend->rollback);
+    logger_log(LOGGER_ERROR, LOGGER_CLASS_SERVER, "%zu readings were not stored\n", backend->pending);
+    atomic_fetch_add_explicit(&backend->shared->lost, backend->pending, memory_order_relaxed);
+    backend->in_transaction = false;
+    backend->pending = 0;
+}
+
+static int sqlite_flush(void* _backend) {
+    sqlite_backend_t* backend = _backend;
+    if (!backend->in_transaction)
+        return 0;
+    if (!run(backend, backend->commit)) {
+        abort_transaction(backend);
+        return 1;
+    }
+    atomic_fetch_add_explicit(&backend->shared->rows, backend->pending, memory_order_relaxed);
+    atomic_fetch_add_explicit(&backend->shared->transactions, 1, memory_order_relaxed);
+    backend->in_transaction = false;
+    backend->pending = 0;
+    return 0;
+}
+
+static int sqlite_commit_timeout(void* _backend) {
+    sqlite_backend_t* backend = _backend;
+    return backend->in_transaction ? storage_group_timeout(backend->shared, backend->opened_at) : -1;
+}
+
+static int sqlite_insert_batch(void* _backend, const sensor_data_t* data, size_t count) {
+    sqlite_backend_t* backend = _backend;
+    if (!backend->in_transaction) {
+        if (!apply_synchronous(backend) || !run(backend, backend->begin)) {
+            // no transaction is open, only these readings are lost
+            backend->pending = count;
+            abort_transaction(backend);
+            return 1;
+        }
+        backend->in_transaction = true;
+        backend->opened_at = storage_now_ms();
+    }
+    backend->pending += count;
+    if (!insert_rows(backend, data, count)) {
+        abort_transaction(backend);
+        return 1;
+    }
+    // group commit: one sync to disk for many batches
+    if (backend->pending >= atomic_load_explicit(&backend->shared->commit_rows, memory_order_relaxed) || sqlite_commit_timeout(backend) == 0)
+        return sqlite_flush(backend);
+    return 0;
+}
+
+static void sqlite_stats(void* _backend, storagemgr_stats_t* stats) {
+    sqlite_backend_t* backend = _backend;
+    stats->checkpoints = atomic_load_explicit(&backend->checkpointer.checkpoints, memory_order_relaxed);
+    stats->bytes = 0;
+}
+
+static void sqlite_close(void* _backend, storagemgr_stats_t* stats) {
+    sqlite_backend_t* backend = _backend;
+    sqlite_flush(backend);
+    // the last checkpoint runs while stopping the thread
+    sqlite_disconnect(backend);
+    sqlite_stats(backend, stats);
+    free(backend);
+}
+
+const storage_backend_t storage_sqlite_backend = {
+    .init = sqlite_init,
+    .insert_batch = sqlite_insert_batch,
+    .flush = sqlite_flush,
+    .commit_timeout = sqlite_commit_timeout,
+    .close = sqlite_close,
+    .stats = sqlite_stats,
+};
@@ -0,0 +1,118 @@
+/**
+ * Storage backend on the compressed time series store of tsdb.h
+ * The store compresses in memory, a group commit appends the blocks that were sealed since the last one.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "storage_backend.h"
+
+#include "logger.h"
+#include "tsdb.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef struct {
+    storage_shared_t* shared;
+    char* path;
+    tsdb_t* tsdb;
+    uint64_t sealed_at; // when the oldest sealed block that is not written out yet was sealed, in ms
+} tsdb_backend_t;
+
+static void* tsdb_backend_init(bool clear_up_flag, const storagemgr_config_t* config, storage_shared_t* shared) {
+    tsdb_config_t tsdb_config = TSDB_DEFAULT_CONFIG;
+    char* path = storagemgr_shard_path(TO_STRING(TSDB_NAME), config->shard, config->shards);
+    tsdb_t* tsdb = tsdb_open(path, clear_up_flag, &tsdb_config);
+    if (tsdb == NULL) {
+        logger_log(LOGGER_ERROR, LOGGER_CLASS_SERVER, "Unable to open %s: %m\n", path);
+        free(path);
+        return NULL;
+    }
+    logger_log(LOGGER_INFO, LOGGER_CLASS_SERVER, "Time series store %s opened\n", path);
+    tsdb_backend_t* backend = calloc(1, sizeof(*backend));
+    assert(backend != NULL);
+    backend->shared = shared;
+    backend->path = path;
+    backend->tsdb = tsdb;
+    return backend;
+}
+
+static int tsdb_backend_flush(void* _backend) {
+    tsdb_backend_t* backend = _backend;
+    bool sync = atomic_load_explicit(&backend->shared->synchronous, memory_order_relaxed) >= STORAGEMGR_SYNC_FULL;
+    tsdb_stats_t before;
+    tsdb_get_stats(backend->tsdb, &before);
+    if (tsdb_flush(backend->tsdb, sync) != 0) {
+        // the blocks stay in memory for the next try
+        logger_log(LOGGER_ERROR, LOGGER_CLASS_SERVER, "Writing %s failed: %m\n", backend->path);
+        return 1;
+    }
+    tsdb_stats_t after;
+    tsdb_get_stats(backend->tsdb, &after);
+    if (after.blocks != before.blocks)
+        atomic_fetch_add_explicit(&backend->shared->transactions, 1, memory_order_relaxed);
+    atomic_store_explicit(&backend->shared->rows, after.readings, memory_order_relaxed);
+    return 0;
+}
+
+static int tsdb_backend_commit_timeout(void* _backend) {
+    tsdb_backend_t* backend = _backend;
+    // a block that ages out is sealed by the flush, and sealed blocks wait at most commit_ms
+    int timeout = tsdb_seal_timeout(backend->tsdb);
+    if (tsdb_sealed_readings(backend->tsdb) > 0) {
+        int commit = storage_group_timeout(backend->shared, backend->sealed_at);
+        if (timeout < 0 || commit < timeout)
+            timeout = commit;
+    }
+    return timeout;
+}
+
+static int tsdb_backend_insert_batch(void* _backend, const sensor_data_t* data, size_t count) {
+    tsdb_backend_t* backend = _backend;
+    bool had_sealed = tsdb_sealed_readings(backend->tsdb) > 0;
+    for (size_t i = 0; i < count; i++)
+        tsdb_append(backend->tsdb, data[i].id, data[i].value, data[i].ts);
+    if (!had_sealed && tsdb_sealed_readings(backend->tsdb) > 0)
+        backend->sealed_at = storage_now_ms();
+    if (tsdb_sealed_readings(backend->tsdb) >= atomic_load_explicit(&backend->shared->commit_rows, memory_order_relaxed) ||
+        tsdb_backend_commit_timeout(backend) == 0)
+        return tsdb_backend_flush(backend);
+    return 0;
+}
+
+static void tsdb_backend_stats(void* _backend, storagemgr_stats_t* stats) {
+    tsdb_backend_t* backend = _backend;
+    tsdb_stats_t tsdb_stats;
+    tsdb_get_stats(backend->tsdb, &tsdb_stats);
+    stats->checkpoints = 0;
+    stats->bytes = tsdb_stats.data_bytes + tsdb_stats.index_bytes;
+}
+
+static void tsdb_backend_close(void* _backend, storagemgr_stats_t* stats) {
+    tsdb_backend_t* backend = _backend;
+    tsdb_backend_flush(backend);
+    // seals the open blocks and syncs, whatever the synchronous level
+    tsdb_stats_t tsdb_stats;
+    if (tsdb_close(backend->tsdb, &tsdb_stats) != 0)
+        logger_log(LOGGER_ERROR, LOGGER_CLASS_SERVER, "Closing %s failed: %m\n", backend->path);
+    atomic_store_explicit(&backend->shared->rows, tsdb_stats.readings, memory_order_relaxed);
+    atomic_fetch_add_explicit(&backend->shared->transactions, 1, memory_order_relaxed);
+    stats->checkpoints = 0;
+    stats->bytes = tsdb_stats.data_bytes + tsdb_stats.index_bytes;
+    free(backend->path);
+    free(backend);
+}
+
+const storage_backend_t storage_tsdb_backend = {
+    .init = tsdb_backend_init,
+    .insert_batch = tsdb_backend_insert_batch,
+    .flush = tsdb_backend_flush,
+    .commit_timeout = tsdb_backend_commit_timeout,
+    .close = tsdb_backend_close,
+    .stats = tsdb_backend_stats,
+};
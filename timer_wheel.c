@@ -0,0 +1,173 @@
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "timer_wheel.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+#define SLOTS (1u << TIMER_WHEEL_BITS)
+#define SLOT_MASK ((uint64_t) SLOTS - 1)
+
+struct timer_wheel {
+    uint64_t now;
+    uint64_t armed;
+    void* context;
+    // circular lists with a dummy head, so unlinking never needs to know which list a timer is in
+    timer_wheel_timer_t slots[TIMER_WHEEL_LEVELS][SLOTS];
+    timer_wheel_timer_t overflow;
+};
+
+static void list_init(timer_wheel_timer_t* head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static bool list_empty(const timer_wheel_timer_t* head) {
+    return head->next == head;
+}
+
+static void list_append(timer_wheel_timer_t* head, timer_wheel_timer_t* timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void list_unlink(timer_wheel_timer_t* timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+/**
+ * Moves every timer of 'from' to the empty list 'to'
+ */
+static void list_move(timer_wheel_timer_t* from, timer_wheel_timer_t* to) {
+    if (list_empty(from)) {
+        list_init(to);
+        return;
+    }
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    list_init(from);
+}
+
+/**
+ * \return the list 'expires' belongs in: the lowest level above which it agrees with 'now'
+ */
+static timer_wheel_timer_t* slot_of(timer_wheel_t* wheel, uint64_t expires) {
+    for (unsigned level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        unsigned shift = TIMER_WHEEL_BITS * (level + 1);
+        if (expires >> shift == wheel->now >> shift)
+            return &wheel->slots[level][(expires >> (shift - TIMER_WHEEL_BITS)) & SLOT_MASK];
+    }
+    return &wheel->overflow;
+}
+
+/**
+ * Puts the timers of 'slot' back in the wheel, now that they are closer they end up a level lower
+ */
+static void cascade(timer_wheel_t* wheel, timer_wheel_timer_t* slot) {
+    timer_wheel_timer_t pending;
+    list_move(slot, &pending);
+    while (!list_empty(&pending)) {
+        timer_wheel_timer_t* timer = pending.next;
+        list_unlink(timer);
+        list_append(slot_of(wheel, timer->expires), timer);
+    }
+}
+
+timer_wheel_t* timer_wheel_create(uint64_t now, void* context) {
+    timer_wheel_t* wheel = malloc(sizeof(*wheel));
+    assert(wheel != NULL);
+    wheel->now = now;
+    wheel->armed = 0;
+    wheel->context = context;
+    for (unsigned level = 0; level < TIMER_WHEEL_LEVELS; level++)
+        for (unsigned slot = 0; slot < SLOTS; slot++)
+            list_init(&wheel->slots[level][slot]);
+    list_init(&wheel->overflow);
+    return wheel;
+}
+
+void timer_wheel_destroy(timer_wheel_t* wheel) {
+    assert(wheel);
+    free(wheel);
+}
+
+void timer_wheel_timer_init(timer_wheel_timer_t* timer, timer_wheel_callback_t callback, void* arg) {
+    assert(timer && callback);
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+}
+
+void timer_wheel_arm(timer_wheel_t* wheel, timer_wheel_timer_t* timer, uint64_t expires) {
+    assert(wheel && timer);
+    timer_wheel_cancel(wheel, timer);
+    // the slot of the current tick already expired
+    if (expires <= wheel->now)
+        expires = wheel->now + 1;
+    timer->expires = expires;
+    list_append(slot_of(wheel, expires), timer);
+    wheel->armed++;
+}
+
+void timer_wheel_cancel(timer_wheel_t* wheel, timer_wheel_timer_t* timer) {
+    assert(wheel && timer);
+    if (timer->next == NULL)
+        return;
+    list_unlink(timer);
+    wheel->armed--;
+}
+
+bool timer_wheel_is_armed(const timer_wheel_timer_t* timer) {
+    assert(timer);
+    return timer->next != NULL;
+}
+
+uint64_t timer_wheel_advance(timer_wheel_t* wheel, uint64_t now) {
+    assert(wheel);
+    uint64_t expired = 0;
+    while (wheel->now < now) {
+        // nothing to cascade or expire on the way
+        if (wheel->armed == 0) {
+            wheel->now = now;
+            break;
+        }
+        wheel->now++;
+
+        // every level whose lower levels wrapped around hands its current slot down, the highest first
+        if ((wheel->now & ((UINT64_C(1) << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)) == 0)
+            cascade(wheel, &wheel->overflow);
+        for (unsigned level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+            unsigned shift = TIMER_WHEEL_BITS * level;
+            if ((wheel->now & ((UINT64_C(1) << shift) - 1)) == 0)
+                cascade(wheel, &wheel->slots[level][(wheel->now >> shift) & SLOT_MASK]);
+        }
+
+        // the whole slot expires at once, a callback can still cancel or re-arm a timer that is pending here
+        timer_wheel_timer_t pending;
+        list_move(&wheel->slots[0][wheel->now & SLOT_MASK], &pending);
+        while (!list_empty(&pending)) {
+            timer_wheel_timer_t* timer = pending.next;
+            list_unlink(timer);
+            wheel->armed--;
+            expired++;
+            timer->callback(wheel->context, timer->arg);
+        }
+    }
+    return expired;
+}
+
+uint64_t timer_wheel_now(const timer_wheel_t* wheel) {
+    assert(wheel);
+    return wheel->now;
+}
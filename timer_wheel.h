@@ -0,0 +1,86 @@
+#pragma once
+
+/**
+ * Hierarchical timer wheel: timers with an expiry tick that is arbitrarily far away, arming and cancelling in O(1).
+ * Level 0 has one slot per tick, every next level has slots that span all slots of the level below.
+ * Timers move down a level when the wheel reaches their slot, and expire in batches of one slot per tick.
+ * What a tick is (a second, a millisecond, ...) is up to the user. Not thread safe: one wheel per thread.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// slots per level is 1 << TIMER_WHEEL_BITS
+#define TIMER_WHEEL_BITS 6
+// the levels cover 1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS) ticks, timers further away wait in an overflow list
+#define TIMER_WHEEL_LEVELS 4
+
+typedef struct timer_wheel timer_wheel_t;
+typedef struct timer_wheel_timer timer_wheel_timer_t;
+
+/**
+ * Called when a timer expires, the timer is no longer armed by then and may be armed again or freed
+ * \param context the context the wheel was created with
+ * \param arg the argument the timer was initialized with
+ */
+typedef void (*timer_wheel_callback_t)(void* context, void* arg);
+
+/**
+ * A timer, meant to be embedded in the object it times. The fields belong to the wheel.
+ */
+struct timer_wheel_timer {
+    timer_wheel_timer_t* next; // NULL while not armed
+    timer_wheel_timer_t* prev;
+    uint64_t expires;
+    timer_wheel_callback_t callback;
+    void* arg;
+};
+
+/**
+ * Creates an empty wheel
+ * \param now the current tick, timers expire relative to it
+ * \param context passed to every callback
+ */
+timer_wheel_t* timer_wheel_create(uint64_t now, void* context);
+
+/**
+ * Frees the wheel, timers that are still armed are simply forgotten
+ */
+void timer_wheel_destroy(timer_wheel_t* wheel);
+
+/**
+ * Prepares a timer that is not armed yet
+ */
+void timer_wheel_timer_init(timer_wheel_timer_t* timer, timer_wheel_callback_t callback, void* arg);
+
+/**
+ * Arms 'timer' to expire at tick 'expires', moving it if it already was armed
+ * A tick that already passed expires at the next tick.
+ */
+void timer_wheel_arm(timer_wheel_t* wheel, timer_wheel_timer_t* timer, uint64_t expires);
+
+/**
+ * Disarms 'timer', does nothing if it is not armed
+ */
+void timer_wheel_cancel(timer_wheel_t* wheel, timer_wheel_timer_t* timer);
+
+/**
+ * \return true if 'timer' is armed and did not expire yet
+ */
+bool timer_wheel_is_armed(const timer_wheel_timer_t* timer);
+
+/**
+ * Moves the wheel forward to tick 'now' and calls the callback of every timer that expires on the way
+ * Callbacks may arm and cancel timers, including other timers that expire in the same tick.
+ * \return the number of expired timers
+ */
+uint64_t timer_wheel_advance(timer_wheel_t* wheel, uint64_t now);
+
+/**
+ * \return the tick the wheel is at
+ */
+uint64_t timer_wheel_now(const timer_wheel_t* wheel);
@@ -0,0 +1,484 @@
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "tsdb.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BLOCK_HEADER_SIZE 8
+#define INDEX_ENTRY_SIZE 32
+// no window of meaningful bits yet, the next XOR always writes its own
+#define NO_WINDOW 64
+
+/**
+ * The open block of one sensor, and what the next reading is compressed against
+ */
+typedef struct series {
+    struct series* older; // open blocks, oldest first
+    struct series* newer;
+    sensor_id_t id;
+    uint8_t* bits;
+    size_t capacity; // bytes
+    size_t length;   // bits
+    uint16_t count;
+    uint64_t opened_at; // ms
+    sensor_ts_t first_ts;
+    sensor_ts_t prev_ts;
+    int64_t prev_delta;
+    uint64_t prev_value;
+    unsigned leading; // the window of the previous XOR
+    unsigned trailing;
+} series_t;
+
+struct tsdb {
+    tsdb_config_t config;
+    int data_fd;
+    int index_fd;
+    uint64_t data_size; // what is on disk, the offset of the next block written
+    uint64_t index_size;
+    series_t* oldest;
+    series_t* newest;
+    // sealed blocks and their index entries, as they go to the files
+    uint8_t* data;
+    size_t data_used;
+    size_t data_capacity;
+    uint8_t* index;
+    size_t index_used;
+    size_t index_capacity;
+    size_t sealed_readings;
+    size_t sealed_blocks;
+    tsdb_stats_t stats;
+    series_t* series[UINT16_MAX + 1];
+};
+
+static uint64_t now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void put_le(uint8_t* out, uint64_t value, int size) {
+    for (int i = 0; i < size; i++)
+        out[i] = value >> (8 * i);
+}
+
+static uint64_t get_le(const uint8_t* in, int size) {
+    uint64_t value = 0;
+    for (int i = 0; i < size; i++)
+        value |= (uint64_t) in[i] << (8 * i);
+    return value;
+}
+
+static void reserve(uint8_t** buffer, size_t* capacity, size_t needed) {
+    if (needed <= *capacity)
+        return;
+    size_t grown = *capacity > 0 ? *capacity : 256;
+    while (grown < needed)
+        grown *= 2;
+    *buffer = realloc(*buffer, grown);
+    assert(*buffer != NULL);
+    // bits are or'ed in, so the new part has to start at zero
+    memset(*buffer + *capacity, 0, grown - *capacity);
+    *capacity = grown;
+}
+
+/**
+ * Appends the lowest 'n' bits of 'value', most significant first
+ */
+static void put_bits(series_t* series, uint64_t value, unsigned n) {
+    reserve(&series->bits, &series->capacity, (series->length + n + 7) / 8);
+    while (n > 0) {
+        unsigned space = 8 - series->length % 8;
+        unsigned take = n < space ? n : space;
+        uint8_t bits = (value >> (n - take)) & ((1u << take) - 1);
+        series->bits[series->length / 8] |= bits << (space - take);
+        series->length += take;
+        n -= take;
+    }
+}
+
+typedef struct {
+    const uint8_t* bits;
+    size_t length; // bits
+    size_t position;
+} bit_reader_t;
+
+/**
+ * \return the next 'n' bits, zeros past the end: a damaged block decodes to garbage but is never read past its end
+ */
+static uint64_t get_bits(bit_reader_t* reader, unsigned n) {
+    uint64_t value = 0;
+    while (n > 0) {
+        if (reader->position >= reader->length)
+            return n < 64 ? value << n : 0;
+        unsigned offset = reader->position % 8;
+        unsigned take = 8 - offset < n ? 8 - offset : n;
+        uint8_t bits = (reader->bits[reader->position / 8] >> (8 - offset - take)) & ((1u << take) - 1);
+        value = (value << take) | bits;
+        reader->position += take;
+        n -= take;
+    }
+    return value;
+}
+
+static int64_t sign_extend(uint64_t value, unsigned bits) {
+    uint64_t sign = 1ull << (bits - 1);
+    return (int64_t) ((value ^ sign) - sign);
+}
+
+static bool fits(int64_t value, unsigned bits) {
+    return value >= -(1ll << (bits - 1)) && value < (1ll << (bits - 1));
+}
+
+static uint64_t value_bits(sensor_value_t value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static void encode_timestamp(series_t* series, sensor_ts_t ts) {
+    int64_t delta = ts - series->prev_ts;
+    int64_t delta_of_delta = delta - series->prev_delta;
+    if (delta_of_delta == 0) {
+        put_bits(series, 0x0, 1);
+    } else if (fits(delta_of_delta, 7)) {
+        put_bits(series, 0x2, 2);
+        put_bits(series, delta_of_delta, 7);
+    } else if (fits(delta_of_delta, 9)) {
+        put_bits(series, 0x6, 3);
+        put_bits(series, delta_of_delta, 9);
+    } else if (fits(delta_of_delta, 12)) {
+        put_bits(series, 0xe, 4);
+        put_bits(series, delta_of_delta, 12);
+    } else {
+        put_bits(series, 0xf, 4);
+        put_bits(series, delta_of_delta, 64);
+    }
+    series->prev_delta = delta;
+    series->prev_ts = ts;
+}
+
+static void encode_value(series_t* series, uint64_t value) {
+    uint64_t xor = value ^ series->prev_value;
+    series->prev_value = value;
+    if (xor == 0) {
+        put_bits(series, 0x0, 1);
+        return;
+    }
+    unsigned leading = __builtin_clzll(xor);
+    unsigned trailing = __builtin_ctzll(xor);
+    // the leading zeros have 5 bits
+    if (leading > 31)
+        leading = 31;
+    if (series->leading != NO_WINDOW && leading >= series->leading && trailing >= series->trailing) {
+        put_bits(series, 0x2, 2);
+        put_bits(series, xor >> series->trailing, 64 - series->leading - series->trailing);
+        return;
+    }
+    unsigned length = 64 - leading - trailing;
+    put_bits(series, 0x3, 2);
+    put_bits(series, leading, 5);
+    put_bits(series, length - 1, 6);
+    put_bits(series, xor >> trailing, length);
+    series->leading = leading;
+    series->trailing = trailing;
+}
+
+/**
+ * Moves the open block of 'series' to the sealed blocks that wait for tsdb_flush
+ */
+static void seal(tsdb_t* db, series_t* series) {
+    assert(series->count > 0);
+    size_t payload = (series->length + 7) / 8;
+    uint64_t offset = db->data_size + db->data_used;
+
+    reserve(&db->data, &db->data_capacity, db->data_used + BLOCK_HEADER_SIZE + payload);
+    uint8_t* out = db->data + db->data_used;
+    put_le(out, series->id, 2);
+    put_le(out + 2, series->count, 2);
+    put_le(out + 4, payload, 4);
+    memcpy(out + BLOCK_HEADER_SIZE, series->bits, payload);
+    db->data_used += BLOCK_HEADER_SIZE + payload;
+
+    reserve(&db->index, &db->index_capacity, db->index_used + INDEX_ENTRY_SIZE);
+    out = db->index + db->index_used;
+    put_le(out, offset, 8);
+    put_le(out + 8, series->first_ts, 8);
+    put_le(out + 16, series->prev_ts, 8);
+    put_le(out + 24, series->id, 2);
+    put_le(out + 26, series->count, 2);
+    put_le(out + 28, BLOCK_HEADER_SIZE + payload, 4);
+    db->index_used += INDEX_ENTRY_SIZE;
+
+    db->sealed_readings += series->count;
+    db->sealed_blocks++;
+
+    // the buffer is kept for the next block of this sensor
+    memset(series->bits, 0, payload);
+    series->length = 0;
+    series->count = 0;
+    if (series->older != NULL)
+        series->older->newer = series->newer;
+    else
+        db->oldest = series->newer;
+    if (series->newer != NULL)
+        series->newer->older = series->older;
+    else
+        db->newest = series->older;
+    series->older = series->newer = NULL;
+}
+
+tsdb_t* tsdb_open(const char* path, bool truncate, const tsdb_config_t* config) {
+    assert(path && config);
+    assert(config->block_readings > 0 && config->block_readings <= TSDB_MAX_BLOCK_READINGS);
+    tsdb_t* db = calloc(1, sizeof(*db));
+    assert(db != NULL);
+    db->config = *config;
+    char* index_path = NULL;
+    ASSERT_ELSE_PERROR(asprintf(&index_path, "%s.idx", path) > 0);
+    int flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (truncate ? O_TRUNC : 0);
+    db->data_fd = open(path, flags, 0644);
+    db->index_fd = open(index_path, flags, 0644);
+    free(index_path);
+    struct stat data_stat, index_stat;
+    if (db->data_fd < 0 || db->index_fd < 0 || fstat(db->data_fd, &data_stat) != 0 || fstat(db->index_fd, &index_stat) != 0) {
+        int error = errno;
+        if (db->data_fd >= 0)
+            close(db->data_fd);
+        if (db->index_fd >= 0)
+            close(db->index_fd);
+        free(db);
+        errno = error;
+        return NULL;
+    }
+    db->data_size = data_stat.st_size;
+    // an index entry that was cut off by a crash is dropped, the next ones line up again
+    db->index_size = index_stat.st_size - index_stat.st_size % INDEX_ENTRY_SIZE;
+    if (db->index_size != (uint64_t) index_stat.st_size)
+        ASSERT_ELSE_PERROR(ftruncate(db->index_fd, db->index_size) == 0);
+    return db;
+}
+
+int tsdb_close(tsdb_t* db, tsdb_stats_t* stats) {
+    assert(db);
+    while (db->oldest != NULL)
+        seal(db, db->oldest);
+    int result = tsdb_flush(db, true);
+    if (stats != NULL)
+        *stats = db->stats;
+    close(db->data_fd);
+    close(db->index_fd);
+    for (size_t i = 0; i <= UINT16_MAX; i++) {
+        if (db->series[i] != NULL) {
+            free(db->series[i]->bits);
+            free(db->series[i]);
+        }
+    }
+    free(db->data);
+    free(db->index);
+    free(db);
+    return result;
+}
+
+void tsdb_append(tsdb_t* db, sensor_id_t id, sensor_value_t value, sensor_ts_t ts) {
+    assert(db);
+    series_t* series = db->series[id];
+    if (series == NULL) {
+        series = calloc(1, sizeof(*series));
+        assert(series != NULL);
+        series->id = id;
+        db->series[id] = series;
+    }
+    if (series->count == 0) {
+        // a new block starts from scratch, so it can be decoded on its own
+        put_bits(series, ts, 64);
+        put_bits(series, value_bits(value), 64);
+        series->first_ts = series->prev_ts = ts;
+        series->prev_delta = 0;
+        series->prev_value = value_bits(value);
+        series->leading = NO_WINDOW;
+        series->trailing = 0;
+        series->opened_at = now_ms();
+        series->older = db->newest;
+        if (db->newest != NULL)
+            db->newest->newer = series;
+        else
+            db->oldest = series;
+        db->newest = series;
+    } else {
+        encode_timestamp(series, ts);
+        encode_value(series, value_bits(value));
+    }
+    if (++series->count == db->config.block_readings)
+        seal(db, series);
+}
+
+static bool write_all(int fd, const uint8_t* buffer, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, buffer, size);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buffer += written;
+        size -= written;
+    }
+    return true;
+}
+
+int tsdb_flush(tsdb_t* db, bool sync) {
+    assert(db);
+    uint64_t now = now_ms();
+    while (db->oldest != NULL && now - db->oldest->opened_at >= db->config.block_age_ms)
+        seal(db, db->oldest);
+    if (db->data_used == 0)
+        return 0;
+    // the data goes first, so an index entry on disk never points past the data
+    if (!write_all(db->data_fd, db->data, db->data_used) || !write_all(db->index_fd, db->index, db->index_used) ||
+        (sync && (fdatasync(db->data_fd) != 0 || fdatasync(db->index_fd) != 0))) {
+        // cut off what made it to the files, the offsets in the sealed blocks only hold at the old sizes
+        int error = errno;
+        if (ftruncate(db->data_fd, db->data_size) != 0 || ftruncate(db->index_fd, db->index_size) != 0)
+            perror("tsdb could not undo a failed flush");
+        errno = error;
+        return 1;
+    }
+    db->data_size += db->data_used;
+    db->index_size += db->index_used;
+    db->stats.readings += db->sealed_readings;
+    db->stats.blocks += db->sealed_blocks;
+    db->stats.data_bytes += db->data_used;
+    db->stats.index_bytes += db->index_used;
+    db->data_used = 0;
+    db->index_used = 0;
+    db->sealed_readings = 0;
+    db->sealed_blocks = 0;
+    return 0;
+}
+
+size_t tsdb_sealed_readings(const tsdb_t* db) {
+    assert(db);
+    return db->sealed_readings;
+}
+
+int tsdb_seal_timeout(const tsdb_t* db) {
+    assert(db);
+    if (db->oldest == NULL)
+        return -1;
+    uint64_t deadline = db->oldest->opened_at + db->config.block_age_ms;
+    uint64_t now = now_ms();
+    return deadline > now ? (int) (deadline - now) : 0;
+}
+
+void tsdb_get_stats(const tsdb_t* db, tsdb_stats_t* stats) {
+    assert(db && stats);
+    *stats = db->stats;
+}
+
+// result of decode_block
+enum {
+    DECODE_DONE,
+    DECODE_STOPPED, // the callback asked to stop
+    DECODE_CORRUPT, // a value header that can not have been written, the rest of the block is not read
+};
+
+/**
+ * Decodes one block and passes the readings in [from, to] to 'callback', counting them in 'found'
+ * \return DECODE_DONE, DECODE_STOPPED or DECODE_CORRUPT
+ */
+static int decode_block(const uint8_t* payload, size_t size, sensor_id_t id, unsigned count, sensor_ts_t from, sensor_ts_t to,
+                         tsdb_callback_t callback, void* arg, int64_t* found) {
+    bit_reader_t reader = {.bits = payload, .length = size * 8};
+    sensor_ts_t ts = (sensor_ts_t) get_bits(&reader, 64);
+    uint64_t value = get_bits(&reader, 64);
+    int64_t delta = 0;
+    unsigned leading = NO_WINDOW, trailing = 0;
+    for (unsigned i = 0; i < count; i++) {
+        if (i > 0) {
+            // the timestamp: count the 1 bits of the prefix
+            unsigned prefix = 0;
+            while (prefix < 4 && get_bits(&reader, 1) == 1)
+                prefix++;
+            static const unsigned widths[] = {0, 7, 9, 12, 64};
+            if (prefix > 0)
+                delta += sign_extend(get_bits(&reader, widths[prefix]), widths[prefix]);
+            ts += delta;
+            // the value
+            if (get_bits(&reader, 1) == 1) {
+                if (get_bits(&reader, 1) == 1) {
+                    leading = get_bits(&reader, 5);
+                    unsigned length = get_bits(&reader, 6) + 1;
+                    if (leading + length > 64)
+                        return DECODE_CORRUPT;
+                    trailing = 64 - leading - length;
+                }
+                unsigned length = 64 - leading - trailing;
+                value ^= get_bits(&reader, length) << trailing;
+            }
+        }
+        if (ts >= from && ts <= to) {
+            sensor_value_t decoded;
+            memcpy(&decoded, &value, sizeof(decoded));
+            (*found)++;
+            if (!callback(arg, id, decoded, ts))
+                return DECODE_STOPPED;
+        }
+    }
+    return DECODE_DONE;
+}
+
+int64_t tsdb_query(const char* path, int id, sensor_ts_t from, sensor_ts_t to, tsdb_callback_t callback, void* arg) {
+    assert(path && callback);
+    char* index_path = NULL;
+    ASSERT_ELSE_PERROR(asprintf(&index_path, "%s.idx", path) > 0);
+    FILE* index = fopen(index_path, "r");
+    free(index_path);
+    int data_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (index == NULL || data_fd < 0) {
+        if (index != NULL)
+            fclose(index);
+        if (data_fd >= 0)
+            close(data_fd);
+        return -1;
+    }
+
+    int64_t total = 0;
+    uint8_t* block = NULL;
+    size_t block_capacity = 0;
+    uint8_t entry[INDEX_ENTRY_SIZE];
+    while (fread(entry, sizeof(entry), 1, index) == 1) {
+        uint64_t offset = get_le(entry, 8);
+        sensor_ts_t first_ts = (sensor_ts_t) get_le(entry + 8, 8);
+        sensor_ts_t last_ts = (sensor_ts_t) get_le(entry + 16, 8);
+        sensor_id_t block_id = get_le(entry + 24, 2);
+        unsigned count = get_le(entry + 26, 2);
+        size_t size = get_le(entry + 28, 4);
+        // the index answers most of the query: the block is only read if it can hold a match
+        if ((id != TSDB_ALL_SENSORS && block_id != id) || last_ts < from || first_ts > to || size < BLOCK_HEADER_SIZE)
+            continue;
+        if (size > block_capacity) {
+            block = realloc(block, size);
+            assert(block != NULL);
+            block_capacity = size;
+        }
+        if (pread(data_fd, block, size, offset) != (ssize_t) size || get_le(block, 2) != block_id || get_le(block + 2, 2) != count ||
+            get_le(block + 4, 4) != size - BLOCK_HEADER_SIZE)
+            continue;
+        if (decode_block(block + BLOCK_HEADER_SIZE, size - BLOCK_HEADER_SIZE, block_id, count, from, to, callback, arg, &total) == DECODE_STOPPED)
+            break;
+    }
+    free(block);
+    fclose(index);
+    close(data_fd);
+    return total;
+}
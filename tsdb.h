@@ -0,0 +1,110 @@
+#pragma once
+
+/**
+ * Append-only, compressed time series storage for sensor readings.
+ *
+ * The readings of every sensor are collected in a block of their own. A block is sealed when it holds
+ * 'block_readings' readings or its first reading is 'block_age_ms' old, and tsdb_flush appends the sealed blocks
+ * to the data file and one entry per block to the index file. Nothing is ever rewritten.
+ *
+ * Within a block the readings are compressed like Gorilla (Pelkonen et al., VLDB 2015), as one bit stream:
+ *   the first timestamp and value in full (64 bits each), then per reading
+ *   - the delta of the timestamp delta:  '0' for 0, '10' + 7 bits, '110' + 9 bits, '1110' + 12 bits or '1111' + 64 bits
+ *   - the value XOR the previous value:  '0' if equal, '10' + the meaningful bits if they fit in the previous
+ *     window of leading and trailing zeros, otherwise '11' + 5 bits leading zeros + 6 bits length - 1 + the meaningful bits
+ * Readings of a sensor that come once a second cost 1 bit for the timestamp, the value depends on how much it changes.
+ *
+ * Data file: blocks of <sensor id u16><count u16><payload size u32><payload>
+ * Index file: per block <offset u64><first timestamp i64><last timestamp i64><sensor id u16><count u16><size u32>
+ * All integers are little endian, the payload is a big endian bit stream.
+ * The index lets a query skip every block of other sensors or outside its time range without reading it.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// readings per block at most, the count is stored in 16 bits
+#define TSDB_MAX_BLOCK_READINGS 65535
+
+// a query for every sensor
+#define TSDB_ALL_SENSORS -1
+
+typedef struct tsdb tsdb_t;
+
+typedef struct {
+    unsigned block_readings; // seal a block once it holds this many readings
+    unsigned block_age_ms;   // seal a block at the latest this long after its first reading was added
+} tsdb_config_t;
+
+#define TSDB_DEFAULT_CONFIG            \
+    ((tsdb_config_t){                  \
+        .block_readings = 1024,        \
+        .block_age_ms = 10000,         \
+    })
+
+typedef struct {
+    uint64_t readings;    // readings written out
+    uint64_t blocks;      // blocks written out
+    uint64_t data_bytes;  // bytes appended to the data file
+    uint64_t index_bytes; // bytes appended to the index file
+} tsdb_stats_t;
+
+/**
+ * Called for every reading a query finds, blocks in the order they were written, readings in the order they were added
+ * \return false to stop the query
+ */
+typedef bool (*tsdb_callback_t)(void* arg, sensor_id_t id, sensor_value_t value, sensor_ts_t ts);
+
+/**
+ * Opens (and creates) the data file 'path' and the index file 'path'.idx to append to
+ * \param truncate throw away what the files hold
+ * \return the store, or NULL if a file can not be opened (errno tells why)
+ */
+tsdb_t* tsdb_open(const char* path, bool truncate, const tsdb_config_t* config);
+
+/**
+ * Seals all blocks, writes them out, syncs both files to disk and frees the store
+ * \param stats if not NULL, filled out with the totals since tsdb_open
+ * \return zero for success, and non-zero if an error occurs
+ */
+int tsdb_close(tsdb_t* db, tsdb_stats_t* stats);
+
+/**
+ * Adds a reading to the open block of its sensor, sealing the block if it is full
+ * Only touches memory
+ */
+void tsdb_append(tsdb_t* db, sensor_id_t id, sensor_value_t value, sensor_ts_t ts);
+
+/**
+ * Seals the blocks that are old enough and appends all sealed blocks to the files with one write per file
+ * \param sync wait until both files are on disk
+ * \return zero for success, and non-zero if an error occurs (the blocks are kept for the next flush then)
+ */
+int tsdb_flush(tsdb_t* db, bool sync);
+
+/**
+ * \return the number of readings in sealed blocks that are not written out yet
+ */
+size_t tsdb_sealed_readings(const tsdb_t* db);
+
+/**
+ * \return the milliseconds until the oldest open block has to be sealed, 0 if it is due, or -1 if no block is open
+ */
+int tsdb_seal_timeout(const tsdb_t* db);
+
+void tsdb_get_stats(const tsdb_t* db, tsdb_stats_t* stats);
+
+/**
+ * Reads back the readings of sensor 'id' (or TSDB_ALL_SENSORS) with a timestamp in [from, to] from the files of 'path'
+ * Only written out blocks are found. A block that is cut off or does not match its index entry is skipped,
+ * a block with bits that can not have been written is read up to the damage.
+ * \return the number of readings passed to 'callback', or -1 if a file can not be read
+ */
+int64_t tsdb_query(const char* path, int id, sensor_ts_t from, sensor_ts_t to, tsdb_callback_t callback, void* arg);
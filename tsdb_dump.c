@@ -0,0 +1,61 @@
+/**
+ * Prints the readings in a time series store written by the server with -e tsdb, one per line:
+ * <sensor id> <value> <timestamp>
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "tsdb.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static int print_usage() {
+    printf("Usage: <command> [-s sensor id] [-f from timestamp] [-t to timestamp] <tsdb file> \n");
+    return -1;
+}
+
+static bool print_reading(void* arg, sensor_id_t id, sensor_value_t value, sensor_ts_t ts) {
+    (void) arg;
+    printf("%" PRIu16 " %g %ld\n", id, value, (long int) ts);
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    int id = TSDB_ALL_SENSORS;
+    sensor_ts_t from = INT64_MIN;
+    sensor_ts_t to = INT64_MAX;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:f:t:")) != -1) {
+        switch (opt) {
+        case 's':
+            id = atoi(optarg);
+            if (id < 0 || id > UINT16_MAX)
+                return print_usage();
+            break;
+        case 'f':
+            from = strtoll(optarg, NULL, 10);
+            break;
+        case 't':
+            to = strtoll(optarg, NULL, 10);
+            break;
+        default:
+            return print_usage();
+        }
+    }
+    if (argc - optind != 1)
+        return print_usage();
+
+    int64_t count = tsdb_query(argv[optind], id, from, to, print_reading, NULL);
+    if (count < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    fprintf(stderr, "%" PRId64 " readings\n", count);
+    return 0;
+}
@@ -0,0 +1,260 @@
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "uring.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// the kernel reads and writes the ring indices concurrently, only the owner side may use plain accesses
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int sys_setup(unsigned entries, struct io_uring_params* params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(uring_t* ring, unsigned entries) {
+    assert(ring && entries > 0);
+    memset(ring, 0, sizeof(*ring));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // completions are only reaped right after io_uring_enter, the kernel does not need to interrupt the thread for them
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = entries * 4;
+    int fd = sys_setup(entries, &params);
+    if (fd < 0 && errno == EINVAL) {
+        // older kernels don't know the last two flags
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+        fd = sys_setup(entries, &params);
+    }
+    if (fd < 0)
+        return -errno;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+        close(fd);
+        return -ENOSYS;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->ring_ptr == MAP_FAILED) {
+        int error = errno;
+        close(fd);
+        return -error;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        int error = errno;
+        munmap(ring->ring_ptr, ring->ring_size);
+        close(fd);
+        return -error;
+    }
+
+    uint8_t* ptr = ring->ring_ptr;
+    ring->fd = fd;
+    ring->features = params.features;
+    ring->sq_head = (unsigned*) (ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned*) (ptr + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*) (ptr + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_array = (unsigned*) (ptr + params.sq_off.array);
+    ring->cq_head = (unsigned*) (ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned*) (ptr + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*) (ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (ptr + params.cq_off.cqes);
+    // slot i of the queue always uses sqe i
+    for (unsigned i = 0; i < ring->sq_entries; i++)
+        ring->sq_array[i] = i;
+    return 0;
+}
+
+void uring_exit(uring_t* ring) {
+    assert(ring);
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->ring_ptr, ring->ring_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+bool uring_supported(void) {
+    uring_t ring;
+    if (uring_init(&ring, 4) != 0)
+        return false;
+    uring_buffers_t buffers;
+    if (uring_buffers_init(&ring, &buffers, 0, 1, 16) != 0) {
+        uring_exit(&ring);
+        return false;
+    }
+    // multishot recv is the newest feature we need, older kernels reject it with -EINVAL
+    bool supported = false;
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0) {
+        uring_prep_multishot_recv(uring_get_sqe(&ring), pair[0], 0, 1);
+        if (write(pair[1], "", 1) == 1 && uring_submit_and_wait(&ring, 1) >= 0) {
+            struct io_uring_cqe* cqe;
+            if (uring_peek_batch(&ring, &cqe, 1) == 1) {
+                supported = cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE);
+                uring_cq_advance(&ring, 1);
+            }
+        }
+        close(pair[0]);
+        close(pair[1]);
+    }
+    // the buffers may only go away once the ring is gone
+    uring_exit(&ring);
+    uring_buffers_free(&ring, &buffers);
+    return supported;
+}
+
+struct io_uring_sqe* uring_get_sqe(uring_t* ring) {
+    assert(ring);
+    unsigned tail = *ring->sq_tail + ring->sq_pending;
+    if (tail - load_acquire(ring->sq_head) >= ring->sq_entries) {
+        uring_submit_and_wait(ring, 0);
+        tail = *ring->sq_tail + ring->sq_pending;
+        assert(tail - load_acquire(ring->sq_head) < ring->sq_entries);
+    }
+    struct io_uring_sqe* sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_pending++;
+    return sqe;
+}
+
+int uring_submit_and_wait(uring_t* ring, unsigned wait_nr) {
+    assert(ring);
+    unsigned tail = *ring->sq_tail + ring->sq_pending;
+    store_release(ring->sq_tail, tail);
+    ring->sq_pending = 0;
+    // also resubmits what the kernel did not take the previous time
+    unsigned to_submit = tail - load_acquire(ring->sq_head);
+    int ret = sys_enter(ring->fd, to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+    return ret < 0 ? -errno : ret;
+}
+
+unsigned uring_peek_batch(uring_t* ring, struct io_uring_cqe** cqes, unsigned max) {
+    assert(ring && cqes);
+    unsigned head = *ring->cq_head;
+    unsigned available = load_acquire(ring->cq_tail) - head;
+    unsigned count = available < max ? available : max;
+    for (unsigned i = 0; i < count; i++)
+        cqes[i] = &ring->cqes[(head + i) & ring->cq_mask];
+    return count;
+}
+
+void uring_cq_advance(uring_t* ring, unsigned count) {
+    assert(ring);
+    store_release(ring->cq_head, *ring->cq_head + count);
+}
+
+void uring_prep_multishot_accept(struct io_uring_sqe* sqe, int fd, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_multishot_recv(struct io_uring_sqe* sqe, int fd, uint16_t group, uint64_t user_data) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_multishot_poll(struct io_uring_sqe* sqe, int fd, unsigned events, uint64_t user_data) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_timeout(struct io_uring_sqe* sqe, struct __kernel_timespec* ts, uint64_t user_data) {
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t) (uintptr_t) ts;
+    sqe->len = 1;
+    sqe->user_data = user_data;
+}
+
+int uring_buffers_init(uring_t* ring, uring_buffers_t* buffers, uint16_t group, unsigned entries, unsigned buffer_size) {
+    assert(ring && buffers && entries > 0 && (entries & (entries - 1)) == 0 && entries <= 32768);
+    memset(buffers, 0, sizeof(*buffers));
+    buffers->entries = entries;
+    buffers->buffer_size = buffer_size;
+    buffers->group = group;
+    // the ring has to be page aligned
+    buffers->ring_size = entries * sizeof(struct io_uring_buf);
+    buffers->ring = mmap(NULL, buffers->ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers->ring == MAP_FAILED)
+        return -errno;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) buffers->ring;
+    reg.ring_entries = entries;
+    reg.bgid = group;
+    if (sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        int error = errno;
+        munmap(buffers->ring, buffers->ring_size);
+        return -error;
+    }
+
+    buffers->buffers = mmap(NULL, (size_t) entries * buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers->buffers == MAP_FAILED) {
+        int error = errno;
+        struct io_uring_buf_reg unreg = {.bgid = group};
+        sys_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &unreg, 1);
+        munmap(buffers->ring, buffers->ring_size);
+        return -error;
+    }
+    for (unsigned i = 0; i < entries; i++)
+        uring_buffer_recycle(buffers, i);
+    return 0;
+}
+
+void uring_buffers_free(uring_t* ring, uring_buffers_t* buffers) {
+    assert(ring && buffers);
+    if (ring->fd >= 0) {
+        struct io_uring_buf_reg unreg = {.bgid = buffers->group};
+        sys_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &unreg, 1);
+    }
+    munmap(buffers->buffers, (size_t) buffers->entries * buffers->buffer_size);
+    munmap(buffers->ring, buffers->ring_size);
+}
+
+uint8_t* uring_buffer(uring_buffers_t* buffers, uint16_t id) {
+    assert(buffers && id < buffers->entries);
+    return buffers->buffers + (size_t) id * buffers->buffer_size;
+}
+
+void uring_buffer_recycle(uring_buffers_t* buffers, uint16_t id) {
+    assert(buffers && id < buffers->entries);
+    struct io_uring_buf* buf = &buffers->ring->bufs[buffers->tail & (buffers->entries - 1)];
+    buf->addr = (uint64_t) (uintptr_t) uring_buffer(buffers, id);
+    buf->len = buffers->buffer_size;
+    buf->bid = id;
+    buffers->tail++;
+    // the kernel only looks at a buffer once the tail says it is there
+    store_release(&buffers->ring->tail, buffers->tail);
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+/**
+ * Minimal io_uring wrapper on top of the raw system calls, only what the connection manager needs:
+ * a submission and completion queue, multishot accept, recv and poll, timeouts and provided buffer rings.
+ * Not thread safe: one ring per thread.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    int fd;
+    unsigned features;
+    // submission queue, shared with the kernel
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned sq_pending; // sqes handed out but not submitted yet
+    // completion queue, shared with the kernel
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    // mappings
+    void* ring_ptr;
+    size_t ring_size;
+    size_t sqes_size;
+} uring_t;
+
+/**
+ * A ring of equally sized buffers the kernel picks from when a recv completes (IOSQE_BUFFER_SELECT)
+ */
+typedef struct {
+    struct io_uring_buf_ring* ring;
+    uint8_t* buffers;
+    size_t ring_size;
+    unsigned entries; // a power of two
+    unsigned buffer_size;
+    uint16_t group;
+    uint16_t tail; // buffers handed to the kernel so far, wraps around
+} uring_buffers_t;
+
+/**
+ * Sets up a ring with 'entries' submission slots and four times as many completion slots
+ * \return 0, or a negative errno if the kernel has no (usable) io_uring
+ */
+int uring_init(uring_t* ring, unsigned entries);
+
+/**
+ * Tears the ring down, the kernel cancels everything that is still in flight
+ */
+void uring_exit(uring_t* ring);
+
+/**
+ * \return true if the kernel supports everything the connection manager uses: multishot accept, multishot recv and provided buffer rings
+ */
+bool uring_supported(void);
+
+/**
+ * \return a cleared submission slot, submitting the pending ones first if the queue is full
+ */
+struct io_uring_sqe* uring_get_sqe(uring_t* ring);
+
+/**
+ * Submits the pending submissions and waits until at least 'wait_nr' completions are available
+ * \return the number of submissions consumed, or a negative errno (-EINTR when interrupted by a signal)
+ */
+int uring_submit_and_wait(uring_t* ring, unsigned wait_nr);
+
+/**
+ * Points 'cqes' at the completions that are available, without waiting
+ * \return the number of completions, hand them back with uring_cq_advance
+ */
+unsigned uring_peek_batch(uring_t* ring, struct io_uring_cqe** cqes, unsigned max);
+
+/**
+ * Hands 'count' completions returned by uring_peek_batch back to the kernel
+ */
+void uring_cq_advance(uring_t* ring, unsigned count);
+
+void uring_prep_multishot_accept(struct io_uring_sqe* sqe, int fd, uint64_t user_data);
+
+/**
+ * Receives into buffers from 'group' for as long as the connection is open, every completion tells which buffer it used
+ */
+void uring_prep_multishot_recv(struct io_uring_sqe* sqe, int fd, uint16_t group, uint64_t user_data);
+
+/**
+ * Completes every time 'fd' becomes ready for 'events' (POLLIN, ...) until it is cancelled, edge triggered like EPOLLET
+ */
+void uring_prep_multishot_poll(struct io_uring_sqe* sqe, int fd, unsigned events, uint64_t user_data);
+
+/**
+ * Completes with -ETIME after 'ts', which has to stay valid until the submission
+ */
+void uring_prep_timeout(struct io_uring_sqe* sqe, struct __kernel_timespec* ts, uint64_t user_data);
+
+/**
+ * Allocates 'entries' buffers of 'buffer_size' bytes and registers them as buffer group 'group'
+ * \return 0, or a negative errno
+ */
+int uring_buffers_init(uring_t* ring, uring_buffers_t* buffers, uint16_t group, unsigned entries, unsigned buffer_size);
+
+void uring_buffers_free(uring_t* ring, uring_buffers_t* buffers);
+
+/**
+ * \return the start of buffer 'id'
+ */
+uint8_t* uring_buffer(uring_buffers_t* buffers, uint16_t id);
+
+/**
+ * Gives buffer 'id' back to the kernel once its data has been handled
+ */
+void uring_buffer_recycle(uring_buffers_t* buffers, uint16_t id);